@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive_index.h"
+
+#define MAX_MSG_LEN (PATH_MAX + 64)     // Room for an index path and the message around it
+
+/*
+ * Reads a 0-padded octal header field, stopping at the first character that
+ * isn't an octal digit
+ */
+static int64_t parse_octal(const char *field, int len) {
+    int64_t value = 0;
+    int i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+// Writes the name of the index kept next to 'archive_name' into 'path'
+// Returns 0 on success or -1 if the name is too long
+static int index_path(char *path, const char *archive_name) {
+    if (snprintf(path, PATH_MAX, "%s%s", archive_name, INDEX_SUFFIX) >= PATH_MAX) {
+        fprintf(stderr, "Archive name %s is too long\n", archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+void archive_index_init(archive_index_t *index) {
+    index->entries = NULL;
+    index->n_entries = 0;
+    index->capacity = 0;
+    index->by_name = NULL;
+}
+
+int archive_index_add(archive_index_t *index, const tar_header *header, off_t offset) {
+    free(index->by_name);
+    index->by_name = NULL;
+
+    if (index->n_entries == index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : 64;
+        index_entry_t *entries = realloc(index->entries, capacity * sizeof(index_entry_t));
+        if (entries == NULL) {
+            perror("Failed to grow archive index");
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+
+    index_entry_t *entry = &index->entries[index->n_entries++];
+    memset(entry, 0, sizeof(index_entry_t));
+    memcpy(entry->name, header->name, sizeof(entry->name));
+    entry->offset = offset;
+    entry->size = parse_octal(header->size, sizeof(header->size));
+    entry->mtime = parse_octal(header->mtime, sizeof(header->mtime));
+    entry->checksum = parse_octal(header->chksum, sizeof(header->chksum));
+    return 0;
+}
+
+int archive_index_scan(archive_index_t *index, const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+
+    int fd = open(archive_name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+
+    // Only header blocks are read; the contents are seeked over
+    off_t offset = 0;
+    tar_header header;
+    while (1) {
+        ssize_t bytes = pread(fd, &header, BLOCK_SIZE, offset);
+        if (bytes < BLOCK_SIZE) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", archive_name);
+            perror(err_msg);
+            close(fd);
+            return -1;
+        }
+
+        if (header.name[0] == '\0')
+            break;
+
+        if (archive_index_add(index, &header, offset)) {
+            close(fd);
+            return -1;
+        }
+        int64_t size = index->entries[index->n_entries - 1].size;
+        offset += BLOCK_SIZE + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int archive_index_load(archive_index_t *index, const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+    char path[PATH_MAX];
+    if (index_path(path, archive_name))
+        return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return 1;
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", path);
+        perror(err_msg);
+        return -1;
+    }
+
+    // Only an index written for the archive as it is now can be trusted
+    index_file_header_t file_header;
+    struct stat archive_stat;
+    struct stat index_stat;
+    if (read(fd, &file_header, sizeof(file_header)) != sizeof(file_header) ||
+        memcmp(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic)) != 0 ||
+        stat(archive_name, &archive_stat) != 0 || fstat(fd, &index_stat) != 0 ||
+        file_header.archive_size != archive_stat.st_size ||
+        file_header.archive_mtime_sec != archive_stat.st_mtim.tv_sec ||
+        file_header.archive_mtime_nsec != archive_stat.st_mtim.tv_nsec ||
+        file_header.archive_ino != archive_stat.st_ino ||
+        file_header.n_entries > INT_MAX ||
+        index_stat.st_size != sizeof(file_header) + file_header.n_entries * sizeof(index_entry_t)) {
+        close(fd);
+        return 1;
+    }
+
+    // Every entry comes in with one read
+    size_t len = file_header.n_entries * sizeof(index_entry_t);
+    index_entry_t *entries = malloc(len > 0 ? len : 1);
+    if (entries == NULL) {
+        perror("Failed to allocate archive index");
+        close(fd);
+        return -1;
+    }
+    if (read(fd, entries, len) != len) {
+        free(entries);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    archive_index_clear(index);
+    index->entries = entries;
+    index->n_entries = file_header.n_entries;
+    index->capacity = file_header.n_entries;
+    return 0;
+}
+
+int archive_index_save(const archive_index_t *index, const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (index_path(path, archive_name))
+        return -1;
+    if (snprintf(tmp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        fprintf(stderr, "Archive name %s is too long\n", archive_name);
+        return -1;
+    }
+
+    struct stat archive_stat;
+    if (stat(archive_name, &archive_stat) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+
+    index_file_header_t file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic));
+    file_header.n_entries = index->n_entries;
+    file_header.archive_size = archive_stat.st_size;
+    file_header.archive_mtime_sec = archive_stat.st_mtim.tv_sec;
+    file_header.archive_mtime_nsec = archive_stat.st_mtim.tv_nsec;
+    file_header.archive_ino = archive_stat.st_ino;
+
+    // Written aside and renamed into place, so a reader never sees half an index
+    FILE *fh = fopen(tmp_path, "w");
+    if (fh == NULL) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", tmp_path);
+        perror(err_msg);
+        return -1;
+    }
+    if (fwrite(&file_header, sizeof(file_header), 1, fh) != 1 ||
+        fwrite(index->entries, sizeof(index_entry_t), index->n_entries, fh) != index->n_entries) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", tmp_path);
+        perror(err_msg);
+        fclose(fh);
+        unlink(tmp_path);
+        return -1;
+    }
+    if (fclose(fh) != 0 || rename(tmp_path, path) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", path);
+        perror(err_msg);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int archive_index_remove(const char *archive_name) {
+    char err_msg[MAX_MSG_LEN];
+    char path[PATH_MAX];
+    if (index_path(path, archive_name))
+        return -1;
+
+    if (unlink(path) != 0 && errno != ENOENT) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to remove file %s", path);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Orders entries by name, and versions of the same name by where they are in
+ * the archive
+ */
+static int compare_entry_names(const void *a, const void *b) {
+    const index_entry_t *entry1 = *(const index_entry_t **) a;
+    const index_entry_t *entry2 = *(const index_entry_t **) b;
+    int result = strncmp(entry1->name, entry2->name, sizeof(entry1->name));
+    if (result != 0)
+        return result;
+    return (entry1 > entry2) - (entry1 < entry2);
+}
+
+int archive_index_sort(archive_index_t *index) {
+    free(index->by_name);
+    index->by_name = malloc((index->n_entries > 0 ? index->n_entries : 1) *
+                            sizeof(index_entry_t *));
+    if (index->by_name == NULL) {
+        perror("Failed to sort archive index");
+        return -1;
+    }
+    for (int i = 0; i < index->n_entries; i++)
+        index->by_name[i] = &index->entries[i];
+    qsort(index->by_name, index->n_entries, sizeof(index_entry_t *), compare_entry_names);
+    return 0;
+}
+
+const index_entry_t *archive_index_find(const archive_index_t *index, const char *name) {
+    // A longer name would otherwise match a member sharing its first 100 bytes
+    size_t name_len = sizeof(index->entries->name);
+    if (strnlen(name, name_len + 1) > name_len)
+        return NULL;
+
+    // The latest version is the last of its name: find the first entry that
+    // sorts after 'name' and look at the one before it
+    int low = 0;
+    int high = index->n_entries;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strncmp(index->by_name[mid]->name, name, name_len) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low > 0 && strncmp(index->by_name[low - 1]->name, name, name_len) == 0)
+        return index->by_name[low - 1];
+    return NULL;
+}
+
+void archive_index_clear(archive_index_t *index) {
+    free(index->entries);
+    free(index->by_name);
+    archive_index_init(index);
+}
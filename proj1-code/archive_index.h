@@ -0,0 +1,103 @@
+#ifndef _ARCHIVE_INDEX_H
+#define _ARCHIVE_INDEX_H
+#include <stdint.h>
+
+#include "minitar.h"
+
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC "mtaridx1"
+
+// Where one member lies in an archive, with the header fields needed to
+// list it or decide whether it is current without reading the header
+typedef struct {
+    char name[100];         // As in the header: null-terminated unless 100 bytes long
+    uint32_t checksum;      // Of the header; fields are laid out to leave no padding
+    int64_t offset;         // Of the member's header block
+    int64_t size;
+    int64_t mtime;
+} index_entry_t;
+
+// Start of an index file, followed by 'n_entries' entries in archive order.
+// Both are stored as-is, in native byte order: the index is a cache of what
+// the archive's headers say, not an interchange format.
+// The archive's size, modification time and inode are recorded when the
+// index is written; should the archive change any other way (e.g. with
+// another tar), they no longer match and the index is ignored.
+typedef struct {
+    char magic[8];
+    uint64_t n_entries;
+    int64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t archive_ino;
+} index_file_header_t;
+
+// Every member of an archive, in archive order, so later versions of a
+// file come after earlier ones
+// Kept in a sidecar file named after the archive with INDEX_SUFFIX added,
+// which tar never looks at, so listing, update checks and extracting single
+// members take one read of the index and then direct seeks into the archive
+typedef struct {
+    index_entry_t *entries;
+    int n_entries;
+    int capacity;
+    // Every entry sorted by name, with versions of a name in archive order,
+    // once archive_index_sort() has been called; NULL after an entry is added
+    const index_entry_t **by_name;
+} archive_index_t;
+
+// Initialize a new, empty index
+void archive_index_init(archive_index_t *index);
+
+/*
+ * Add the member whose header is 'header', found at 'offset' in the archive
+ * Returns 0 on success or -1 if an error occurred
+ */
+int archive_index_add(archive_index_t *index, const tar_header *header, off_t offset);
+
+/*
+ * Build the index of the archive identified by 'archive_name' from its
+ * headers alone, skipping over the members' contents
+ * Returns 0 on success or -1 if an error occurred
+ */
+int archive_index_scan(archive_index_t *index, const char *archive_name);
+
+/*
+ * Read the index kept next to the archive identified by 'archive_name'
+ * Returns 0 if it was loaded, 1 if there is none or it no longer matches the
+ * archive, or -1 if an error occurred
+ */
+int archive_index_load(archive_index_t *index, const char *archive_name);
+
+/*
+ * Write the index next to the archive identified by 'archive_name',
+ * replacing any there, and record the archive's current state in it
+ * Returns 0 on success or -1 if an error occurred
+ */
+int archive_index_save(const archive_index_t *index, const char *archive_name);
+
+/*
+ * Delete the index kept next to the archive identified by 'archive_name', if any
+ * Returns 0 on success or -1 if an error occurred
+ */
+int archive_index_remove(const char *archive_name);
+
+/*
+ * Sort the index's entries by name, for archive_index_find()
+ * Returns 0 on success or -1 if an error occurred
+ */
+int archive_index_sort(archive_index_t *index);
+
+/*
+ * Find the most recently added member named 'name' with a binary search of
+ * the entries sorted by archive_index_sort(), which must have been called
+ * since the last one was added
+ * Returns the entry, or NULL if the archive has no such member or 'name' is
+ * too long to be stored in a header
+ */
+const index_entry_t *archive_index_find(const archive_index_t *index, const char *name);
+
+// Remove all entries from the index and free any memory associated with them
+void archive_index_clear(archive_index_t *index);
+
+#endif
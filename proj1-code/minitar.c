@@ -1,19 +1,90 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive_index.h"
 #include "minitar.h"
 
 #define NUM_TRAILING_BLOCKS 2
 #define BLOCK_SIZE 512
 #define MAX_MSG_LEN 512
+#define STREAM_CHUNK_SIZE (4 << 20) // Bytes gathered per write() to the archive
+#define STREAM_COPY_SIZE (8 << 20)  // Bytes asked of each copy_file_range()
+#define STREAM_ALIGN 4096
+#define STAGE_SIZE (1 << 20)        // Largest file a parallel worker reads in itself
+#define STAGE_SLOTS_PER_THREAD 2    // Members staged ahead of the writer, per worker
+#define MAX_STAGE_THREADS 64        // Most workers a parallel create starts
+
+// Output side of an archive being written. Headers, small files' contents
+// and padding are gathered into one aligned chunk and written a chunk at a
+// time; files of a chunk or more are copied in the kernel when possible.
+typedef struct {
+    int fd;
+    const char *archive_name;
+    char *buf;
+    size_t len;             // Bytes buffered but not yet written
+    off_t offset;           // Position in the archive of the next byte added
+    archive_index_t *index; // Gets an entry for every member added, or NULL
+    int use_copy_range;     // Cleared once copy_file_range() turns out unsupported
+} archive_writer_t;
+
+// Input side of an extraction: members' contents are read straight from
+// their offsets, so only the blocks of members being extracted are touched
+typedef struct {
+    int fd;
+    const char *archive_name;
+    char *buf;              // STREAM_CHUNK_SIZE bytes for copies through user space
+    int use_copy_range;     // Cleared once copy_file_range() turns out unsupported
+} archive_reader_t;
+
+// Whether create and append write an index next to the archive
+int index_archives = 0;
+
+// Where a member staged for the writer is
+typedef enum {
+    SLOT_PENDING,   // Still being prepared
+    SLOT_READY,
+    SLOT_FAILED,
+} slot_state_t;
+
+// One member prepared ahead of the writer by a worker: its header, and its
+// contents either read in already or left for the writer to stream
+typedef struct {
+    const char *file_name;
+    slot_state_t state;
+    tar_header header;
+    off_t size;
+    int fd;             // File to stream the contents from, or -1 if they are in 'data'
+    char *data;         // STAGE_SIZE bytes, allocated by the first worker to need it
+} stage_slot_t;
+
+// Shared state of a parallel create. Member i is staged in slot
+// i % n_slots, which its worker may only take once the writer is done with
+// member i - n_slots, so members are written in list order and at most
+// n_slots are held in memory at once.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // A slot has been staged
+    pthread_cond_t consumed;    // The writer has finished with a slot
+    node_t *next_file;          // First member not yet taken by a worker
+    int next_index;
+    int n_written;              // Members the writer is done with
+    int failed;                 // Set to make workers stop early
+    int n_slots;
+    stage_slot_t *slots;
+} stager_t;
 
 /*
  * Helper function to compute the checksum of a tar header block
@@ -31,50 +102,119 @@ void compute_checksum(tar_header *header) {
     snprintf(header->chksum, 8, "%07o", sum);
 }
 
+/*
+ * Reports a failed user or group lookup for 'file_name'. The reentrant
+ * lookups return their error, leaving errno alone, and succeed with no
+ * entry for an ID that has no name
+ */
+static void lookup_error(const char *what, const char *missing, const char *file_name,
+                         int result) {
+    fprintf(stderr, "Failed to look up %s name of file %s: %s\n", what, file_name,
+            result != 0 ? strerror(result) : missing);
+}
+
+/*
+ * Copies the name of the user 'uid' into 'name', of size 'len'. The
+ * reentrant lookup lets parallel creation build headers on many threads; its
+ * scratch buffer starts at the size the system suggests and grows until the
+ * entry fits.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int lookup_user_name(uid_t uid, char *name, size_t len, const char *file_name) {
+    long buf_len = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if (buf_len <= 0)
+        buf_len = 1024;
+
+    while (1) {
+        char *buf = malloc(buf_len);
+        if (buf == NULL) {
+            perror("malloc");
+            return -1;
+        }
+
+        struct passwd pwd_buf;
+        struct passwd *pwd = NULL;
+        int result = getpwuid_r(uid, &pwd_buf, buf, buf_len, &pwd);
+        if (result == ERANGE) {
+            free(buf);
+            buf_len *= 2;
+            continue;
+        }
+        if (result != 0 || pwd == NULL) {
+            lookup_error("owner", "no such user", file_name, result);
+            free(buf);
+            return -1;
+        }
+        strncpy(name, pwd->pw_name, len);
+        free(buf);
+        return 0;
+    }
+}
+
+/*
+ * Copies the name of the group 'gid' into 'name', of size 'len', like
+ * lookup_user_name(). Groups with many members need the buffer to grow.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int lookup_group_name(gid_t gid, char *name, size_t len, const char *file_name) {
+    long buf_len = sysconf(_SC_GETGR_R_SIZE_MAX);
+    if (buf_len <= 0)
+        buf_len = 1024;
+
+    while (1) {
+        char *buf = malloc(buf_len);
+        if (buf == NULL) {
+            perror("malloc");
+            return -1;
+        }
+
+        struct group grp_buf;
+        struct group *grp = NULL;
+        int result = getgrgid_r(gid, &grp_buf, buf, buf_len, &grp);
+        if (result == ERANGE) {
+            free(buf);
+            buf_len *= 2;
+            continue;
+        }
+        if (result != 0 || grp == NULL) {
+            lookup_error("group", "no such group", file_name, result);
+            free(buf);
+            return -1;
+        }
+        strncpy(name, grp->gr_name, len);
+        free(buf);
+        return 0;
+    }
+}
+
 /*
  * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * the file identified by 'file_name', as given by 'stat_buf'.
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf) {
     memset(header, 0, sizeof(tar_header));
-    char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
-        return -1;
-    }
 
     strncpy(header->name, file_name, 100); // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o", stat_buf.st_mode & 07777); // Permissions for file, 0-padded octal
+    snprintf(header->mode, 8, "%07o", stat_buf->st_mode & 07777); // Permissions for file, 0-padded octal
 
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid); // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid); // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
+    snprintf(header->uid, 8, "%07o", stat_buf->st_uid); // Owner ID of the file, 0-padded octal
+    // Owner name of the file, null-terminated string
+    if (lookup_user_name(stat_buf->st_uid, header->uname, 32, file_name) == -1)
         return -1;
-    }
-    strncpy(header->uname, pwd->pw_name, 32); // Owner  name of the file, null-terminated string
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid); // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid); // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
+    snprintf(header->gid, 8, "%07o", stat_buf->st_gid); // Group ID of the file, 0-padded octal
+    // Group name of the file, null-terminated string
+    if (lookup_group_name(stat_buf->st_gid, header->gname, 32, file_name) == -1)
         return -1;
-    }
-    strncpy(header->gname, grp->gr_name, 32); // Group name of the file, null-terminated string
 
-    snprintf(header->size, 12, "%011o", (unsigned)stat_buf.st_size); // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o", (unsigned)stat_buf.st_mtime); // Modification time, 0-padded octal
+    snprintf(header->size, 12, "%011o", (unsigned)stat_buf->st_size); // File size, 0-padded octal
+    snprintf(header->mtime, 12, "%011o", (unsigned)stat_buf->st_mtime); // Modification time, 0-padded octal
     header->typeflag = REGTYPE; // File type, always regular file in this project
     strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
     memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o", major(stat_buf.st_dev)); // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o", minor(stat_buf.st_dev)); // Minor device number, 0-padded octal
+    snprintf(header->devmajor, 8, "%07o", major(stat_buf->st_dev)); // Major device number, 0-padded octal
+    snprintf(header->devminor, 8, "%07o", minor(stat_buf->st_dev)); // Minor device number, 0-padded octal
 
     compute_checksum(header);
     return 0;
@@ -117,204 +257,585 @@ int remove_trailing_bytes(const char *file_name, size_t nbytes) {
     return 0;
 }
 
-int create_archive(const char *archive_name, const file_list_t *files) {
-    char err_msg[MAX_MSG_LEN];
+/*
+ * Writes all 'len' bytes of 'buf' to 'fd', retrying short writes
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = write(fd, buf, len);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
 
-    // open archive file
-    FILE *archive_fh = fopen(archive_name, "w");
-    if (archive_fh == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
-        perror(err_msg);
+/*
+ * Sets up 'writer' to stream members into the archive open as 'fd'
+ * offset: Where in the archive 'fd' is positioned
+ * index: Index to add the members to, or NULL
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_init(archive_writer_t *writer, int fd, const char *archive_name, off_t offset,
+                        archive_index_t *index) {
+    writer->fd = fd;
+    writer->archive_name = archive_name;
+    writer->len = 0;
+    writer->offset = offset;
+    writer->index = index;
+    writer->use_copy_range = 1;
+
+    // Page aligned, so reads into it can go straight to the page cache's pages
+    int result = posix_memalign((void **) &writer->buf, STREAM_ALIGN, STREAM_CHUNK_SIZE);
+    if (result) {
+        errno = result;
+        perror("Failed to allocate stream buffer");
         return -1;
     }
+    return 0;
+}
 
-    // write files to archive
-    char buffer[BLOCK_SIZE];
-    size_t bytes;
-    node_t *file = files->head;
-    while (file) {
+/*
+ * Writes out everything buffered in 'writer'
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_flush(archive_writer_t *writer) {
+    char err_msg[MAX_MSG_LEN];
+    if (write_all(writer->fd, writer->buf, writer->len) == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", writer->archive_name);
+        perror(err_msg);
+        return -1;
+    }
+    writer->len = 0;
+    return 0;
+}
 
-        // create header
-        tar_header header;
-        if (fill_tar_header(&header, file->name)) {
-            fclose(archive_fh);
+/*
+ * Appends 'len' bytes of 'data', or of zeroes if 'data' is NULL, to the archive
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_put(archive_writer_t *writer, const void *data, size_t len) {
+    while (len > 0) {
+        if (writer->len == STREAM_CHUNK_SIZE && archive_writer_flush(writer))
             return -1;
+
+        size_t n = STREAM_CHUNK_SIZE - writer->len;
+        if (n > len)
+            n = len;
+        if (data == NULL) {
+            memset(writer->buf + writer->len, 0, n);
+        } else {
+            memcpy(writer->buf + writer->len, data, n);
+            data = (const char *) data + n;
         }
+        writer->len += n;
+        writer->offset += n;
+        len -= n;
+    }
+    return 0;
+}
 
-        // write header
-        if (fwrite(&header, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
-            perror(err_msg);
-            fclose(archive_fh);
+/*
+ * Copies 'size' bytes of the file open as 'fd' into the archive, reading
+ * straight into the writer's buffer a chunk at a time
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_read_file(archive_writer_t *writer, int fd, const char *file_name, off_t size) {
+    char err_msg[MAX_MSG_LEN];
+    while (size > 0) {
+        if (writer->len == STREAM_CHUNK_SIZE && archive_writer_flush(writer))
             return -1;
-        }
 
-        // open file
-        FILE *fh = fopen(file->name, "r");
-        if (fh == NULL) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file->name);
+        size_t n = STREAM_CHUNK_SIZE - writer->len;
+        if (n > size)
+            n = size;
+        ssize_t bytes = read(fd, writer->buf + writer->len, n);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0) {
+            // The header already promised 'size' bytes
+            if (bytes == 0)
+                errno = EIO;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", file_name);
             perror(err_msg);
-            fclose(archive_fh);
             return -1;
         }
-
-        // write file contents
-        do {
-            // read block
-            bytes = fread(buffer, 1, BLOCK_SIZE, fh);
-            if (ferror(fh)) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", file->name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
-
-            if (bytes == 0)
-                break;
-
-            // fill in zeroes if needed
-            for (int i = bytes; i < BLOCK_SIZE; i++)
-                buffer[i] = 0;
-
-            // write block
-            if (fwrite(buffer, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
-        } while (bytes == BLOCK_SIZE);
-
-        fclose(fh);
-        file = file->next;
+        writer->len += bytes;
+        writer->offset += bytes;
+        size -= bytes;
     }
+    return 0;
+}
 
-    // write footer blocks
-    for (int i = 0; i < BLOCK_SIZE; i++)
-        buffer[i] = 0;
+/*
+ * Copies 'size' bytes of the file open as 'fd' into the archive in the
+ * kernel, with no copy through user space (or none at all, where the file
+ * system can share the blocks)
+ * Returns 0 on success, 1 if copy_file_range() can't be used for these files
+ * and nothing was copied, or -1 if an error occurs
+ */
+int archive_writer_copy_file(archive_writer_t *writer, int fd, const char *file_name, off_t size) {
+    char err_msg[MAX_MSG_LEN];
+    if (archive_writer_flush(writer))
+        return -1;
 
-    for (int i = 0; i < NUM_TRAILING_BLOCKS; i++) {
-        if (fwrite(buffer, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
+    off_t copied = 0;
+    while (copied < size) {
+        size_t n = size - copied < STREAM_COPY_SIZE ? size - copied : STREAM_COPY_SIZE;
+        ssize_t bytes = copy_file_range(fd, NULL, writer->fd, NULL, n, 0);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes == -1 && copied == 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+             errno == EBADF)) {
+            writer->use_copy_range = 0;
+            return 1;
+        }
+        if (bytes <= 0) {
+            if (bytes == 0)
+                errno = EIO;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to copy file %s", file_name);
             perror(err_msg);
-            fclose(archive_fh);
             return -1;
         }
+        copied += bytes;
+        writer->offset += bytes;
     }
-
-    fclose(archive_fh);
     return 0;
 }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+/*
+ * Opens the file identified by 'file_name' to be archived and builds its header
+ * size: Set to the number of bytes the header promises
+ * Returns the open file's descriptor or -1 if an error occurs
+ */
+int open_member(const char *file_name, tar_header *header, off_t *size) {
     char err_msg[MAX_MSG_LEN];
 
-    // remove footer blocks
-    if (remove_trailing_bytes(archive_name, BLOCK_SIZE * NUM_TRAILING_BLOCKS))
+    // open file
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
+        perror(err_msg);
         return -1;
+    }
 
-    // open archive
-    FILE *archive_fh = fopen(archive_name, "a");
-    if (archive_fh == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
+    // The header describes the file that is read, even if it is replaced meanwhile
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
         perror(err_msg);
+        close(fd);
         return -1;
     }
 
-    // seek to end of file
-    if (fseek(archive_fh, 0, SEEK_END)) {
-        snprintf(err_msg, MAX_MSG_LEN, "Error reading from file %s", archive_name);
-        perror(err_msg);
-        fclose(archive_fh);
+    // create header
+    if (fill_tar_header(header, file_name, &stat_buf)) {
+        close(fd);
         return -1;
     }
+    *size = stat_buf.st_size;
+    return fd;
+}
 
+/*
+ * Writes a member's header, noting where it went in the index
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_put_header(archive_writer_t *writer, const tar_header *header) {
+    if (writer->index != NULL && archive_index_add(writer->index, header, writer->offset))
+        return -1;
+    return archive_writer_put(writer, header, BLOCK_SIZE);
+}
+
+/*
+ * Writes the contents of the file open as 'fd', following its header:
+ * large files are copied by the kernel, small ones share a buffer with their
+ * neighbours' headers and contents. Only the final block is padded.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_put_contents(archive_writer_t *writer, int fd, const char *file_name,
+                                off_t size) {
+    int result = 1;
+    if (writer->use_copy_range && size >= STREAM_CHUNK_SIZE)
+        result = archive_writer_copy_file(writer, fd, file_name, size);
+    if (result == 1)
+        result = archive_writer_read_file(writer, fd, file_name, size);
+    if (result)
+        return -1;
+
+    // fill in zeroes up to the end of the final block
+    return archive_writer_put(writer, NULL, (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+}
+
+/*
+ * Adds the file identified by 'file_name' to the archive: its header, its
+ * contents and the zeroes padding them out to a whole block
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_add(archive_writer_t *writer, const char *file_name) {
+    tar_header header;
+    off_t size;
+    int fd = open_member(file_name, &header, &size);
+    if (fd == -1)
+        return -1;
+
+    int result = archive_writer_put_header(writer, &header) == 0 &&
+                 archive_writer_put_contents(writer, fd, file_name, size) == 0 ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+/*
+ * Ends the archive with its footer blocks and releases 'writer', closing
+ * the archive. Also used to clean up after an error, when 'ok' is 0.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_finish(archive_writer_t *writer, int ok) {
+    char err_msg[MAX_MSG_LEN];
+    int ret_val = ok ? 0 : -1;
+
+    if (ok && (archive_writer_put(writer, NULL, BLOCK_SIZE * NUM_TRAILING_BLOCKS) ||
+               archive_writer_flush(writer)))
+        ret_val = -1;
+
+    free(writer->buf);
+    if (close(writer->fd) == -1 && ret_val == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", writer->archive_name);
+        perror(err_msg);
+        ret_val = -1;
+    }
+    return ret_val;
+}
+
+/*
+ * Writes each file in 'files', then the footer, to the archive open as 'fd',
+ * closing it
+ * offset: Where in the archive 'fd' is positioned
+ * index: Index to add the members to, or NULL
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_archive_members(int fd, const char *archive_name, const file_list_t *files,
+                          off_t offset, archive_index_t *index) {
+    archive_writer_t writer;
+    if (archive_writer_init(&writer, fd, archive_name, offset, index)) {
+        close(fd);
+        return -1;
+    }
 
-    // write files to archive
-    char buffer[BLOCK_SIZE];
-    size_t bytes;
     node_t *file = files->head;
     while (file) {
+        if (archive_writer_add(&writer, file->name))
+            return archive_writer_finish(&writer, 0);
+        file = file->next;
+    }
 
-        // create header
-        tar_header header;
-        if (fill_tar_header(&header, file->name)) {
-            fclose(archive_fh);
-            return -1;
-        }
+    return archive_writer_finish(&writer, 1);
+}
 
-        // write header
-        if (fwrite(&header, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
-            perror(err_msg);
-            fclose(archive_fh);
+/*
+ * Prepares a member in its slot: opens the file and builds its header, and
+ * reads in its contents if they fit in the slot. Larger files are left open
+ * for the writer, with the kernel asked to start reading them.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int stage_member(stage_slot_t *slot) {
+    char err_msg[MAX_MSG_LEN];
+    slot->fd = open_member(slot->file_name, &slot->header, &slot->size);
+    if (slot->fd == -1)
+        return -1;
+
+    if (slot->size > STAGE_SIZE) {
+        posix_fadvise(slot->fd, 0, 0, POSIX_FADV_WILLNEED);
+        return 0;
+    }
+
+    if (slot->data == NULL) {
+        slot->data = malloc(STAGE_SIZE);
+        if (slot->data == NULL) {
+            perror("Failed to allocate staging buffer");
             return -1;
         }
+    }
 
-        // open file
-        FILE *fh = fopen(file->name, "r");
-        if (fh == NULL) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file->name);
+    off_t staged = 0;
+    while (staged < slot->size) {
+        ssize_t bytes = read(slot->fd, slot->data + staged, slot->size - staged);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0) {
+            // The header already promised 'size' bytes
+            if (bytes == 0)
+                errno = EIO;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", slot->file_name);
             perror(err_msg);
-            fclose(archive_fh);
             return -1;
         }
+        staged += bytes;
+    }
 
-        // write file contents
-        do {
-            // read block
-            bytes = fread(buffer, 1, BLOCK_SIZE, fh);
-            if (ferror(fh)) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", file->name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
+    close(slot->fd);
+    slot->fd = -1;
+    return 0;
+}
 
-            if (bytes == 0)
-                break;
-
-            // fill in zeroes if needed
-            for (int i = bytes; i < BLOCK_SIZE; i++)
-                buffer[i] = 0;
-
-            // write block
-            if (fwrite(buffer, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
-        } while (bytes == BLOCK_SIZE);
+// Worker thread of a parallel create: stages members in list order until
+// none are left or the create has failed
+void *stage_worker(void *arg) {
+    stager_t *stager = arg;
 
-        fclose(fh);
-        file = file->next;
+    pthread_mutex_lock(&stager->lock);
+    while (!stager->failed && stager->next_file != NULL) {
+        int index = stager->next_index++;
+        node_t *file = stager->next_file;
+        stager->next_file = file->next;
+
+        // Wait for the writer to be done with the slot's previous member
+        while (!stager->failed && index - stager->n_written >= stager->n_slots)
+            pthread_cond_wait(&stager->consumed, &stager->lock);
+        if (stager->failed)
+            break;
+
+        stage_slot_t *slot = &stager->slots[index % stager->n_slots];
+        slot->file_name = file->name;
+        pthread_mutex_unlock(&stager->lock);
+
+        int result = stage_member(slot);
+
+        pthread_mutex_lock(&stager->lock);
+        slot->state = result == 0 ? SLOT_READY : SLOT_FAILED;
+        pthread_cond_broadcast(&stager->ready);
+    }
+    pthread_mutex_unlock(&stager->lock);
+    return NULL;
+}
+
+/*
+ * Writes one staged member to the archive
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_writer_put_staged(archive_writer_t *writer, const stage_slot_t *slot) {
+    if (archive_writer_put_header(writer, &slot->header))
+        return -1;
+    if (slot->fd != -1)
+        return archive_writer_put_contents(writer, slot->fd, slot->file_name, slot->size);
+    if (archive_writer_put(writer, slot->data, slot->size))
+        return -1;
+    return archive_writer_put(writer, NULL, (BLOCK_SIZE - slot->size % BLOCK_SIZE) % BLOCK_SIZE);
+}
+
+/*
+ * Like write_archive_members(), but with 'n_threads' workers opening, reading
+ * and building headers for the files ahead of the writer
+ * Returns 0 on success or -1 if an error occurs
+ */
+int write_archive_members_parallel(int fd, const char *archive_name, const file_list_t *files,
+                                   int n_threads, archive_index_t *index) {
+    archive_writer_t writer;
+    if (archive_writer_init(&writer, fd, archive_name, 0, index)) {
+        close(fd);
+        return -1;
     }
 
-    // write footer blocks
-    for (int i = 0; i < BLOCK_SIZE; i++)
-        buffer[i] = 0;
+    // Workers beyond one per file, or beyond what one writer can keep up
+    // with, would only use up memory and threads
+    if (n_threads > MAX_STAGE_THREADS)
+        n_threads = MAX_STAGE_THREADS;
+    if (n_threads > files->size)
+        n_threads = files->size > 0 ? files->size : 1;
 
-    for (int i = 0; i < NUM_TRAILING_BLOCKS; i++) {
-        if (fwrite(buffer, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", archive_name);
-            perror(err_msg);
-            fclose(archive_fh);
-            return -1;
+    stager_t stager;
+    stager.next_file = files->head;
+    stager.next_index = 0;
+    stager.n_written = 0;
+    stager.failed = 0;
+    stager.n_slots = n_threads * STAGE_SLOTS_PER_THREAD;
+    stager.slots = calloc(stager.n_slots, sizeof(stage_slot_t));
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    if (stager.slots == NULL || threads == NULL) {
+        perror("Failed to allocate workers");
+        free(stager.slots);
+        free(threads);
+        return archive_writer_finish(&writer, 0);
+    }
+    for (int i = 0; i < stager.n_slots; i++) {
+        stager.slots[i].state = SLOT_PENDING;
+        stager.slots[i].fd = -1;
+    }
+    pthread_mutex_init(&stager.lock, NULL);
+    pthread_cond_init(&stager.ready, NULL);
+    pthread_cond_init(&stager.consumed, NULL);
+
+    // Any one worker can stage every member, so fewer than asked for will do
+    int n_started = 0;
+    for (; n_started < n_threads; n_started++) {
+        int result = pthread_create(&threads[n_started], NULL, stage_worker, &stager);
+        if (result) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            break;
         }
     }
+    int ok = n_started > 0;
 
-    fclose(archive_fh);
-    return 0;
+    // Write the members out in list order as they become ready
+    for (int i = 0; ok && i < files->size; i++) {
+        stage_slot_t *slot = &stager.slots[i % stager.n_slots];
+
+        pthread_mutex_lock(&stager.lock);
+        while (slot->state == SLOT_PENDING)
+            pthread_cond_wait(&stager.ready, &stager.lock);
+        pthread_mutex_unlock(&stager.lock);
+
+        if (slot->state == SLOT_FAILED || archive_writer_put_staged(&writer, slot))
+            ok = 0;
+        if (slot->fd != -1) {
+            close(slot->fd);
+            slot->fd = -1;
+        }
+
+        pthread_mutex_lock(&stager.lock);
+        slot->state = SLOT_PENDING;
+        stager.n_written++;
+        pthread_cond_broadcast(&stager.consumed);
+        pthread_mutex_unlock(&stager.lock);
+    }
+
+    // Stop the workers, should the create have failed, and clean up
+    pthread_mutex_lock(&stager.lock);
+    stager.failed = !ok;
+    pthread_cond_broadcast(&stager.consumed);
+    pthread_mutex_unlock(&stager.lock);
+    for (int i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < stager.n_slots; i++) {
+        if (stager.slots[i].fd != -1)
+            close(stager.slots[i].fd);
+        free(stager.slots[i].data);
+    }
+    pthread_cond_destroy(&stager.consumed);
+    pthread_cond_destroy(&stager.ready);
+    pthread_mutex_destroy(&stager.lock);
+    free(stager.slots);
+    free(threads);
+    return archive_writer_finish(&writer, ok);
+}
+
+/*
+ * Saves the index of an archive that has just been written, or removes the
+ * one next to it, which no longer matches, if there is none or the write failed
+ * result: What writing the archive returned
+ * Returns 0 on success or -1 if an error occurs
+ */
+int finish_archive_index(const char *archive_name, archive_index_t *index, int result) {
+    if (result == 0 && index != NULL && archive_index_save(index, archive_name))
+        result = -1;
+    if ((result != 0 || index == NULL) && archive_index_remove(archive_name))
+        result = -1;
+    if (index != NULL)
+        archive_index_clear(index);
+    return result;
+}
+
+void set_archive_indexing(int enabled) {
+    index_archives = enabled;
+}
+
+int create_archive(const char *archive_name, const file_list_t *files) {
+    return create_archive_parallel(archive_name, files, 0);
+}
+
+int create_archive_parallel(const char *archive_name, const file_list_t *files, int n_threads) {
+    char err_msg[MAX_MSG_LEN];
+
+    // open archive file
+    int fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
+        perror(err_msg);
+        return -1;
+    }
+
+    archive_index_t index;
+    archive_index_init(&index);
+    archive_index_t *use_index = index_archives ? &index : NULL;
+    int result = n_threads > 0
+               ? write_archive_members_parallel(fd, archive_name, files, n_threads, use_index)
+               : write_archive_members(fd, archive_name, files, 0, use_index);
+    return finish_archive_index(archive_name, use_index, result);
+}
+
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    char err_msg[MAX_MSG_LEN];
+
+    // An index already next to the archive is kept up to date; if one is
+    // wanted but missing, it is built from the headers
+    archive_index_t index;
+    archive_index_init(&index);
+    int result = archive_index_load(&index, archive_name);
+    if (result == 1 && index_archives)
+        result = archive_index_scan(&index, archive_name);
+    if (result == -1) {
+        archive_index_clear(&index);
+        return -1;
+    }
+    archive_index_t *use_index = result == 0 ? &index : NULL;
+
+    // remove footer blocks
+    if (remove_trailing_bytes(archive_name, BLOCK_SIZE * NUM_TRAILING_BLOCKS))
+        return finish_archive_index(archive_name, use_index, -1);
+
+    // open archive; not O_APPEND, which copy_file_range() refuses
+    int fd = open(archive_name, O_WRONLY);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
+        perror(err_msg);
+        return finish_archive_index(archive_name, use_index, -1);
+    }
+
+    // seek to end of file
+    off_t offset = lseek(fd, 0, SEEK_END);
+    if (offset == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Error reading from file %s", archive_name);
+        perror(err_msg);
+        close(fd);
+        return finish_archive_index(archive_name, use_index, -1);
+    }
+
+    result = write_archive_members(fd, archive_name, files, offset, use_index);
+    return finish_archive_index(archive_name, use_index, result);
 }
 
 int get_archive_file_list(const char *archive_name, file_list_t *files) {
     char err_msg[MAX_MSG_LEN];
 
+    // With an index, the names come from one read of it
+    archive_index_t index;
+    archive_index_init(&index);
+    int loaded = archive_index_load(&index, archive_name);
+    if (loaded == -1)
+        return -1;
+    if (loaded == 0) {
+        for (int i = 0; i < index.n_entries; i++) {
+            char name[sizeof(index.entries[i].name) + 1];
+            memcpy(name, index.entries[i].name, sizeof(index.entries[i].name));
+            name[sizeof(index.entries[i].name)] = '\0';
+            int result = file_list_add(files, name);
+            if (result) {
+                fprintf(stderr, "Error reading file %s\n", archive_name);
+                archive_index_clear(&index);
+                return result;
+            }
+        }
+        archive_index_clear(&index);
+        return 0;
+    }
+
     // open archive file
     FILE *fh = fopen(archive_name, "r");
     if (fh == NULL) {
@@ -339,13 +860,11 @@ int get_archive_file_list(const char *archive_name, file_list_t *files) {
             break;
 
         // read name from header
-        if (header.name != NULL) {
-            int result = file_list_add(files, header.name);
-            if (result) {
-                fprintf(stderr, "Error reading file %s\n", archive_name);
-                fclose(fh);
-                return result;
-            }
+        int result = file_list_add(files, header.name);
+        if (result) {
+            fprintf(stderr, "Error reading file %s\n", archive_name);
+            fclose(fh);
+            return result;
         }
 
         // read size from header
@@ -369,76 +888,247 @@ int get_archive_file_list(const char *archive_name, file_list_t *files) {
     return 0;
 }
 
-int extract_files_from_archive(const char *archive_name) {
+/*
+ * Fills 'index' with every member of the archive identified by 'archive_name',
+ * from the index kept next to it if that is up to date, or else from one
+ * pass over its headers
+ * Returns 0 on success or -1 if an error occurs
+ */
+int read_archive_index(archive_index_t *index, const char *archive_name) {
+    int result = archive_index_load(index, archive_name);
+    if (result == 1)
+        result = archive_index_scan(index, archive_name);
+    if (result == 0)
+        result = archive_index_sort(index);
+    if (result == -1) {
+        archive_index_clear(index);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Opens the archive identified by 'archive_name' for reading members' contents
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_reader_open(archive_reader_t *reader, const char *archive_name) {
     char err_msg[MAX_MSG_LEN];
+    reader->archive_name = archive_name;
+    reader->use_copy_range = 1;
 
-    // open archive file
-    FILE *archive_fh = fopen(archive_name, "r");
-    if (archive_fh == NULL) {
+    reader->fd = open(archive_name, O_RDONLY);
+    if (reader->fd == -1) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", archive_name);
         perror(err_msg);
         return -1;
     }
 
-    int size;
-    tar_header header;
-    while (1) {
-        // read header block
-        int bytes = fread(&header, 1, BLOCK_SIZE, archive_fh);
-        if (bytes < BLOCK_SIZE) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", archive_name);
+    int result = posix_memalign((void **) &reader->buf, STREAM_ALIGN, STREAM_CHUNK_SIZE);
+    if (result) {
+        errno = result;
+        perror("Failed to allocate stream buffer");
+        close(reader->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Closes the archive and frees the reader's buffer
+void archive_reader_close(archive_reader_t *reader) {
+    free(reader->buf);
+    close(reader->fd);
+}
+
+/*
+ * Copies 'size' bytes at 'offset' in the archive to the file open as 'fd' in
+ * the kernel
+ * Returns 0 on success, 1 if copy_file_range() can't be used for these files
+ * and nothing was copied, or -1 if an error occurs
+ */
+int archive_reader_copy_range(archive_reader_t *reader, int fd, const char *file_name,
+                              off_t offset, off_t size) {
+    char err_msg[MAX_MSG_LEN];
+    off_t copied = 0;
+    while (copied < size) {
+        size_t n = size - copied < STREAM_COPY_SIZE ? size - copied : STREAM_COPY_SIZE;
+        ssize_t bytes = copy_file_range(reader->fd, &offset, fd, NULL, n, 0);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes == -1 && copied == 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+             errno == EBADF)) {
+            reader->use_copy_range = 0;
+            return 1;
+        }
+        if (bytes <= 0) {
+            // The header promised 'size' bytes; the archive is cut short
+            if (bytes == 0)
+                errno = EIO;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to extract file %s", file_name);
             perror(err_msg);
-            fclose(archive_fh);
             return -1;
         }
+        copied += bytes;
+    }
+    return 0;
+}
 
-        if (header.size[0] == 0)
-            break;
-
-        // read size from header
-        size = 0;
-        for (int i = 0; i < 11; i++) {
-            size *= 8;
-            size += header.size[i] - '0';
+/*
+ * Copies 'size' bytes at 'offset' in the archive to the file open as 'fd',
+ * a chunk at a time through the reader's buffer
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_reader_read_range(archive_reader_t *reader, int fd, const char *file_name,
+                              off_t offset, off_t size) {
+    char err_msg[MAX_MSG_LEN];
+    while (size > 0) {
+        size_t n = size < STREAM_CHUNK_SIZE ? size : STREAM_CHUNK_SIZE;
+        ssize_t bytes = pread(reader->fd, reader->buf, n, offset);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0) {
+            if (bytes == 0)
+                errno = EIO;
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", reader->archive_name);
+            perror(err_msg);
+            return -1;
         }
-
-        // open file for writing
-        FILE* fh = fopen(header.name, "w");
-        if (fh == NULL) {
-            snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", header.name);
+        if (write_all(fd, reader->buf, bytes) == -1) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", file_name);
             perror(err_msg);
-            fclose(archive_fh);
             return -1;
         }
+        offset += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
 
-        // read file from archive
-        char buffer[BLOCK_SIZE];
-        while (size) {
-            int num_bytes = size < BLOCK_SIZE ? size : BLOCK_SIZE;
-
-            // load block from archive
-            fread(buffer, 1, BLOCK_SIZE, archive_fh);
-            if (ferror(archive_fh)) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to read from file %s", archive_name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
+/*
+ * Writes the contents of the member 'entry' to a new file of the same name in
+ * the current working directory, reading only that member's blocks
+ * Returns 0 on success or -1 if an error occurs
+ */
+int archive_reader_extract(archive_reader_t *reader, const index_entry_t *entry) {
+    char err_msg[MAX_MSG_LEN];
+    char file_name[sizeof(entry->name) + 1];
+    memcpy(file_name, entry->name, sizeof(entry->name));
+    file_name[sizeof(entry->name)] = '\0';
 
-            // write block to file
-            if (fwrite(buffer, 1, num_bytes, fh) != num_bytes) {
-                snprintf(err_msg, MAX_MSG_LEN, "Failed to write to file %s", header.name);
-                perror(err_msg);
-                fclose(archive_fh);
-                fclose(fh);
-                return -1;
-            }
+    // open file for writing
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+
+    // The contents start in the block after the header
+    off_t offset = entry->offset + BLOCK_SIZE;
+    int result = 1;
+    if (reader->use_copy_range && entry->size >= STREAM_CHUNK_SIZE)
+        result = archive_reader_copy_range(reader, fd, file_name, offset, entry->size);
+    if (result == 1)
+        result = archive_reader_read_range(reader, fd, file_name, offset, entry->size);
+
+    if (close(fd) == -1 && result == 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", file_name);
+        perror(err_msg);
+        result = -1;
+    }
+    return result;
+}
+
+int extract_named_files_from_archive(const char *archive_name, const file_list_t *files) {
+    archive_index_t index;
+    archive_index_init(&index);
+    if (read_archive_index(&index, archive_name))
+        return -1;
 
-            size -= num_bytes;
+    // Every name is resolved to its latest version before anything is written,
+    // and a name given more than once is only extracted the first time
+    const index_entry_t **wanted = malloc((files->size > 0 ? files->size : 1) *
+                                          sizeof(index_entry_t *));
+    char *seen = calloc(index.n_entries > 0 ? index.n_entries : 1, 1);
+    if (wanted == NULL || seen == NULL) {
+        perror("Failed to allocate extraction list");
+        free(wanted);
+        free(seen);
+        archive_index_clear(&index);
+        return -1;
+    }
+    int n_wanted = 0;
+    for (node_t *file = files->head; file != NULL; file = file->next) {
+        const index_entry_t *entry = archive_index_find(&index, file->name);
+        if (entry == NULL) {
+            fprintf(stderr, "Error: %s is not present in archive %s\n", file->name, archive_name);
+            free(wanted);
+            free(seen);
+            archive_index_clear(&index);
+            return -1;
+        }
+        if (!seen[entry - index.entries]) {
+            seen[entry - index.entries] = 1;
+            wanted[n_wanted++] = entry;
         }
     }
+    free(seen);
 
-    fclose(archive_fh);
-    return 0;
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name)) {
+        free(wanted);
+        archive_index_clear(&index);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < n_wanted && result == 0; i++)
+        result = archive_reader_extract(&reader, wanted[i]);
+
+    archive_reader_close(&reader);
+    free(wanted);
+    archive_index_clear(&index);
+    return result;
+}
+
+int extract_files_from_archive(const char *archive_name) {
+    // First pass: every member's name and offset, from the headers alone
+    archive_index_t index;
+    archive_index_init(&index);
+    if (read_archive_index(&index, archive_name))
+        return -1;
+
+    // Sorted by name, the last of each run of versions is the one to keep
+    const index_entry_t **by_name = index.by_name;
+    char *latest = calloc(index.n_entries > 0 ? index.n_entries : 1, 1);
+    if (latest == NULL) {
+        perror("Failed to allocate extraction list");
+        archive_index_clear(&index);
+        return -1;
+    }
+    for (int i = 0; i < index.n_entries; i++) {
+        if (i + 1 == index.n_entries ||
+            strncmp(by_name[i]->name, by_name[i + 1]->name, sizeof(by_name[i]->name)) != 0)
+            latest[by_name[i] - index.entries] = 1;
+    }
+
+    // Second pass: each surviving member written once, in archive order, so
+    // the archive is read front to back
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name)) {
+        free(latest);
+        archive_index_clear(&index);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < index.n_entries && result == 0; i++) {
+        if (latest[i])
+            result = archive_reader_extract(&reader, &index.entries[i]);
+    }
+
+    archive_reader_close(&reader);
+    free(latest);
+    archive_index_clear(&index);
+    return result;
 }
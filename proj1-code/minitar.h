@@ -1,5 +1,7 @@
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <sys/stat.h>
+
 #include "file_list.h"
 
 #define BLOCK_SIZE 512
@@ -49,6 +51,13 @@ typedef struct {
 #define REGTYPE '0'
 #define DIRTYPE '5'
 
+/*
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name', as given by 'stat_buf'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_tar_header(tar_header *header, const char *file_name, const struct stat *stat_buf);
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files contained in the 'files' list.
@@ -60,6 +69,26 @@ typedef struct {
  */
 int create_archive(const char *archive_name, const file_list_t *files);
 
+/*
+ * Same as create_archive(), but with 'n_threads' worker threads opening the
+ * files, building their headers and reading them in ahead of a single
+ * writer. Members are still written in list order, so the archive is
+ * byte-for-byte the one create_archive() makes. No more workers are started
+ * than there are files, nor than 64; should starting some fail, the rest do
+ * the work.
+ * This function should return 0 upon success or -1 if an error occurred
+ */
+int create_archive_parallel(const char *archive_name, const file_list_t *files, int n_threads);
+
+/*
+ * Have create_archive(), create_archive_parallel() and append_files_to_archive()
+ * keep an index of the members next to the archive (see archive_index.h),
+ * which get_archive_file_list() and extraction then use instead of scanning
+ * the archive. Appending keeps an index that is already there up to date
+ * either way; without one, creating an archive removes any stale index.
+ */
+void set_archive_indexing(int enabled);
+
 /*
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
@@ -87,4 +116,15 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Write only the files named in 'files' from the archive identified by
+ * 'archive_name' to the current working directory, each as its most recently
+ * added version. All names are looked up, in the archive's index if it has an
+ * up-to-date one or else in its headers alone, before any file is written, and
+ * only the named members' contents are read.
+ * This function should return 0 upon success or -1 if an error occurred,
+ * including if a named file is not present in the archive.
+ */
+int extract_named_files_from_archive(const char *archive_name, const file_list_t *files);
+
 #endif
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_list.h"
+#include "minitar.h"
+
+#define BENCH_DIR "bench_files"
+#define LARGE_FILES 4
+#define LARGE_FILE_SIZE (64 << 20)
+#define SMALL_FILES 2000
+#define SMALL_FILE_SIZE 3000    // Not a multiple of BLOCK_SIZE, so every file is padded
+#define ITERATIONS 3
+#define BENCH_THREADS 4
+#define MAX_MSG_LEN 512
+
+/*
+ * Throughput benchmark for create_archive()
+ * Archives a set of large files and a set of small ones with the 512-byte
+ * fread()/fwrite() loop create_archive() replaced, with create_archive() and
+ * with create_archive_parallel(), checks the archives are identical and
+ * reports the best rate of each.
+ */
+
+/*
+ * The original create_archive(): each file moves through a 512-byte buffer
+ * one fread() and fwrite() at a time
+ * Returns 0 on success or -1 if an error occurs
+ */
+int legacy_create_archive(const char *archive_name, const file_list_t *files) {
+    FILE *archive_fh = fopen(archive_name, "w");
+    if (archive_fh == NULL) {
+        perror(archive_name);
+        return -1;
+    }
+
+    char buffer[BLOCK_SIZE];
+    size_t bytes;
+    node_t *file = files->head;
+    while (file) {
+        struct stat stat_buf;
+        tar_header header;
+        if (stat(file->name, &stat_buf) != 0 ||
+            fill_tar_header(&header, file->name, &stat_buf) ||
+            fwrite(&header, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
+            perror(file->name);
+            fclose(archive_fh);
+            return -1;
+        }
+
+        FILE *fh = fopen(file->name, "r");
+        if (fh == NULL) {
+            perror(file->name);
+            fclose(archive_fh);
+            return -1;
+        }
+
+        do {
+            bytes = fread(buffer, 1, BLOCK_SIZE, fh);
+            if (bytes == 0)
+                break;
+            for (int i = bytes; i < BLOCK_SIZE; i++)
+                buffer[i] = 0;
+            if (fwrite(buffer, 1, BLOCK_SIZE, archive_fh) != BLOCK_SIZE) {
+                perror(archive_name);
+                fclose(archive_fh);
+                fclose(fh);
+                return -1;
+            }
+        } while (bytes == BLOCK_SIZE);
+
+        fclose(fh);
+        file = file->next;
+    }
+
+    memset(buffer, 0, BLOCK_SIZE);
+    for (int i = 0; i < 2; i++)
+        fwrite(buffer, 1, BLOCK_SIZE, archive_fh);
+    return fclose(archive_fh) == 0 ? 0 : -1;
+}
+
+// Writes 'n_files' files of 'size' pseudo-random bytes, adding their names to 'files'
+// Returns 0 on success or -1 on error
+int make_files(file_list_t *files, const char *prefix, int n_files, size_t size) {
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    unsigned seed = 1;
+    for (int i = 0; i < n_files; i++) {
+        for (size_t j = 0; j < size; j++)
+            buf[j] = rand_r(&seed);
+
+        char name[MAX_NAME_LEN];
+        snprintf(name, MAX_NAME_LEN, "%s%d", prefix, i);
+        FILE *fh = fopen(name, "w");
+        if (fh == NULL || fwrite(buf, 1, size, fh) != size || fclose(fh) != 0) {
+            perror(name);
+            free(buf);
+            return -1;
+        }
+        file_list_add(files, name);
+    }
+
+    free(buf);
+    return 0;
+}
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns 1 if the two files have the same contents, 0 if not
+int same_contents(const char *path1, const char *path2) {
+    FILE *fh1 = fopen(path1, "r");
+    FILE *fh2 = fopen(path2, "r");
+    int same = fh1 != NULL && fh2 != NULL;
+    while (same) {
+        int c1 = getc(fh1);
+        same = c1 == getc(fh2);
+        if (c1 == EOF)
+            break;
+    }
+    if (fh1 != NULL)
+        fclose(fh1);
+    if (fh2 != NULL)
+        fclose(fh2);
+    return same;
+}
+
+// Times both ways of archiving 'files' and prints their rates
+// Returns 0 on success or -1 on error
+int bench(const char *label, const file_list_t *files, size_t total_bytes) {
+    double best_legacy = 0;
+    double best_stream = 0;
+    double best_parallel = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        double start = now_sec();
+        if (legacy_create_archive("legacy.tar", files))
+            return -1;
+        double elapsed = now_sec() - start;
+        if (best_legacy == 0 || elapsed < best_legacy)
+            best_legacy = elapsed;
+
+        start = now_sec();
+        if (create_archive("stream.tar", files))
+            return -1;
+        elapsed = now_sec() - start;
+        if (best_stream == 0 || elapsed < best_stream)
+            best_stream = elapsed;
+
+        start = now_sec();
+        if (create_archive_parallel("parallel.tar", files, BENCH_THREADS))
+            return -1;
+        elapsed = now_sec() - start;
+        if (best_parallel == 0 || elapsed < best_parallel)
+            best_parallel = elapsed;
+    }
+
+    if (!same_contents("legacy.tar", "stream.tar") ||
+        !same_contents("legacy.tar", "parallel.tar")) {
+        fprintf(stderr, "%s: archives differ\n", label);
+        return -1;
+    }
+
+    double mib = total_bytes / (double) (1 << 20);
+    printf("%-28s 512-byte stdio %8.1f MiB/s   streaming %8.1f MiB/s (%.1fx)   "
+           "-j %d %8.1f MiB/s (%.1fx)\n", label, mib / best_legacy, mib / best_stream,
+           best_legacy / best_stream, BENCH_THREADS, mib / best_parallel,
+           best_legacy / best_parallel);
+    unlink("legacy.tar");
+    unlink("stream.tar");
+    unlink("parallel.tar");
+    return 0;
+}
+
+int main(void) {
+    if (mkdir(BENCH_DIR, 0777) == -1 || chdir(BENCH_DIR) == -1) {
+        perror(BENCH_DIR);
+        return 1;
+    }
+
+    int ret_val = 0;
+    file_list_t large;
+    file_list_t small;
+    file_list_init(&large);
+    file_list_init(&small);
+    if (make_files(&large, "large", LARGE_FILES, LARGE_FILE_SIZE) ||
+        make_files(&small, "small", SMALL_FILES, SMALL_FILE_SIZE))
+        ret_val = 1;
+
+    char label[MAX_MSG_LEN];
+    snprintf(label, MAX_MSG_LEN, "%d x %d MiB files:", LARGE_FILES, LARGE_FILE_SIZE >> 20);
+    if (ret_val == 0 && bench(label, &large, (size_t) LARGE_FILES * LARGE_FILE_SIZE))
+        ret_val = 1;
+    snprintf(label, MAX_MSG_LEN, "%d x %d byte files:", SMALL_FILES, SMALL_FILE_SIZE);
+    if (ret_val == 0 && bench(label, &small, (size_t) SMALL_FILES * SMALL_FILE_SIZE))
+        ret_val = 1;
+
+    // Clean up
+    file_list_t *lists[] = { &large, &small };
+    for (int i = 0; i < 2; i++) {
+        for (node_t *file = lists[i]->head; file != NULL; file = file->next)
+            unlink(file->name);
+        file_list_clear(lists[i]);
+    }
+    unlink("legacy.tar");
+    unlink("stream.tar");
+    unlink("parallel.tar");
+    if (chdir("..") == -1 || rmdir(BENCH_DIR) == -1)
+        perror(BENCH_DIR);
+    return ret_val;
+}
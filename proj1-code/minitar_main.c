@@ -1,12 +1,38 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "file_list.h"
 #include "minitar.h"
 
 int main(int argc, char **argv) {
+    // Options come ahead of the operation: '-j N' for parallel creation and
+    // '-i' to keep an index next to the archive
+    int n_threads = 0;
+    char *prog = argv[0];
+    while (argc > 1) {
+        if (argc > 2 && strcmp("-j", argv[1]) == 0) {
+            char *end;
+            long value = strtol(argv[2], &end, 10);
+            if (end == argv[2] || *end != '\0' || value < 1 || value > INT_MAX) {
+                printf("Usage: %s [-i] [-j N] -c|a|t|u|x -f ARCHIVE [FILE...]\n", prog);
+                return 0;
+            }
+            n_threads = value;
+            argc -= 2;
+            argv += 2;
+        } else if (strcmp("-i", argv[1]) == 0) {
+            set_archive_indexing(1);
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+    }
+
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s [-i] [-j N] -c|a|t|u|x -f ARCHIVE [FILE...]\n", prog);
         return 0;
     }
 
@@ -22,7 +48,9 @@ int main(int argc, char **argv) {
         for (int i = 4; i < argc; i++)
             file_list_add(&files, argv[i]);
 
-        if (create_archive(archive, &files)) {
+        int result = n_threads > 0 ? create_archive_parallel(archive, &files, n_threads)
+                                   : create_archive(archive, &files);
+        if (result) {
             file_list_clear(&files);
             return -1;
         }
@@ -80,11 +108,19 @@ int main(int argc, char **argv) {
 
     } else if (strcmp("-x", argv[1]) == 0) { // extract files from archive
 
-        if (extract_files_from_archive(archive))
+        // Named files are extracted alone, otherwise the whole archive
+        for (int i = 4; i < argc; i++)
+            file_list_add(&files, argv[i]);
+
+        int result = files.head != NULL ? extract_named_files_from_archive(archive, &files)
+                                        : extract_files_from_archive(archive);
+        if (result) {
+            file_list_clear(&files);
             return -1;
+        }
 
     } else {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s [-i] [-j N] -c|a|t|u|x -f ARCHIVE [FILE...]\n", prog);
     }
 
     file_list_clear(&files);
@@ -0,0 +1,211 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+
+#define BUFSIZE 512
+#define DRAIN_BUFSIZE 65536
+#define DEFAULT_ITERATIONS 50
+
+/*
+ * Throughput benchmark for write_file_body()
+ * Sends every file in a directory over a loopback TCP connection with each
+ * body copy strategy and reports the achieved rate.
+ */
+
+static const struct {
+    body_method_t method;
+    const char *name;
+} methods[] = {
+    { BODY_SENDFILE, "sendfile" },
+    { BODY_SPLICE, "splice" },
+    { BODY_COPY, "read/write" },
+};
+#define N_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+// Reads and discards everything from the socket until EOF
+void *drain_func(void *arg) {
+    int fd = *(int *) arg;
+    char *buf = malloc(DRAIN_BUFSIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    while (read(fd, buf, DRAIN_BUFSIZE) > 0)
+        ;
+
+    free(buf);
+    return NULL;
+}
+
+// Creates a connected loopback TCP pair, returns 0 on success or -1 on error
+int loopback_pair(int *send_fd, int *recv_fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len) == -1) {
+        perror("bind/listen");
+        close(listen_fd);
+        return -1;
+    }
+
+    *send_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*send_fd == -1) {
+        perror("socket");
+        close(listen_fd);
+        return -1;
+    }
+
+    if (connect(*send_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(*send_fd);
+        close(listen_fd);
+        return -1;
+    }
+
+    *recv_fd = accept(listen_fd, NULL, NULL);
+    if (*recv_fd == -1) {
+        perror("accept");
+        close(*send_fd);
+        close(listen_fd);
+        return -1;
+    }
+
+    close(listen_fd);
+    return 0;
+}
+
+double elapsed_sec(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Sends 'path' 'iterations' times with 'method', returns MB/s or -1 on error
+double bench_file(const char *path, body_method_t method, int iterations) {
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat statbuf;
+    if (fstat(file_fd, &statbuf) == -1) {
+        perror("fstat");
+        close(file_fd);
+        return -1;
+    }
+
+    int send_fd, recv_fd;
+    if (loopback_pair(&send_fd, &recv_fd) == -1) {
+        close(file_fd);
+        return -1;
+    }
+
+    pthread_t drain_thread;
+    int result = pthread_create(&drain_thread, NULL, drain_func, &recv_fd);
+    if (result) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        close(send_fd);
+        close(recv_fd);
+        close(file_fd);
+        return -1;
+    }
+
+    double rate = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        if (write_file_body(send_fd, file_fd, 0, statbuf.st_size, method) == -1) {
+            rate = -1;
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Closing the sending side lets the drain thread see EOF
+    close(send_fd);
+    pthread_join(drain_thread, NULL);
+    close(recv_fd);
+    close(file_fd);
+
+    if (rate == 0) {
+        double total_mb = (double) statbuf.st_size * iterations / (1 << 20);
+        rate = total_mb / elapsed_sec(&start, &end);
+    }
+    return rate;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        printf("Usage: %s <directory> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const char *dir_name = argv[1];
+    int iterations = argc == 3 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) {
+        fprintf(stderr, "Invalid iteration count: %s\n", argv[2]);
+        return 1;
+    }
+
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL) {
+        perror("opendir");
+        return 1;
+    }
+
+    printf("%-20s %10s", "file", "bytes");
+    for (int i = 0; i < N_METHODS; i++)
+        printf(" %12s", methods[i].name);
+    printf("   (MB/s, %d iterations)\n", iterations);
+
+    int ret_val = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[BUFSIZE];
+        snprintf(path, BUFSIZE, "%s/%s", dir_name, entry->d_name);
+
+        struct stat statbuf;
+        if (stat(path, &statbuf) == -1 || !S_ISREG(statbuf.st_mode))
+            continue;
+
+        printf("%-20s %10ld", entry->d_name, (long) statbuf.st_size);
+        for (int i = 0; i < N_METHODS; i++) {
+            double rate = bench_file(path, methods[i].method, iterations);
+            if (rate < 0) {
+                printf(" %12s", "error");
+                ret_val = 1;
+            } else {
+                printf(" %12.1f", rate);
+            }
+        }
+        printf("\n");
+    }
+
+    closedir(dir);
+    return ret_val;
+}
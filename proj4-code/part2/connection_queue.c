@@ -1,11 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "connection_queue.h"
 
-int connection_queue_init(connection_queue_t *queue) {
+int connection_queue_init(connection_queue_t *queue, int capacity) {
     int result;
 
+    // Allocate storage
+    queue->client_fds = malloc(capacity * sizeof(int));
+    if (queue->client_fds == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
     // Initialize integer values
+    queue->capacity = capacity;
     queue->length = 0;
     queue->read_idx = 0;
     queue->write_idx = 0;
@@ -15,6 +24,7 @@ int connection_queue_init(connection_queue_t *queue) {
     result = pthread_mutex_init(&queue->lock, NULL);
     if (result) {
         fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+        free(queue->client_fds);
         return -1;
     }
 
@@ -22,6 +32,7 @@ int connection_queue_init(connection_queue_t *queue) {
     if (result) {
         fprintf(stderr, "pthread_cond_init: %s\n", strerror(result));
         pthread_mutex_destroy(&queue->lock);
+        free(queue->client_fds);
         return -1;
     }
 
@@ -30,6 +41,7 @@ int connection_queue_init(connection_queue_t *queue) {
         fprintf(stderr, "pthread_cond_init: %s\n", strerror(result));
         pthread_mutex_destroy(&queue->lock);
         pthread_cond_destroy(&queue->full);
+        free(queue->client_fds);
         return -1;
     }
 
@@ -46,7 +58,7 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
         return -1;
     }
 
-    while (queue->length == CAPACITY) {
+    while (queue->length == queue->capacity) {
         // Exit instead of waiting on shutdown
         if (queue->shutdown) {
             pthread_mutex_unlock(&queue->lock);
@@ -64,7 +76,7 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
     // Add item to queue
     queue->client_fds[queue->write_idx] = connection_fd;
     queue->length++;
-    if (++queue->write_idx == CAPACITY)
+    if (++queue->write_idx == queue->capacity)
         queue->write_idx = 0;
 
     // Signal waiting threads
@@ -113,7 +125,7 @@ int connection_dequeue(connection_queue_t *queue) {
     // Read item from queue
     int fd = queue->client_fds[queue->read_idx];
     queue->length--;
-    if (++queue->read_idx == CAPACITY)
+    if (++queue->read_idx == queue->capacity)
         queue->read_idx = 0;
 
     // Signal waiting threads
@@ -179,5 +191,6 @@ int connection_queue_free(connection_queue_t *queue) {
         ret_val = -1;
     }
 
+    free(queue->client_fds);
     return ret_val;
 }
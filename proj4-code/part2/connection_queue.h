@@ -1,14 +1,46 @@
 #ifndef CONNECTION_QUEUE_H
 #define CONNECTION_QUEUE_H
 
-#include <pthread.h>
+// Two implementations share this interface: connection_queue.c (mutex and
+// condition variables) and, when built with -DCONNECTION_QUEUE_LOCKFREE,
+// connection_queue_lockfree.c (lock-free ring)
+#ifdef CONNECTION_QUEUE_LOCKFREE
+#include <stdatomic.h>
+#include <stddef.h>
+
+// One element of the lock-free ring
+// 'seq' says whose turn it is to use the slot: a producer when it equals the
+// enqueue position, a consumer when it equals the dequeue position plus one
+typedef struct {
+    _Alignas(64) atomic_size_t seq;
+    int fd;
+} connection_slot_t;
 
-#define CAPACITY 5
+// Struct representing a thread-safe queue data structure
+// Bounded multi-producer/multi-consumer ring with no locks; threads that
+// find it empty or full sleep on a futex until woken by the other side
+typedef struct {
+    connection_slot_t *slots;
+    size_t capacity;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+
+    // Futex words, bumped on every enqueue/dequeue, and sleeper counts
+    _Alignas(64) atomic_uint items_seq;
+    atomic_uint dequeue_waiters;
+    _Alignas(64) atomic_uint spaces_seq;
+    atomic_uint enqueue_waiters;
+
+    atomic_int shutdown;
+} connection_queue_t;
+#else
+#include <pthread.h>
 
 // Struct representing a thread-safe queue data structure
 // The queue stores file descriptors of active client TCP sockets
 typedef struct {
-    int client_fds[CAPACITY];
+    int *client_fds;
+    int capacity;
     int length;
     int read_idx;
     int write_idx;
@@ -19,14 +51,16 @@ typedef struct {
     pthread_cond_t full;
     pthread_cond_t empty;
 } connection_queue_t;
+#endif
 
 /*
  * Initialize a new connection queue.
- * The queue can store at most 'CAPACITY' elements.
+ * The queue can store at most 'capacity' elements.
  * queue: Pointer to connection_queue_t to be initialized
+ * capacity: Maximum number of elements, at least 1
  * Returns 0 on success or -1 on error
  */
-int connection_queue_init(connection_queue_t *queue);
+int connection_queue_init(connection_queue_t *queue, int capacity);
 
 /*
  * Add a new file descriptor to a connection queue. If the queue is full, then
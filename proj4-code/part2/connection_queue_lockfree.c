@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "connection_queue.h"
+
+/*
+ * Bounded MPMC ring after Dmitry Vyukov's design. Each slot carries a
+ * sequence number, so producers and consumers claim positions with a single
+ * compare-and-swap and never touch a shared lock. Threads that find the ring
+ * empty (or full) register as waiters and sleep on a futex word that the
+ * other side bumps after every operation, so sleeping threads cost nothing
+ * and wakeups only happen when someone is actually waiting.
+ */
+
+static int futex_wait(atomic_uint *addr, unsigned val) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static int futex_wake(atomic_uint *addr, int n) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Bumps a futex word and wakes one sleeper if there are any
+static void notify(atomic_uint *seq, atomic_uint *waiters) {
+    atomic_fetch_add(seq, 1);
+    if (atomic_load(waiters) > 0 && futex_wake(seq, 1) == -1)
+        perror("futex");
+}
+
+// Returns 0 if the fd was added or -1 if the queue is full
+static int try_enqueue(connection_queue_t *queue, int fd) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        connection_slot_t *slot = &queue->slots[pos % queue->capacity];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long) seq - (long) pos;
+
+        if (diff == 0) {
+            // Slot is free for this position, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->fd = fd;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            // Slot still holds an item from the previous lap
+            return -1;
+        } else {
+            // Another producer got here first
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns the removed fd or -1 if the queue is empty
+static int try_dequeue(connection_queue_t *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        connection_slot_t *slot = &queue->slots[pos % queue->capacity];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long) seq - (long) (pos + 1);
+
+        if (diff == 0) {
+            // Slot holds the item for this position, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                int fd = slot->fd;
+                // Hand the slot to the producer one lap ahead
+                atomic_store_explicit(&slot->seq, pos + queue->capacity, memory_order_release);
+                return fd;
+            }
+        } else if (diff < 0) {
+            // Nothing has been written here yet
+            return -1;
+        } else {
+            // Another consumer got here first
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+int connection_queue_init(connection_queue_t *queue, int capacity) {
+    queue->slots = aligned_alloc(_Alignof(connection_slot_t),
+                                 capacity * sizeof(connection_slot_t));
+    if (queue->slots == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+
+    queue->capacity = capacity;
+    for (size_t i = 0; i < queue->capacity; i++)
+        atomic_init(&queue->slots[i].seq, i);
+
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->items_seq, 0);
+    atomic_init(&queue->dequeue_waiters, 0);
+    atomic_init(&queue->spaces_seq, 0);
+    atomic_init(&queue->enqueue_waiters, 0);
+    atomic_init(&queue->shutdown, 0);
+
+    return 0;
+}
+
+int connection_enqueue(connection_queue_t *queue, int connection_fd) {
+    while (try_enqueue(queue, connection_fd) == -1) {
+        // Exit instead of waiting on shutdown
+        if (atomic_load(&queue->shutdown))
+            return -1;
+
+        // Register as a waiter, then look again so a dequeue that happened
+        // in between can't be missed
+        unsigned seq = atomic_load(&queue->spaces_seq);
+        atomic_fetch_add(&queue->enqueue_waiters, 1);
+        if (try_enqueue(queue, connection_fd) == 0) {
+            atomic_fetch_sub(&queue->enqueue_waiters, 1);
+            break;
+        }
+
+        // Wait until space available in queue
+        if (!atomic_load(&queue->shutdown) && futex_wait(&queue->spaces_seq, seq) == -1 &&
+            errno != EAGAIN && errno != EINTR) {
+            perror("futex");
+            atomic_fetch_sub(&queue->enqueue_waiters, 1);
+            return -1;
+        }
+        atomic_fetch_sub(&queue->enqueue_waiters, 1);
+    }
+
+    // Wake a waiting consumer
+    notify(&queue->items_seq, &queue->dequeue_waiters);
+    return 0;
+}
+
+int connection_dequeue(connection_queue_t *queue) {
+    int fd;
+    while ((fd = try_dequeue(queue)) == -1) {
+        // Exit when queue empty instead of blocking on shutdown
+        if (atomic_load(&queue->shutdown))
+            return -1;
+
+        // Register as a waiter, then look again so an enqueue that happened
+        // in between can't be missed
+        unsigned seq = atomic_load(&queue->items_seq);
+        atomic_fetch_add(&queue->dequeue_waiters, 1);
+        if ((fd = try_dequeue(queue)) != -1) {
+            atomic_fetch_sub(&queue->dequeue_waiters, 1);
+            break;
+        }
+
+        // Wait for items available to dequeue
+        if (!atomic_load(&queue->shutdown) && futex_wait(&queue->items_seq, seq) == -1 &&
+            errno != EAGAIN && errno != EINTR) {
+            perror("futex");
+            atomic_fetch_sub(&queue->dequeue_waiters, 1);
+            return -1;
+        }
+        atomic_fetch_sub(&queue->dequeue_waiters, 1);
+    }
+
+    // Wake a waiting producer
+    notify(&queue->spaces_seq, &queue->enqueue_waiters);
+    return fd;
+}
+
+int connection_queue_shutdown(connection_queue_t *queue) {
+    int ret_val = 0;
+
+    atomic_store(&queue->shutdown, 1);
+
+    // Change both futex words so no thread goes to sleep on a stale value,
+    // then wake everyone
+    atomic_fetch_add(&queue->items_seq, 1);
+    atomic_fetch_add(&queue->spaces_seq, 1);
+
+    if (futex_wake(&queue->items_seq, INT_MAX) == -1) {
+        perror("futex");
+        ret_val = -1;
+    }
+
+    if (futex_wake(&queue->spaces_seq, INT_MAX) == -1) {
+        perror("futex");
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
+
+int connection_queue_free(connection_queue_t *queue) {
+    free(queue->slots);
+    return 0;
+}
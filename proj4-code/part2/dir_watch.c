@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dir_watch.h"
+#include "server_stats.h"
+
+// Everything that can change what a file's name serves
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Tells every listener about a change
+static void notify(dir_watch_t *watch, const char *path) {
+    for (int i = 0; i < watch->n_listeners; i++)
+        watch->listeners[i].func(watch->listeners[i].arg, path);
+}
+
+// Joins a directory's relative path and a name in it, "" being the root
+// Returns 0 on success or -1 if it doesn't fit
+static int join_path(char *buf, const char *dir, const char *name) {
+    int len = snprintf(buf, PATH_MAX, "%s%s%s", dir, *dir ? "/" : "", name);
+    return len < PATH_MAX ? 0 : -1;
+}
+
+// Records the relative path of the directory a watch descriptor watches
+// Returns 0 on success or -1 on error
+static int set_dir(dir_watch_t *watch, int wd, const char *path) {
+    if (wd >= watch->dirs_cap) {
+        int new_cap = watch->dirs_cap ? watch->dirs_cap : 64;
+        while (new_cap <= wd)
+            new_cap *= 2;
+        char **dirs = realloc(watch->dirs, new_cap * sizeof(char *));
+        if (dirs == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        memset(dirs + watch->dirs_cap, 0, (new_cap - watch->dirs_cap) * sizeof(char *));
+        watch->dirs = dirs;
+        watch->dirs_cap = new_cap;
+    }
+
+    // Watching a directory again, e.g. after it moved, gives the same descriptor
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    free(watch->dirs[wd]);
+    watch->dirs[wd] = copy;
+    return 0;
+}
+
+/*
+ * Watch a directory and every directory beneath it, noting anything that
+ * makes the watch incomplete
+ * path: The directory, relative to the root
+ * Returns 0 on success or -1 if the directory itself couldn't be watched
+ */
+static int add_tree(dir_watch_t *watch, const char *path) {
+    char full[PATH_MAX];
+    if (join_path(full, watch->root, path) == -1) {
+        atomic_store(&watch->complete, 0);
+        return -1;
+    }
+
+    int wd = inotify_add_watch(watch->inotify_fd, full, WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd == -1 || set_dir(watch, wd, path) == -1) {
+        if (wd == -1)
+            perror(full);
+        atomic_store(&watch->complete, 0);
+        return -1;
+    }
+
+    DIR *dir = opendir(full);
+    if (dir == NULL) {
+        // Removed again already; its deletion will be seen
+        if (errno != ENOENT)
+            perror(full);
+        return 0;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat statbuf;
+            if (fstatat(dirfd(dir), ent->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+            type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISLNK(statbuf.st_mode) ? DT_LNK : DT_REG;
+        }
+
+        char child[PATH_MAX];
+        if (type == DT_LNK) {
+            atomic_store(&watch->complete, 0);
+        } else if (type == DT_DIR) {
+            if (join_path(child, path, ent->d_name) == -1)
+                atomic_store(&watch->complete, 0);
+            else
+                add_tree(watch, child);
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// Passes one inotify event on to the listeners
+static void handle_event(dir_watch_t *watch, const struct inotify_event *event) {
+    stats_count(watch_events, 1);
+
+    // Events were lost, so any file may have changed
+    if (event->mask & IN_Q_OVERFLOW) {
+        notify(watch, NULL);
+        return;
+    }
+
+    if (event->wd < 0 || event->wd >= watch->dirs_cap || watch->dirs[event->wd] == NULL)
+        return;
+    const char *dir = watch->dirs[event->wd];
+
+    if (event->mask & IN_IGNORED) {
+        free(watch->dirs[event->wd]);
+        watch->dirs[event->wd] = NULL;
+        return;
+    }
+
+    char path[PATH_MAX];
+    if (event->len == 0 || join_path(path, dir, event->name) == -1) {
+        // An event on the directory itself, such as its removal, or a name
+        // too long to pass on
+        notify(watch, NULL);
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        // A directory appearing needs watching, and moving one changes the
+        // paths of everything beneath it; either way, every path it could
+        // hold was affected
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            add_tree(watch, path);
+        if (event->mask & IN_MOVED_FROM)
+            add_tree(watch, "");
+        notify(watch, NULL);
+        return;
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        char full[PATH_MAX];
+        struct stat statbuf;
+        if (join_path(full, watch->root, path) == 0 && lstat(full, &statbuf) == 0 &&
+            S_ISLNK(statbuf.st_mode))
+            atomic_store(&watch->complete, 0);
+    }
+    notify(watch, path);
+}
+
+static void *dir_watch_func(void *arg) {
+    dir_watch_t *watch = arg;
+    char buf[DIR_WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fds[2];
+    fds[0].fd = watch->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->wake_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        ssize_t len = read(watch->inotify_fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("read");
+            break;
+        }
+
+        for (char *pos = buf; pos < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) pos;
+            handle_event(watch, event);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Without the thread, nothing is invalidated any more
+    atomic_store(&watch->complete, 0);
+    return NULL;
+}
+
+int dir_watch_init(dir_watch_t *watch, const char *root) {
+    watch->dirs = NULL;
+    watch->dirs_cap = 0;
+    watch->n_listeners = 0;
+    atomic_init(&watch->complete, 1);
+
+    watch->root = strdup(root);
+    if (watch->root == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify_fd == -1) {
+        perror("inotify_init1");
+        free(watch->root);
+        return -1;
+    }
+
+    watch->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watch->wake_fd == -1) {
+        perror("eventfd");
+        close(watch->inotify_fd);
+        free(watch->root);
+        return -1;
+    }
+
+    if (add_tree(watch, "") == -1) {
+        dir_watch_free(watch);
+        return -1;
+    }
+    return 0;
+}
+
+int dir_watch_listen(dir_watch_t *watch, dir_watch_listener_t func, void *arg) {
+    // A listener that won't be told can't rely on the watch, and nor can the
+    // others, who may share what it caches
+    if (watch->n_listeners == DIR_WATCH_MAX_LISTENERS) {
+        fprintf(stderr, "Too many directory watch listeners\n");
+        atomic_store(&watch->complete, 0);
+        return -1;
+    }
+    watch->listeners[watch->n_listeners].func = func;
+    watch->listeners[watch->n_listeners].arg = arg;
+    watch->n_listeners++;
+    return 0;
+}
+
+int dir_watch_complete(dir_watch_t *watch) {
+    return atomic_load_explicit(&watch->complete, memory_order_relaxed);
+}
+
+int dir_watch_start(dir_watch_t *watch) {
+    int result = pthread_create(&watch->thread, NULL, dir_watch_func, watch);
+    if (result) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        atomic_store(&watch->complete, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int dir_watch_stop(dir_watch_t *watch) {
+    int ret_val = 0;
+
+    uint64_t one = 1;
+    if (write(watch->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        ret_val = -1;
+    }
+
+    int result = pthread_join(watch->thread, NULL);
+    if (result) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
+
+int dir_watch_free(dir_watch_t *watch) {
+    int ret_val = 0;
+
+    for (int i = 0; i < watch->dirs_cap; i++)
+        free(watch->dirs[i]);
+    free(watch->dirs);
+    free(watch->root);
+
+    if (close(watch->wake_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+    if (close(watch->inotify_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+    return ret_val;
+}
@@ -0,0 +1,84 @@
+#ifndef DIR_WATCH_H
+#define DIR_WATCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DIR_WATCH_MAX_LISTENERS 8
+#define DIR_WATCH_BUFSIZE 16384     // Bytes of inotify events read at once
+
+/*
+ * Told that something changed in the watched tree, on the watcher's thread
+ * arg: The argument the listener was registered with
+ * path: The changed file, relative to the watched directory and in the form
+ * http_normalize_path() gives, or NULL if anything may have changed
+ */
+typedef void (*dir_watch_listener_t)(void *arg, const char *path);
+
+typedef struct {
+    dir_watch_listener_t func;
+    void *arg;
+} dir_watch_listen_t;
+
+// Watches a directory tree with inotify(7) from a background thread, telling
+// registered listeners (the caches) which files changed so they can drop what
+// they hold for them. While the watch is complete, the caches trust their
+// entries until told otherwise instead of checking the file system.
+// It stops being complete, and the caches go back to revalidating on a timer,
+// if a directory can't be watched (e.g. fs.inotify.max_user_watches is
+// reached) or the tree holds a symbolic link, since a change to a link's
+// target can't be traced back to the link's name.
+typedef struct {
+    char *root;         // The watched directory
+    int inotify_fd;
+    int wake_fd;        // eventfd written to ask the thread to stop
+    char **dirs;        // Path of each watched directory, indexed by watch descriptor
+    int dirs_cap;
+    dir_watch_listen_t listeners[DIR_WATCH_MAX_LISTENERS];
+    int n_listeners;
+    atomic_int complete;
+    pthread_t thread;
+} dir_watch_t;
+
+/*
+ * Start watching every directory in a tree; events are queued until the
+ * thread is started
+ * watch: Pointer to the dir_watch_t to be initialized
+ * root: Directory at the top of the tree
+ * Returns 0 on success or -1 on error, e.g. when inotify isn't available
+ */
+int dir_watch_init(dir_watch_t *watch, const char *root);
+
+/*
+ * Register a function to be told about changes. Must be called before the
+ * watch is started.
+ * Returns 0 on success or -1 if there are too many listeners
+ */
+int dir_watch_listen(dir_watch_t *watch, dir_watch_listener_t func, void *arg);
+
+/*
+ * Check whether every change in the tree will reach the listeners, so that
+ * what they cache needs no other revalidation
+ * Returns 1 if so, 0 if not
+ */
+int dir_watch_complete(dir_watch_t *watch);
+
+/*
+ * Start handling events on a new thread
+ * Returns 0 on success or -1 on error
+ */
+int dir_watch_start(dir_watch_t *watch);
+
+/*
+ * Ask the watcher thread to stop and wait for it to exit
+ * Returns 0 on success or -1 on error
+ */
+int dir_watch_stop(dir_watch_t *watch);
+
+/*
+ * Deallocates the resources associated with a watch
+ * Returns 0 on success or -1 on error
+ */
+int dir_watch_free(dir_watch_t *watch);
+
+#endif // DIR_WATCH_H
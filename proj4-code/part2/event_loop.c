@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "http.h"
+#include "server_stats.h"
+
+#define SWEEP_INTERVAL_MS 1000
+
+// Where a connection is in its request/response cycle
+typedef enum {
+    CONN_READING_HEADERS,
+    CONN_WRITING_HEADERS,
+    CONN_WRITING_BODY,
+} conn_state_t;
+
+// Per-connection state, also the epoll_event data pointer for its socket
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    http_conn_t http;
+    int n_requests;
+    int keep_alive;
+    long last_active;
+    http_response_t response;
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+// Connections owned by one loop thread, so no locking is needed
+// The list is kept in order of last activity, oldest first
+typedef struct {
+    event_loop_t *loop;
+    conn_t *head;
+    conn_t *tail;
+    int draining;       // Set once asked to stop: no more accepts or keep-alive
+    long deadline_ms;   // When draining gives up on the connections left
+} loop_state_t;
+
+static long now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void list_remove(loop_state_t *state, conn_t *conn) {
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        state->head = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    else
+        state->tail = conn->prev;
+}
+
+static void list_append(loop_state_t *state, conn_t *conn) {
+    conn->prev = state->tail;
+    conn->next = NULL;
+    if (state->tail != NULL)
+        state->tail->next = conn;
+    else
+        state->head = conn;
+    state->tail = conn;
+}
+
+static void conn_close(loop_state_t *state, conn_t *conn) {
+    if (conn->state != CONN_READING_HEADERS)
+        free_http_response(&conn->response);
+
+    // Closing the socket also removes it from the epoll set
+    if (close(conn->fd) == -1)
+        perror("close");
+
+    list_remove(state, conn);
+    free(conn);
+}
+
+// Sets up the response to a request
+// Returns 0 on success or -1 if the connection should be closed
+static int conn_start_response(loop_state_t *state, conn_t *conn, const http_request_t *request) {
+    event_loop_t *loop = state->loop;
+
+    conn->n_requests++;
+    conn->keep_alive = request->keep_alive && conn->n_requests < loop->max_requests &&
+                       !state->draining;
+    int prepared = prepare_request_response(&conn->response, request, conn->http.parsed_ns,
+                                            loop->paths, loop->cache, conn->keep_alive);
+    if (prepared == -1)
+        return -1;
+    if (prepared == 1)
+        conn->keep_alive = 0;
+
+    conn->state = CONN_WRITING_HEADERS;
+    return 0;
+}
+
+// Advances a connection's state machine as far as its socket allows
+static void conn_handle(loop_state_t *state, conn_t *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        conn_close(state, conn);
+        return;
+    }
+
+    // Move to the back of the idle list
+    conn->last_active = now_sec();
+    list_remove(state, conn);
+    list_append(state, conn);
+
+    while (1) {
+        if (conn->state == CONN_READING_HEADERS) {
+            // Pipelined requests are already buffered and need no read
+            http_request_t request;
+            int result = read_http_request(&conn->http, &request);
+            if (result == 2) {
+                // Nothing more is coming once the server is draining
+                if (state->draining && !http_conn_busy(&conn->http))
+                    conn_close(state, conn);
+                return;
+            }
+            if (result != 0 || conn_start_response(state, conn, &request) == -1) {
+                conn_close(state, conn);
+                return;
+            }
+        }
+
+        int result = continue_http_response(conn->fd, &conn->response);
+        if (result == 1) {
+            if (conn->response.headers_sent == conn->response.headers_len)
+                conn->state = CONN_WRITING_BODY;
+            return;
+        }
+
+        if (result == -1 || !conn->keep_alive) {
+            conn_close(state, conn);
+            return;
+        }
+
+        // Go back to reading; read_http_request() drops the answered request
+        free_http_response(&conn->response);
+        conn->state = CONN_READING_HEADERS;
+    }
+}
+
+// Closes connections that have made no progress within the idle timeout
+static void close_idle_connections(loop_state_t *state) {
+    long cutoff = now_sec() - state->loop->idle_timeout;
+    while (state->head != NULL && state->head->last_active <= cutoff)
+        conn_close(state, state->head);
+}
+
+// Stops accepting and closes the connections that are waiting for a request,
+// leaving those with one under way to finish
+static void start_draining(loop_state_t *state) {
+    event_loop_t *loop = state->loop;
+
+    state->draining = 1;
+    state->deadline_ms = now_ms() + loop->drain_timeout * 1000L;
+
+    // Shutting the listening socket down stops it listening, so new
+    // connections are refused and those in the backlog are reset
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL) == -1)
+        perror("epoll_ctl");
+    shutdown(loop->listen_fd, SHUT_RD);
+
+    conn_t *conn = state->head;
+    while (conn != NULL) {
+        conn_t *next = conn->next;
+        if (conn->state == CONN_READING_HEADERS && !http_conn_busy(&conn->http))
+            conn_close(state, conn);
+        conn = next;
+    }
+}
+
+// Accepts every pending connection on the loop's listening socket
+static void accept_connections(loop_state_t *state) {
+    event_loop_t *loop = state->loop;
+
+    while (1) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return;
+        }
+
+        conn_t *conn = malloc(sizeof(conn_t));
+        if (conn == NULL) {
+            perror("malloc");
+            close(client_fd);
+            continue;
+        }
+
+        conn->fd = client_fd;
+        conn->state = CONN_READING_HEADERS;
+        http_conn_init(&conn->http, client_fd);
+        conn->n_requests = 0;
+        conn->keep_alive = 0;
+        conn->last_active = now_sec();
+
+        // Edge triggered, so the state machine runs until the socket would block
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            perror("epoll_ctl");
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+
+        list_append(state, conn);
+    }
+}
+
+void *event_loop_func(void *arg) {
+    loop_state_t state;
+    state.loop = (event_loop_t *) arg;
+    state.head = NULL;
+    state.tail = NULL;
+    state.draining = 0;
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    while (1) {
+        int timeout = SWEEP_INTERVAL_MS;
+        if (state.draining) {
+            long remaining = state.deadline_ms - now_ms();
+            if (state.head == NULL || remaining <= 0)
+                break;
+            if (remaining < timeout)
+                timeout = remaining;
+        }
+
+        int n_events = epoll_wait(state.loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        if (n_events == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        // Connections are only closed by others once the batch is handled, as
+        // a later event in it may be theirs
+        int woken = 0;
+        for (int i = 0; i < n_events; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &state.loop->wake_fd) {
+                uint64_t count;
+                if (read(state.loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    perror("read");
+                woken = 1;
+            } else if (ptr == &state.loop->listen_fd) {
+                accept_connections(&state);
+            } else {
+                conn_handle(&state, ptr, events[i].events);
+            }
+        }
+
+        if (woken && !state.draining)
+            start_draining(&state);
+        close_idle_connections(&state);
+    }
+
+    // Clean up any connections still open, which didn't finish in time
+    while (state.head != NULL) {
+        if (state.head->state != CONN_READING_HEADERS || http_conn_busy(&state.head->http))
+            stats_count(dropped, 1);
+        conn_close(&state, state.head);
+    }
+
+    return NULL;
+}
+
+int event_loop_init(event_loop_t *loop, int listen_fd, path_cache_t *paths,
+                    file_cache_t *cache, int idle_timeout, int max_requests,
+                    int drain_timeout) {
+    loop->listen_fd = listen_fd;
+    loop->paths = paths;
+    loop->cache = cache;
+    loop->idle_timeout = idle_timeout;
+    loop->max_requests = max_requests;
+    loop->drain_timeout = drain_timeout;
+
+    // Accepting must never block the loop
+    int flags = fcntl(listen_fd, F_GETFL);
+    if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        perror("eventfd");
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // The listening socket and eventfd are told apart from connections by
+    // pointing at their fields in the loop
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &loop->listen_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &loop->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_start(event_loop_t *loop) {
+    int result = pthread_create(&loop->thread, NULL, event_loop_func, loop);
+    if (result) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_drain(event_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_stop(event_loop_t *loop) {
+    int ret_val = 0;
+
+    if (event_loop_drain(loop) == -1)
+        ret_val = -1;
+
+    int result = pthread_join(loop->thread, NULL);
+    if (result) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
+
+int event_loop_free(event_loop_t *loop) {
+    int ret_val = 0;
+
+    if (close(loop->wake_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+
+    if (close(loop->epoll_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
@@ -0,0 +1,72 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+
+#include "file_cache.h"
+
+#define EVENT_LOOP_MAX_EVENTS 64
+
+// A single-threaded, epoll-driven HTTP server loop
+// Each loop owns its own listening socket (normally bound with SO_REUSEPORT
+// so the kernel spreads connections across loops) and serves any number of
+// non-blocking connections from one thread
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;    // eventfd written to ask the loop to stop
+    path_cache_t *paths;    // Resolves paths within the served directory
+    file_cache_t *cache;
+    int idle_timeout;   // Seconds a connection may go without progress
+    int max_requests;   // Requests served on one connection before closing it
+    int drain_timeout;  // Seconds connections get to finish once stopping
+    pthread_t thread;
+} event_loop_t;
+
+/*
+ * Initialize an event loop
+ * loop: Pointer to event_loop_t to be initialized
+ * listen_fd: Listening socket the loop accepts connections from, made
+ * non-blocking by this call
+ * paths: Resolves paths within the directory the resources are served from
+ * cache: File cache to serve from, or NULL
+ * idle_timeout: Seconds after which a connection making no progress is closed
+ * max_requests: Number of keep-alive requests served on one connection
+ * drain_timeout: Seconds requests under way get to finish once the loop is
+ * asked to stop
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_init(event_loop_t *loop, int listen_fd, path_cache_t *paths,
+                    file_cache_t *cache, int idle_timeout, int max_requests,
+                    int drain_timeout);
+
+/*
+ * Start running an event loop on a new thread
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_start(event_loop_t *loop);
+
+/*
+ * Ask a running event loop to drain without waiting for it: it stops
+ * accepting, closes idle connections, and closes the rest as soon as their
+ * current request is answered. Those still open after the drain timeout are
+ * closed anyway and counted as dropped.
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_drain(event_loop_t *loop);
+
+/*
+ * Drain a running event loop, if not already asked to, and wait for its
+ * thread to exit
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_stop(event_loop_t *loop);
+
+/*
+ * Deallocates the resources associated with an event loop. The listening
+ * socket is not closed.
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_free(event_loop_t *loop);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,680 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "file_cache.h"
+#include "http.h"
+#include "server_stats.h"
+
+// FNV-1a hash of a path
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Current monotonic time in seconds, read without a system call
+static long now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int same_mtime(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Stands in for a variant that isn't worth serving, so it isn't tried again
+static file_cache_variant_t no_variant;
+
+static void free_variant(file_cache_variant_t *variant) {
+    if (variant != NULL && variant != &no_variant) {
+        free(variant->data);
+        free(variant);
+    }
+}
+
+static void free_entry(file_cache_entry_t *entry) {
+    for (int i = 0; i < N_ENCODINGS; i++)
+        free_variant(atomic_load(&entry->variants[i]));
+    if (entry->mmapped)
+        munmap(entry->data, entry->size);
+    else
+        free(entry->data);
+    if (entry->fd != -1 && close(entry->fd) == -1)
+        perror("close");
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * Read an open file's contents into an entry, with mmap() if it is large
+ * Returns 0 on success or -1 on error
+ */
+static int read_contents(file_cache_entry_t *entry, int fd) {
+    if (entry->size >= FILE_CACHE_MMAP_MIN) {
+        entry->data = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (entry->data == MAP_FAILED) {
+            perror("mmap");
+            entry->data = NULL;
+            return -1;
+        }
+        entry->mmapped = 1;
+    } else if (entry->size > 0) {
+        entry->data = malloc(entry->size);
+        if (entry->data == NULL) {
+            perror("malloc");
+            return -1;
+        }
+
+        size_t total = 0;
+        while (total < entry->size) {
+            ssize_t bytes = pread(fd, entry->data + total, entry->size - total, total);
+            if (bytes <= 0) {
+                if (bytes == -1 && errno == EINTR)
+                    continue;
+                if (bytes == -1)
+                    perror("read");
+                return -1;
+            }
+            total += bytes;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read a file into a new, unlinked cache entry, or if it is too large to hold
+ * in memory, keep it open in one
+ * fd: The file, if the caller has opened it already, or -1 to open it here
+ * Returns the entry with a reference count of 1, which now owns 'fd', or NULL
+ * if the file can't or shouldn't be cached, leaving a caller's 'fd' open
+ */
+static file_cache_entry_t *load_entry(file_cache_t *cache, const char *path, int fd) {
+    size_t max_size = FILE_CACHE_MAX_ENTRY < cache->shard_max_bytes ? FILE_CACHE_MAX_ENTRY
+                                                                    : cache->shard_max_bytes;
+    path_info_t info;
+    if (path_cache_stat(cache->paths, path, &info) == -1) {
+        if (!path_error_not_found(errno))
+            perror("stat");
+        return NULL;
+    }
+    if (!S_ISREG(info.mode) || (info.size > max_size && cache->shard_max_fds == 0))
+        return NULL;
+
+    int opened = fd == -1;
+    if (opened) {
+        fd = path_cache_open(cache->paths, path, O_RDONLY);
+        if (fd == -1) {
+            if (!path_error_not_found(errno))
+                perror("open");
+            return NULL;
+        }
+    }
+
+    // Stat the open file so the recorded mtime matches the contents we read.
+    // If it isn't the file the path cache knows, one of them is out of date,
+    // and entries are only revalidated against the path cache.
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode) ||
+        (statbuf.st_size > max_size && cache->shard_max_fds == 0) ||
+        statbuf.st_ino != info.ino || statbuf.st_size != info.size ||
+        !same_mtime(&statbuf.st_mtim, &info.mtime)) {
+        if (opened)
+            close(fd);
+        return NULL;
+    }
+
+    file_cache_entry_t *entry = calloc(1, sizeof(file_cache_entry_t));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        perror("calloc");
+        free(entry);
+        if (opened)
+            close(fd);
+        return NULL;
+    }
+    entry->size = statbuf.st_size;
+    entry->fd = -1;
+
+    if (entry->size > max_size) {
+        // Keep the file open instead, for requests to share with sendfile
+        entry->fd = fd;
+    } else if (read_contents(entry, fd) == -1) {
+        if (opened)
+            close(fd);
+        free_entry(entry);
+        return NULL;
+    } else if (close(fd) == -1) {
+        perror("close");
+    }
+
+    entry->mtime = statbuf.st_mtim;
+    entry->ino = statbuf.st_ino;
+    entry->mime_type = get_mime_type(path);
+    http_file_info_t file_info = { entry->size, entry->mtime, entry->ino };
+    int len = render_file_headers(entry->headers, FILE_CACHE_HEADER_LEN, entry->mime_type,
+                                  &file_info, NULL, entry->size);
+    if (len == -1) {
+        if (!opened)
+            entry->fd = -1;
+        free_entry(entry);
+        return NULL;
+    }
+    entry->headers_len = len;
+
+    atomic_init(&entry->refcount, 1);
+    atomic_init(&entry->referenced, 1);
+    atomic_init(&entry->checked, now_sec());
+    return entry;
+}
+
+// Memory an entry's contents take, which a file kept open doesn't
+static size_t entry_bytes(const file_cache_entry_t *entry) {
+    return entry->fd == -1 ? entry->size : 0;
+}
+
+// Finds an entry in a shard, caller must hold the shard's lock
+static file_cache_entry_t *shard_find(file_cache_shard_t *shard, uint32_t hash, const char *path) {
+    file_cache_entry_t *entry = shard->buckets[hash % FILE_CACHE_BUCKETS];
+    while (entry != NULL && strcmp(entry->path, path) != 0)
+        entry = entry->next;
+    return entry;
+}
+
+// Unlinks an entry from a shard and drops the cache's reference to it
+// Caller must hold the shard's write lock
+static void shard_remove(file_cache_shard_t *shard, file_cache_entry_t *entry) {
+    file_cache_entry_t **link = &shard->buckets[hash_path(entry->path) % FILE_CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+
+    // Fill the hole in the ring with the last entry
+    file_cache_entry_t *last = shard->ring[--shard->ring_len];
+    shard->ring[entry->ring_idx] = last;
+    last->ring_idx = entry->ring_idx;
+    if (shard->hand >= shard->ring_len)
+        shard->hand = 0;
+
+    shard->bytes -= entry_bytes(entry) + entry->variant_bytes;
+    if (entry->fd != -1)
+        shard->n_fds--;
+    file_cache_release(entry);
+}
+
+// Evicts entries with the CLOCK algorithm until 'needed' more bytes and
+// 'needed_fds' more open files fit
+// Caller must hold the shard's write lock
+static void shard_make_room(file_cache_t *cache, file_cache_shard_t *shard, size_t needed,
+                            int needed_fds) {
+    while (shard->ring_len > 0 && (shard->bytes + needed > cache->shard_max_bytes ||
+                                   shard->n_fds + needed_fds > cache->shard_max_fds)) {
+        file_cache_entry_t *entry = shard->ring[shard->hand];
+        if (atomic_exchange(&entry->referenced, 0)) {
+            // Recently used, give it a second chance
+            if (++shard->hand >= shard->ring_len)
+                shard->hand = 0;
+        } else {
+            shard_remove(shard, entry);
+        }
+    }
+}
+
+/*
+ * Adds a freshly loaded entry to a shard unless another thread beat us to it
+ * generation: The shard's generation from before the file was loaded; if it
+ * has been invalidated since, the entry may be stale and is served uncached
+ * Returns the entry now in the cache with a reference held for the caller
+ */
+static file_cache_entry_t *shard_insert(file_cache_t *cache, file_cache_shard_t *shard,
+                                        uint32_t hash, file_cache_entry_t *entry,
+                                        unsigned long generation) {
+    int result = pthread_rwlock_wrlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+        return entry;
+    }
+
+    if (atomic_load(&shard->generation) != generation) {
+        pthread_rwlock_unlock(&shard->lock);
+        return entry;
+    }
+
+    file_cache_entry_t *existing = shard_find(shard, hash, entry->path);
+    if (existing != NULL) {
+        if (same_mtime(&existing->mtime, &entry->mtime)) {
+            atomic_fetch_add(&existing->refcount, 1);
+            pthread_rwlock_unlock(&shard->lock);
+            file_cache_release(entry);
+            return existing;
+        }
+        shard_remove(shard, existing);
+    }
+
+    // Grow the ring if needed; on failure just serve the entry uncached
+    if (shard->ring_len == shard->ring_cap) {
+        int new_cap = shard->ring_cap ? shard->ring_cap * 2 : 16;
+        file_cache_entry_t **ring = realloc(shard->ring, new_cap * sizeof(*ring));
+        if (ring == NULL) {
+            perror("realloc");
+            pthread_rwlock_unlock(&shard->lock);
+            return entry;
+        }
+        shard->ring = ring;
+        shard->ring_cap = new_cap;
+    }
+
+    int fds = entry->fd != -1;
+    shard_make_room(cache, shard, entry_bytes(entry), fds);
+
+    entry->next = shard->buckets[hash % FILE_CACHE_BUCKETS];
+    shard->buckets[hash % FILE_CACHE_BUCKETS] = entry;
+    entry->ring_idx = shard->ring_len;
+    shard->ring[shard->ring_len++] = entry;
+    shard->bytes += entry_bytes(entry);
+    shard->n_fds += fds;
+
+    // One reference for the cache, one for the caller
+    atomic_fetch_add(&entry->refcount, 1);
+
+    pthread_rwlock_unlock(&shard->lock);
+    return entry;
+}
+
+// Drops a stale entry from its shard if it is still the cached version
+static void shard_invalidate(file_cache_shard_t *shard, uint32_t hash, file_cache_entry_t *stale) {
+    int result = pthread_rwlock_wrlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+        return;
+    }
+
+    if (shard_find(shard, hash, stale->path) == stale)
+        shard_remove(shard, stale);
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/*
+ * Checks that a cached entry still matches the file on disk, at most once
+ * every FILE_CACHE_REVALIDATE_SEC seconds, as seen through the path cache
+ * Returns 1 if the entry can be used, 0 if it is stale
+ */
+static int entry_is_fresh(file_cache_t *cache, file_cache_entry_t *entry) {
+    if (cache->watch != NULL && dir_watch_complete(cache->watch))
+        return 1;
+
+    long now = now_sec();
+    long checked = atomic_load_explicit(&entry->checked, memory_order_relaxed);
+    if (now - checked < FILE_CACHE_REVALIDATE_SEC)
+        return 1;
+
+    // Only one thread needs to do the check
+    if (!atomic_compare_exchange_strong(&entry->checked, &checked, now))
+        return 1;
+
+    path_info_t info;
+    if (path_cache_stat(cache->paths, entry->path, &info) == -1)
+        return 0;
+    return same_mtime(&info.mtime, &entry->mtime) && info.size == entry->size &&
+           info.ino == entry->ino;
+}
+
+int file_cache_init(file_cache_t *cache, size_t max_bytes, int max_fds, path_cache_t *paths) {
+    int result;
+
+    cache->paths = paths;
+    cache->watch = NULL;
+    cache->shard_max_bytes = max_bytes / FILE_CACHE_SHARDS;
+    cache->shard_max_fds = max_fds > 0 && max_fds < FILE_CACHE_SHARDS ? 1
+                                                                      : max_fds / FILE_CACHE_SHARDS;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->ring = NULL;
+        shard->ring_len = 0;
+        shard->ring_cap = 0;
+        shard->hand = 0;
+        shard->bytes = 0;
+        shard->n_fds = 0;
+        atomic_init(&shard->generation, 0);
+
+        result = pthread_rwlock_init(&shard->lock, NULL);
+        if (result) {
+            fprintf(stderr, "pthread_rwlock_init: %s\n", strerror(result));
+            for (int j = 0; j < i; j++)
+                pthread_rwlock_destroy(&cache->shards[j].lock);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+file_cache_entry_t *file_cache_find(file_cache_t *cache, const char *path) {
+    int result;
+    uint32_t hash = hash_path(path);
+    file_cache_shard_t *shard = &cache->shards[hash % FILE_CACHE_SHARDS];
+
+    // Fast path: shared lock only
+    result = pthread_rwlock_rdlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_rdlock: %s\n", strerror(result));
+        return NULL;
+    }
+
+    file_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refcount, 1);
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        if (entry_is_fresh(cache, entry)) {
+            stats_count(file_cache_hits, 1);
+            return entry;
+        }
+        shard_invalidate(shard, hash, entry);
+        file_cache_release(entry);
+    }
+
+    stats_count(file_cache_misses, 1);
+    return NULL;
+}
+
+file_cache_entry_t *file_cache_load(file_cache_t *cache, const char *path) {
+    uint32_t hash = hash_path(path);
+    file_cache_shard_t *shard = &cache->shards[hash % FILE_CACHE_SHARDS];
+
+    unsigned long generation = atomic_load(&shard->generation);
+    file_cache_entry_t *entry = load_entry(cache, path, -1);
+    if (entry == NULL)
+        return NULL;
+
+    return shard_insert(cache, shard, hash, entry, generation);
+}
+
+file_cache_entry_t *file_cache_adopt(file_cache_t *cache, const char *path, int fd) {
+    uint32_t hash = hash_path(path);
+    file_cache_shard_t *shard = &cache->shards[hash % FILE_CACHE_SHARDS];
+
+    unsigned long generation = atomic_load(&shard->generation);
+    file_cache_entry_t *entry = load_entry(cache, path, fd);
+    if (entry == NULL)
+        return NULL;
+
+    return shard_insert(cache, shard, hash, entry, generation);
+}
+
+file_cache_entry_t *file_cache_get(file_cache_t *cache, const char *path) {
+    file_cache_entry_t *entry = file_cache_find(cache, path);
+    if (entry != NULL)
+        return entry;
+    return file_cache_load(cache, path);
+}
+
+/*
+ * Read a precompressed "<path>.gz" sibling of an entry's file into 'variant'
+ * if there is one no older than the file and smaller than it
+ * Returns 1 if it was read, 0 if there is no usable sibling
+ */
+static int read_gzip_sibling(path_cache_t *paths, file_cache_entry_t *entry,
+                             file_cache_variant_t *variant) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.gz", entry->path) >= sizeof(path))
+        return 0;
+
+    // Not blocking should the sibling be a FIFO
+    int fd = path_cache_open(paths, path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
+        return 0;
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode) ||
+        statbuf.st_size >= entry->size || statbuf.st_mtim.tv_sec < entry->mtime.tv_sec ||
+        (variant->data = malloc(statbuf.st_size > 0 ? statbuf.st_size : 1)) == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    size_t total = 0;
+    while (total < statbuf.st_size) {
+        ssize_t bytes = pread(fd, variant->data + total, statbuf.st_size - total, total);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR)
+                continue;
+            if (bytes == -1)
+                perror("read");
+            close(fd);
+            free(variant->data);
+            variant->data = NULL;
+            return 0;
+        }
+        total += bytes;
+    }
+    close(fd);
+
+    variant->size = total;
+    return 1;
+}
+
+/*
+ * Compress an entry's contents into 'variant' with zlib, in the gzip or zlib
+ * format
+ * Returns 1 if the result is smaller than the original, 0 if not, or -1 on
+ * error
+ */
+static int compress_entry(file_cache_entry_t *entry, content_encoding_t encoding,
+                          file_cache_variant_t *variant) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // Window bits 15, plus 16 for a gzip rather than a zlib wrapper
+    int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+    int result = deflateInit2(&stream, FILE_CACHE_COMPRESS_LEVEL, Z_DEFLATED, window_bits, 8,
+                              Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        fprintf(stderr, "deflateInit2: %s\n", zError(result));
+        return -1;
+    }
+
+    // Anything that doesn't fit in one byte less than the original isn't
+    // worth sending
+    variant->data = malloc(entry->size - 1);
+    if (variant->data == NULL) {
+        perror("malloc");
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in = (Bytef *) entry->data;
+    stream.avail_in = entry->size;
+    stream.next_out = (Bytef *) variant->data;
+    stream.avail_out = entry->size - 1;
+    result = deflate(&stream, Z_FINISH);
+    variant->size = stream.total_out;
+    deflateEnd(&stream);
+
+    if (result == Z_STREAM_END)
+        return 1;
+
+    free(variant->data);
+    variant->data = NULL;
+    if (result == Z_OK || result == Z_BUF_ERROR)
+        return 0;
+    fprintf(stderr, "deflate: %s\n", zError(result));
+    return -1;
+}
+
+/*
+ * Make a new variant of an entry in a content coding
+ * Returns the variant, &no_variant if the entry isn't worth encoding, or NULL
+ * on error
+ */
+static file_cache_variant_t *make_variant(path_cache_t *paths, file_cache_entry_t *entry,
+                                          content_encoding_t encoding) {
+    if (entry->fd != -1 || entry->size < FILE_CACHE_COMPRESS_MIN ||
+        !http_mime_compressible(entry->mime_type))
+        return &no_variant;
+
+    file_cache_variant_t *variant = calloc(1, sizeof(file_cache_variant_t));
+    if (variant == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (encoding != ENCODING_GZIP || !read_gzip_sibling(paths, entry, variant)) {
+        int result = compress_entry(entry, encoding, variant);
+        if (result != 1) {
+            free(variant);
+            return result == 0 ? &no_variant : NULL;
+        }
+    }
+
+    http_file_info_t info = { entry->size, entry->mtime, entry->ino };
+    int len = render_file_headers(variant->headers, FILE_CACHE_HEADER_LEN, entry->mime_type,
+                                  &info, http_encoding_name(encoding), variant->size);
+    if (len == -1) {
+        free_variant(variant);
+        return NULL;
+    }
+    variant->headers_len = len;
+    return variant;
+}
+
+file_cache_variant_t *file_cache_variant(file_cache_t *cache, file_cache_entry_t *entry,
+                                         content_encoding_t encoding) {
+    file_cache_variant_t *variant = atomic_load(&entry->variants[encoding]);
+    if (variant != NULL)
+        return variant != &no_variant ? variant : NULL;
+
+    variant = make_variant(cache->paths, entry, encoding);
+    if (variant == NULL)
+        return NULL;
+
+    // Another thread may have made the same variant in the meantime
+    file_cache_variant_t *expected = NULL;
+    if (!atomic_compare_exchange_strong(&entry->variants[encoding], &expected, variant)) {
+        free_variant(variant);
+        return expected != &no_variant ? expected : NULL;
+    }
+    if (variant == &no_variant)
+        return NULL;
+
+    // Count the variant against its shard, unless the entry has been evicted
+    // already, in which case it goes when the entry is freed
+    uint32_t hash = hash_path(entry->path);
+    file_cache_shard_t *shard = &cache->shards[hash % FILE_CACHE_SHARDS];
+    int result = pthread_rwlock_wrlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+        return variant;
+    }
+    if (shard_find(shard, hash, entry->path) == entry) {
+        shard_make_room(cache, shard, variant->size, 0);
+        if (shard_find(shard, hash, entry->path) == entry) {
+            shard->bytes += variant->size;
+            entry->variant_bytes += variant->size;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return variant;
+}
+
+void file_cache_release(file_cache_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refcount, 1) == 1)
+        free_entry(entry);
+}
+
+
+int file_cache_free(file_cache_t *cache) {
+    int ret_val = 0;
+    int result;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        for (int j = 0; j < shard->ring_len; j++)
+            file_cache_release(shard->ring[j]);
+        free(shard->ring);
+
+        result = pthread_rwlock_destroy(&shard->lock);
+        if (result) {
+            fprintf(stderr, "pthread_rwlock_destroy: %s\n", strerror(result));
+            ret_val = -1;
+        }
+    }
+
+    return ret_val;
+}
+
+// Drops a path's entry, or every entry if 'path' is NULL, from a shard
+static void shard_drop(file_cache_shard_t *shard, uint32_t hash, const char *path) {
+    int result = pthread_rwlock_wrlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+        return;
+    }
+
+    if (path == NULL) {
+        while (shard->ring_len > 0)
+            shard_remove(shard, shard->ring[shard->ring_len - 1]);
+    } else {
+        file_cache_entry_t *entry = shard_find(shard, hash, path);
+        if (entry != NULL)
+            shard_remove(shard, entry);
+    }
+    // Anything being loaded meanwhile may predate the change
+    atomic_fetch_add(&shard->generation, 1);
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void file_cache_invalidate(file_cache_t *cache, const char *path) {
+    if (path == NULL) {
+        for (int i = 0; i < FILE_CACHE_SHARDS; i++)
+            shard_drop(&cache->shards[i], 0, NULL);
+        return;
+    }
+
+    uint32_t hash = hash_path(path);
+    shard_drop(&cache->shards[hash % FILE_CACHE_SHARDS], hash, path);
+
+    // A precompressed sibling is served as the gzip variant of its file
+    size_t len = strlen(path);
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+        char base[PATH_MAX];
+        if (len - 3 < sizeof(base)) {
+            memcpy(base, path, len - 3);
+            base[len - 3] = '\0';
+            hash = hash_path(base);
+            shard_drop(&cache->shards[hash % FILE_CACHE_SHARDS], hash, base);
+        }
+    }
+}
+
+static void invalidate_listener(void *arg, const char *path) {
+    file_cache_invalidate(arg, path);
+}
+
+int file_cache_watch(file_cache_t *cache, dir_watch_t *watch) {
+    if (dir_watch_listen(watch, invalidate_listener, cache) == -1)
+        return -1;
+    cache->watch = watch;
+    return 0;
+}
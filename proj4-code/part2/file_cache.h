@@ -0,0 +1,179 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "path_cache.h"
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256          // Hash buckets per shard
+#define FILE_CACHE_HEADER_LEN 384
+#define FILE_CACHE_MAX_BYTES (64 << 20) // Total budget for cached file contents
+#define FILE_CACHE_MAX_ENTRY (4 << 20)  // Larger files are kept open rather than read in
+#define FILE_CACHE_MAX_FDS 1024         // Default limit on files kept open
+#define FILE_CACHE_MMAP_MIN (64 << 10)  // Files at least this big are mmap()ed
+#define FILE_CACHE_REVALIDATE_SEC 1     // How often a hit re-checks the mtime
+#define FILE_CACHE_COMPRESS_MIN 256     // Smaller files are never compressed
+#define FILE_CACHE_COMPRESS_LEVEL 6
+
+// Content codings a cached file can also be served in
+typedef enum {
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,   // The zlib format, as HTTP's "deflate" means
+    N_ENCODINGS,
+} content_encoding_t;
+
+// A cached file's contents in one content coding, with pre-rendered headers
+// Owned by its entry and freed with it
+typedef struct {
+    char *data;
+    size_t size;
+    char headers[FILE_CACHE_HEADER_LEN];
+    size_t headers_len;
+} file_cache_variant_t;
+
+// A cached file's contents and pre-rendered response headers
+// Files too large to hold in memory are kept open instead, with their
+// contents NULL, so any number of requests can send them with sendfile() or
+// splice() without opening or stat()ing them again
+// Entries are reference counted; a holder may keep using an entry after it
+// has been evicted, and the memory (or the file descriptor) is released by the
+// last file_cache_release()
+typedef struct file_cache_entry {
+    char *path;
+    char *data;
+    size_t size;
+    int mmapped;
+    int fd;                 // Open file for an entry without contents, or -1
+    struct timespec mtime;
+    ino_t ino;
+    const char *mime_type;
+    char headers[FILE_CACHE_HEADER_LEN];
+    size_t headers_len;
+
+    // Encoded variants, made on first request; a variant that isn't worth
+    // serving is recorded as such so it isn't tried again
+    _Atomic(file_cache_variant_t *) variants[N_ENCODINGS];
+    size_t variant_bytes;   // Counted against the shard, under its write lock
+
+    atomic_int refcount;
+    atomic_int referenced;  // CLOCK reference bit
+    atomic_long checked;    // Monotonic second of the last mtime check
+
+    struct file_cache_entry *next;  // Hash chain within a shard
+    int ring_idx;                   // Position in the shard's CLOCK ring
+} file_cache_entry_t;
+
+// One independently locked slice of the cache
+typedef struct {
+    pthread_rwlock_t lock;
+    file_cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+
+    // Entries in insertion order for CLOCK eviction
+    file_cache_entry_t **ring;
+    int ring_len;
+    int ring_cap;
+    int hand;
+
+    size_t bytes;
+    int n_fds;              // Entries holding an open file
+    atomic_ulong generation;    // Bumped whenever a path in the shard is invalidated
+} file_cache_shard_t;
+
+// Thread-safe cache of file contents and open files keyed by path, bounded in
+// both memory and file descriptors. Entries are revalidated on a timer, or
+// with a complete directory watch, trusted until the watch invalidates them.
+typedef struct {
+    path_cache_t *paths;    // Where files are looked up and opened
+    dir_watch_t *watch;     // Invalidates changed files, or NULL
+    file_cache_shard_t shards[FILE_CACHE_SHARDS];
+    size_t shard_max_bytes;
+    int shard_max_fds;
+} file_cache_t;
+
+/*
+ * Initialize an empty file cache
+ * cache: Pointer to the file_cache_t to be initialized
+ * max_bytes: Maximum total size of cached file contents
+ * max_fds: Maximum number of files too large to read in that are kept open
+ * (0 not to keep any)
+ * paths: Resolves the paths files are cached under, relative to the served
+ * directory
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_init(file_cache_t *cache, size_t max_bytes, int max_fds, path_cache_t *paths);
+
+/*
+ * Look up a file in the cache, loading it on a miss. A hit whose entry was
+ * validated within the last FILE_CACHE_REVALIDATE_SEC seconds, or is covered
+ * by a complete directory watch, makes no system calls. The returned entry
+ * must be released with file_cache_release().
+ * cache: The cache to look in
+ * path: Path of the file relative to the served directory, normalized
+ * Returns the entry on success, or NULL if the file does not exist, is not a
+ * regular file, is too large to read in when no files may be kept open, or an
+ * error occurred
+ */
+file_cache_entry_t *file_cache_get(file_cache_t *cache, const char *path);
+
+/*
+ * The two halves of file_cache_get(), for callers that must not block on a
+ * miss. file_cache_find() only looks the file up, counting a hit or a miss.
+ * file_cache_load() reads the file into the cache (or finds that another
+ * thread already has) without counting either.
+ * Both return the entry, to be released with file_cache_release(), or NULL
+ */
+file_cache_entry_t *file_cache_find(file_cache_t *cache, const char *path);
+file_cache_entry_t *file_cache_load(file_cache_t *cache, const char *path);
+
+/*
+ * Like file_cache_load(), for a file the caller has opened already
+ * fd: The open file; taken over by the cache on success, and still the
+ * caller's if NULL is returned
+ */
+file_cache_entry_t *file_cache_adopt(file_cache_t *cache, const char *path, int fd);
+
+/*
+ * Get a cached file's contents in a content coding, making the variant on
+ * first use: a gzip variant comes from a "<path>.gz" sibling no older than the
+ * file if there is one, anything else is compressed here. Variants count
+ * against the cache's size budget and go when their entry does.
+ * cache: The cache 'entry' came from
+ * entry: An entry the caller holds a reference to
+ * encoding: The content coding wanted
+ * Returns the variant, valid while the reference to 'entry' is held, or NULL
+ * if the file shouldn't be served encoded (its type is already compressed,
+ * or encoding wouldn't make it smaller) or an error occurred
+ */
+file_cache_variant_t *file_cache_variant(file_cache_t *cache, file_cache_entry_t *entry,
+                                         content_encoding_t encoding);
+
+/*
+ * Drop a reference obtained from file_cache_get()
+ */
+void file_cache_release(file_cache_entry_t *entry);
+
+/*
+ * Deallocates all cached entries and the cache's locks
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_free(file_cache_t *cache);
+
+/*
+ * Drop a file's entry, with its compressed variants
+ * path: The file that changed, or NULL to drop every entry
+ */
+void file_cache_invalidate(file_cache_t *cache, const char *path);
+
+/*
+ * Have a directory watch invalidate the cache, which then trusts entries for
+ * as long as the watch is complete. Must be called before the watch is
+ * started.
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_watch(file_cache_t *cache, dir_watch_t *watch);
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,87 @@
+#include "histogram.h"
+
+// Maps a value to its bucket: values below HISTOGRAM_SUB_BUCKETS get a bucket
+// each, larger ones are found by their top HISTOGRAM_SUB_BITS + 1 bits
+static int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    int exp = 63 - __builtin_clzll(value);
+    int shift = exp - HISTOGRAM_SUB_BITS;
+    int sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that maps to a bucket
+static uint64_t bucket_upper(int idx) {
+    if (idx < HISTOGRAM_SUB_BUCKETS)
+        return idx;
+
+    int shift = idx / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = idx % HISTOGRAM_SUB_BUCKETS;
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_init(histogram_t *hist) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_init(&hist->counts[i], 0);
+    atomic_init(&hist->total, 0);
+    atomic_init(&hist->max, 0);
+}
+
+void histogram_record(histogram_t *hist, uint64_t value) {
+    // With a single writer, a plain load and store is enough and avoids the
+    // cost of an atomic read-modify-write on every sample
+    atomic_ulong *count = &hist->counts[bucket_index(value)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&hist->total,
+                          atomic_load_explicit(&hist->total, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+}
+
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+    unsigned long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        unsigned long count = atomic_load_explicit(&src->counts[i], memory_order_relaxed);
+        atomic_fetch_add_explicit(&dst->counts[i], count, memory_order_relaxed);
+        total += count;
+    }
+
+    // Sum the buckets rather than reading src->total so the merged total
+    // always matches the merged counts
+    atomic_fetch_add_explicit(&dst->total, total, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&src->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&dst->max, memory_order_relaxed))
+        atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+}
+
+uint64_t histogram_quantile(const histogram_t *hist, double quantile) {
+    unsigned long total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    // Rank of the wanted value, counting from 1
+    unsigned long rank = (unsigned long) (quantile * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            // The top bucket's upper bound can overshoot the real maximum
+            uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+            uint64_t upper = bucket_upper(i);
+            return upper < max ? upper : max;
+        }
+    }
+
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
@@ -0,0 +1,46 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Each power of two is split into 2^HISTOGRAM_SUB_BITS linear buckets, so a
+// recorded value is off by at most 1/16 (about 6%) of itself
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Log-bucketed histogram of non-negative integer values (e.g. nanoseconds)
+// Written by one thread at a time without locks; other threads may read or
+// merge it concurrently and see a slightly stale but consistent-enough view
+typedef struct {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong max;
+} histogram_t;
+
+/*
+ * Initialize an empty histogram
+ */
+void histogram_init(histogram_t *hist);
+
+/*
+ * Add one value to a histogram. Only one thread may record into a given
+ * histogram at a time.
+ */
+void histogram_record(histogram_t *hist, uint64_t value);
+
+/*
+ * Add every value recorded in 'src' to 'dst'. 'dst' must not be recorded into
+ * concurrently.
+ */
+void histogram_merge(histogram_t *dst, const histogram_t *src);
+
+/*
+ * Find the value below which a fraction 'quantile' (0 to 1) of recorded
+ * values fall, rounded up to the end of its bucket
+ * Returns the value, or 0 if the histogram is empty
+ */
+uint64_t histogram_quantile(const histogram_t *hist, double quantile);
+
+#endif // HISTOGRAM_H
@@ -1,185 +1,1115 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
+#include "file_cache.h"
 #include "http.h"
+#include "mime_types.h"
+#include "server_stats.h"
 
 #define BUFSIZE 512
+#define STATS_BUFSIZE 2048
+
+const char *get_mime_type(const char *path) {
+    // The extension follows the last '.' of the file name itself
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+        const char *mime_type = mime_types_lookup(extension + 1);
+        if (mime_type != NULL)
+            return mime_type;
+    }
+    return MIME_TYPE_DEFAULT;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t bytes = write(fd, pos, len);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+/*
+ * Copy file contents to the socket with sendfile(2)
+ * Returns 0 on success, -1 on error, or 1 if sendfile is unsupported for
+ * these descriptors and nothing has been sent yet
+ */
+static int send_body_sendfile(int fd, int file_fd, off_t offset, off_t length) {
+    off_t remaining = length;
+    while (remaining > 0) {
+        ssize_t bytes = sendfile(fd, file_fd, &offset, remaining);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EINVAL || errno == ENOSYS) && remaining == length)
+                return 1;
+            perror("sendfile");
+            return -1;
+        }
+
+        // File shrank while we were sending it
+        if (bytes == 0) {
+            fprintf(stderr, "sendfile: unexpected end of file\n");
+            return -1;
+        }
 
-const char *get_mime_type(const char *file_extension) {
-    if (strcmp(".txt", file_extension) == 0) {
-        return "text/plain";
-    } else if (strcmp(".html", file_extension) == 0) {
-        return "text/html";
-    } else if (strcmp(".jpg", file_extension) == 0) {
-        return "image/jpeg";
-    } else if (strcmp(".png", file_extension) == 0) {
-        return "image/png";
-    } else if (strcmp(".pdf", file_extension) == 0) {
-        return "application/pdf";
+        remaining -= bytes;
+    }
+    return 0;
+}
+
+/*
+ * Copy file contents to the socket with splice(2) through an intermediate pipe
+ * Returns 0 on success, -1 on error, or 1 if splice is unsupported for
+ * these descriptors and nothing has been sent yet
+ */
+static int send_body_splice(int fd, int file_fd, off_t offset, off_t length) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    int ret_val = 0;
+    off_t remaining = length;
+    while (remaining > 0) {
+        // Move a chunk of the file into the pipe
+        ssize_t in_pipe = splice(file_fd, &offset, pipe_fds[1], NULL,
+                                 remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EINVAL || errno == ENOSYS) && remaining == length) {
+                ret_val = 1;
+                break;
+            }
+            perror("splice");
+            ret_val = -1;
+            break;
+        }
+
+        if (in_pipe == 0) {
+            fprintf(stderr, "splice: unexpected end of file\n");
+            ret_val = -1;
+            break;
+        }
+
+        // Drain the pipe into the socket, which may take several calls
+        while (in_pipe > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, fd, NULL, in_pipe,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("splice");
+                ret_val = -1;
+                break;
+            }
+            in_pipe -= out;
+            remaining -= out;
+        }
+
+        if (ret_val == -1)
+            break;
     }
 
-    return NULL;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return ret_val;
 }
 
-int read_http_request(int fd, char *resource_name) {
+/*
+ * Copy file contents to the socket through a user space buffer
+ * Returns 0 on success or -1 on error
+ */
+static int send_body_copy(int fd, int file_fd, off_t offset, off_t length) {
     char buf[BUFSIZE];
+    while (length > 0) {
+        size_t to_read = length < BUFSIZE ? length : BUFSIZE;
+        ssize_t bytes_read = pread(file_fd, buf, to_read, offset);
+        if (bytes_read == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return -1;
+        }
+
+        if (bytes_read == 0) {
+            fprintf(stderr, "read: unexpected end of file\n");
+            return -1;
+        }
+
+        if (write_all(fd, buf, bytes_read) == -1) {
+            perror("write");
+            return -1;
+        }
+
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+int write_file_body(int fd, int file_fd, off_t offset, off_t length, body_method_t method) {
+    int result;
+
+    if (method == BODY_AUTO || method == BODY_SENDFILE) {
+        result = send_body_sendfile(fd, file_fd, offset, length);
+        if (result != 1)
+            return result;
+        if (method == BODY_SENDFILE) {
+            fprintf(stderr, "sendfile: not supported for this file\n");
+            return -1;
+        }
+    }
+
+    if (method == BODY_AUTO || method == BODY_SPLICE) {
+        result = send_body_splice(fd, file_fd, offset, length);
+        if (result != 1)
+            return result;
+        if (method == BODY_SPLICE) {
+            fprintf(stderr, "splice: not supported for this file\n");
+            return -1;
+        }
+    }
+
+    return send_body_copy(fd, file_fd, offset, length);
+}
 
-    // Copy descriptor
-    int fd_copy = dup(fd);
-    if (fd_copy == -1) {
-        perror("dup");
+int render_http_headers(char *buf, size_t bufsize, const char *mime_type, off_t content_length) {
+    int len = snprintf(buf, bufsize, "HTTP/1.1 200 OK\r\n"
+                                     "Content-Type: %s\r\n"
+                                     "Content-Length: %jd\r\n",
+                                     mime_type, (intmax_t) content_length);
+    if (len < 0 || len >= bufsize) {
+        fprintf(stderr, "render_http_headers: headers too long\n");
         return -1;
     }
+    return len;
+}
+
+static const char *const encoding_names[N_ENCODINGS] = {
+    [ENCODING_GZIP] = "gzip",
+    [ENCODING_DEFLATE] = "deflate",
+};
+
+const char *http_encoding_name(content_encoding_t encoding) {
+    return encoding_names[encoding];
+}
+
+int http_mime_compressible(const char *mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 || strstr(mime_type, "json") != NULL ||
+           strstr(mime_type, "xml") != NULL || strstr(mime_type, "javascript") != NULL;
+}
+
+void http_format_etag(char *buf, const http_file_info_t *info, const char *encoding) {
+    // Each encoding of a file is a different representation with its own tag
+    uint64_t mtime_ns = (uint64_t) info->mtime.tv_sec * 1000000000 + info->mtime.tv_nsec;
+    snprintf(buf, HTTP_ETAG_LEN, "\"%jx-%jx-%jx%s%s\"", (uintmax_t) info->ino,
+             (uintmax_t) info->size, (uintmax_t) mtime_ns, encoding != NULL ? "-" : "",
+             encoding != NULL ? encoding : "");
+}
 
-    // Convert to file pointer to read line-by-line with fgets()
-    FILE *socket_stream = fdopen(fd_copy, "r");
-    if (socket_stream == NULL) {
-        perror("fdopen");
-        close(fd_copy);
+// Formats the headers every response for a file carries: validators, and
+// for types that may be compressed, the encoding or the fact that it varies
+// Returns the length written on success or -1 if 'buf' is too small
+static int render_representation(char *buf, size_t bufsize, const char *mime_type,
+                                 const http_file_info_t *info, const char *encoding) {
+    char etag[HTTP_ETAG_LEN];
+    char date[HTTP_DATE_LEN];
+    http_format_etag(etag, info, encoding);
+    http_format_date(date, info->mtime.tv_sec);
+
+    int len = snprintf(buf, bufsize, "Last-Modified: %s\r\n"
+                                     "ETag: %s\r\n"
+                                     "%s%s%s%s",
+                                     date, etag,
+                                     encoding != NULL ? "Content-Encoding: " : "",
+                                     encoding != NULL ? encoding : "",
+                                     encoding != NULL ? "\r\n" : "",
+                                     http_mime_compressible(mime_type)
+                                         ? "Vary: Accept-Encoding\r\n" : "");
+    if (len < 0 || len >= bufsize)
+        return -1;
+    return len;
+}
+
+int render_file_headers(char *buf, size_t bufsize, const char *mime_type,
+                        const http_file_info_t *info, const char *encoding,
+                        off_t content_length) {
+    char representation[HTTP_HEADER_BUFSIZE];
+    int len = render_representation(representation, sizeof(representation), mime_type, info,
+                                    encoding);
+    if (len != -1)
+        len = snprintf(buf, bufsize, "HTTP/1.1 200 OK\r\n"
+                                     "Content-Type: %s\r\n"
+                                     "Content-Length: %jd\r\n"
+                                     "Accept-Ranges: bytes\r\n"
+                                     "%s",
+                                     mime_type, (intmax_t) content_length, representation);
+    if (len < 0 || len >= bufsize) {
+        fprintf(stderr, "render_file_headers: headers too long\n");
         return -1;
     }
+    return len;
+}
+
+// Copies a header value into a fixed buffer, leaving it empty if absent or
+// too long
+// Returns 1 if the value was copied, 0 otherwise
+static int copy_condition(char *buf, const str_view_t *value) {
+    buf[0] = '\0';
+    if (value == NULL || value->len >= HTTP_CONDITION_LEN)
+        return 0;
+    memcpy(buf, value->ptr, value->len);
+    buf[value->len] = '\0';
+    return 1;
+}
+
+void http_request_conditions(const http_request_t *request, http_conditions_t *conditions) {
+    conditions->present = 0;
+    conditions->present |= copy_condition(conditions->if_none_match,
+                                          http_request_header(request, "If-None-Match"));
+    conditions->present |= copy_condition(conditions->if_range,
+                                          http_request_header(request, "If-Range"));
+
+    conditions->if_modified_since = -1;
+    const str_view_t *value = http_request_header(request, "If-Modified-Since");
+    if (value != NULL && http_parse_date(*value, &conditions->if_modified_since) == 0)
+        conditions->present = 1;
+    else
+        conditions->if_modified_since = -1;
+
+    // Identity is always acceptable, so only the codings we offer matter
+    conditions->accept_encodings = 0;
+    value = http_request_header(request, "Accept-Encoding");
+    if (value != NULL) {
+        for (int i = 0; i < N_ENCODINGS; i++) {
+            if (http_token_quality(*value, encoding_names[i]) > 0)
+                conditions->accept_encodings |= 1 << i;
+        }
+    }
+
+    conditions->n_ranges = 0;
+    value = http_request_header(request, "Range");
+    if (value != NULL) {
+        int n_ranges = http_parse_ranges(*value, conditions->ranges);
+        if (n_ranges > 0) {
+            conditions->n_ranges = n_ranges;
+            conditions->present = 1;
+        }
+    }
+}
+
+void http_conn_init(http_conn_t *conn, int fd) {
+    conn->fd = fd;
+    conn->start = 0;
+    conn->end = 0;
+    conn->scanned = 0;
+    conn->request_len = 0;
+    conn->start_ns = 0;
+    conn->parsed_ns = 0;
+}
+
+// Drops the request last returned, keeping anything pipelined behind it
+static void drop_request(http_conn_t *conn) {
+    conn->start += conn->request_len;
+    conn->request_len = 0;
+    if (conn->start == conn->end) {
+        conn->start = 0;
+        conn->end = 0;
+    }
+}
+
+// Moves the unconsumed bytes to the front of the buffer
+static void compact(http_conn_t *conn) {
+    memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+}
 
-    // Disable stdio buffering
-    if (setvbuf(socket_stream, NULL, _IONBF, 0) != 0) {
-        perror("setvbuf");
-        fclose(socket_stream);
+/*
+ * Parse a request from the bytes already buffered, if a complete one is there
+ * Returns 0 on success, 2 if more bytes are needed or -1 on error
+ */
+static int parse_buffered_request(http_conn_t *conn, http_request_t *request) {
+    // Nothing buffered yet, so nothing to time
+    if (conn->start == conn->end)
+        return 2;
+
+    uint64_t start_ns = conn->start_ns != 0 ? conn->start_ns : stats_now();
+    size_t len = http_find_request_end(conn->buf + conn->start,
+                                       conn->end - conn->start, &conn->scanned);
+    if (len == 0) {
+        if (conn->start == 0 && conn->end == HTTP_REQUEST_BUFSIZE) {
+            fprintf(stderr, "Request too large\n");
+            return -1;
+        }
+        return 2;
+    }
+
+    conn->request_len = len;
+    conn->scanned = 0;
+    conn->start_ns = 0;
+    if (http_parse_request(conn->buf + conn->start, len, request) == -1 ||
+        !str_view_eq(request->method, "GET")) {
+        fprintf(stderr, "Could not parse request\n");
+        stats_count(errors, 1);
         return -1;
     }
+    conn->parsed_ns = stats_time(STATS_PARSE, start_ns);
+    return 0;
+}
+
+int read_http_request(http_conn_t *conn, http_request_t *request) {
+    drop_request(conn);
+
+    while (1) {
+        // Check for a complete request among the buffered bytes
+        int result = parse_buffered_request(conn, request);
+        if (result != 2)
+            return result;
+
+        // Make room at the end of the buffer
+        if (conn->end == HTTP_REQUEST_BUFSIZE)
+            compact(conn);
+
+        ssize_t bytes = recv(conn->fd, conn->buf + conn->end, HTTP_REQUEST_BUFSIZE - conn->end, 0);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            // Either a non-blocking socket is drained or an idle timeout fired
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 2;
+            // Resets between requests are a normal way for a connection to end
+            if (errno == ECONNRESET && conn->start == conn->end)
+                return 1;
+            perror("recv");
+            return -1;
+        }
+
+        if (bytes == 0) {
+            // Client closed the connection between requests
+            if (conn->start == conn->end)
+                return 1;
+            fprintf(stderr, "Incomplete request\n");
+            return -1;
+        }
+
+        conn->end += bytes;
+    }
+}
+
+int next_http_request(http_conn_t *conn, http_request_t *request) {
+    drop_request(conn);
+    return parse_buffered_request(conn, request);
+}
+
+int http_conn_busy(const http_conn_t *conn) {
+    return conn->end - conn->start > conn->request_len;
+}
+
+int http_conn_append(http_conn_t *conn, const char *data, size_t len) {
+    if (len > HTTP_REQUEST_BUFSIZE - conn->end) {
+        compact(conn);
+        if (len > HTTP_REQUEST_BUFSIZE - conn->end) {
+            fprintf(stderr, "Request too large\n");
+            return -1;
+        }
+    }
+
+    memcpy(conn->buf + conn->end, data, len);
+    conn->end += len;
+    return 0;
+}
 
-    // Read first line
-    char *result = fgets(buf, BUFSIZE, socket_stream);
-    if (ferror(socket_stream)) {
-        perror("fgets");
-        fclose(socket_stream);
+/*
+ * Append the Connection header and the blank line ending the headers
+ * Returns 0 on success or -1 if the headers don't fit
+ */
+static int finish_headers(http_response_t *response, int keep_alive) {
+    const char *connection = keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                        : "Connection: close\r\n\r\n";
+    size_t len = strlen(connection);
+    if (response->headers_len + len > HTTP_HEADER_BUFSIZE) {
+        fprintf(stderr, "Response headers too long\n");
         return -1;
     }
 
-    // Parse request
-    if (sscanf(buf, "GET %s HTTP/1.0\r\n", resource_name) != 1) {
-        printf("Could not parse request");
-        fclose(socket_stream);
+    memcpy(response->headers + response->headers_len, connection, len);
+    response->headers_len += len;
+    return 0;
+}
+
+// Resets a response to hold nothing
+static void init_response(http_response_t *response) {
+    response->headers_len = 0;
+    response->headers_sent = 0;
+    response->entry = NULL;
+    response->body = NULL;
+    response->body_buf = NULL;
+    response->file_fd = -1;
+    response->body_offset = 0;
+    response->body_end = 0;
+    response->ready_ns = 0;
+}
+
+// Drops a response's body, for responses that turn out not to have one
+static void drop_body(http_response_t *response) {
+    free_http_response(response);
+    response->body_offset = 0;
+    response->body_end = 0;
+}
+
+/*
+ * Check whether an If-None-Match list holds 'etag', using the weak comparison
+ * RFC 9110 calls for: a "W/" prefix is ignored
+ */
+static int etag_list_matches(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *pos = list;
+    while (*pos != '\0') {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',')
+            pos++;
+        const char *elem = pos;
+        while (*pos != '\0' && *pos != ',')
+            pos++;
+        const char *elem_end = pos;
+        while (elem_end > elem && (elem_end[-1] == ' ' || elem_end[-1] == '\t'))
+            elem_end--;
+
+        if (elem_end - elem == 1 && *elem == '*')
+            return 1;
+        if (elem_end - elem > 2 && memcmp(elem, "W/", 2) == 0)
+            elem += 2;
+        if (elem_end - elem == etag_len && memcmp(elem, etag, etag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Compares two byte ranges by first byte, for qsort()
+static int compare_ranges(const void *a, const void *b) {
+    off_t first_a = ((const http_range_t *) a)->first;
+    off_t first_b = ((const http_range_t *) b)->first;
+    return first_a < first_b ? -1 : first_a > first_b;
+}
+
+/*
+ * Turn the requested ranges into the sorted, non-overlapping ranges of a file
+ * of 'size' bytes that can be satisfied, merging any that overlap or touch
+ * Returns the number of ranges left in 'out'
+ */
+static int resolve_ranges(const http_conditions_t *conditions, off_t size, http_range_t *out) {
+    int n_ranges = 0;
+    for (int i = 0; i < conditions->n_ranges; i++) {
+        const http_range_t *range = &conditions->ranges[i];
+        off_t first, last;
+        if (range->first == -1) {
+            if (range->last == 0)
+                continue;
+            first = range->last < size ? size - range->last : 0;
+            last = size - 1;
+        } else {
+            first = range->first;
+            last = range->last == -1 || range->last >= size ? size - 1 : range->last;
+        }
+        if (first >= size)
+            continue;
+        out[n_ranges].first = first;
+        out[n_ranges++].last = last;
+    }
+
+    qsort(out, n_ranges, sizeof(http_range_t), compare_ranges);
+    int n_merged = 0;
+    for (int i = 0; i < n_ranges; i++) {
+        if (n_merged > 0 && out[i].first <= out[n_merged - 1].last + 1) {
+            if (out[i].last > out[n_merged - 1].last)
+                out[n_merged - 1].last = out[i].last;
+        } else {
+            out[n_merged++] = out[i];
+        }
+    }
+    return n_merged;
+}
+
+/*
+ * Replace a response's body with a multipart/byteranges body holding each of
+ * 'ranges', and format its headers
+ * Returns 0 on success, 1 if the body would exceed HTTP_MULTIPART_MAX, or -1
+ * on error
+ */
+static int render_multipart(http_response_t *response, const char *mime_type, off_t size,
+                            const char *etag, const char *representation,
+                            const http_range_t *ranges, int n_ranges) {
+    // Anything that can't occur in the parts works as the boundary; the count
+    // tells this body apart from others of the same file, and comes first so
+    // that cutting the boundary to the 70 characters allowed keeps it
+    static atomic_ulong n_boundaries;
+    char boundary[71];
+    snprintf(boundary, sizeof(boundary), "byteranges_%lx_%.*s",
+             atomic_fetch_add_explicit(&n_boundaries, 1, memory_order_relaxed),
+             (int) strlen(etag) - 2, etag + 1);
+    const char *part_format = "\r\n--%s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Range: bytes %jd-%jd/%jd\r\n\r\n";
+    const char *end_format = "\r\n--%s--\r\n";
+
+    size_t total = snprintf(NULL, 0, end_format, boundary);
+    for (int i = 0; i < n_ranges; i++) {
+        total += snprintf(NULL, 0, part_format, boundary, mime_type, (intmax_t) ranges[i].first,
+                          (intmax_t) ranges[i].last, (intmax_t) size);
+        total += ranges[i].last - ranges[i].first + 1;
+    }
+    if (total > HTTP_MULTIPART_MAX)
+        return 1;
+
+    char *body = malloc(total + 1);
+    if (body == NULL) {
+        perror("malloc");
         return -1;
     }
 
-    // Consume rest of request
-    while (result != NULL) {
-        result = fgets(buf, BUFSIZE, socket_stream);
-        if (strcmp(buf, "\r\n") == 0)
-            break;
+    const char *data = response->body;
+    size_t len = 0;
+    for (int i = 0; i < n_ranges; i++) {
+        off_t first = ranges[i].first;
+        size_t part_len = ranges[i].last - first + 1;
+        len += sprintf(body + len, part_format, boundary, mime_type, (intmax_t) first,
+                       (intmax_t) ranges[i].last, (intmax_t) size);
+
+        if (data != NULL) {
+            memcpy(body + len, data + first, part_len);
+        } else {
+            size_t copied = 0;
+            while (copied < part_len) {
+                ssize_t bytes = pread(response->file_fd, body + len + copied, part_len - copied,
+                                      first + copied);
+                if (bytes <= 0) {
+                    if (bytes == -1 && errno == EINTR)
+                        continue;
+                    if (bytes == -1)
+                        perror("pread");
+                    else
+                        fprintf(stderr, "pread: unexpected end of file\n");
+                    free(body);
+                    return -1;
+                }
+                copied += bytes;
+            }
+        }
+        len += part_len;
     }
+    len += sprintf(body + len, end_format, boundary);
 
-    // Check for error
-    if (ferror(socket_stream)) {
-        perror("fgets");
-        fclose(socket_stream);
+    int headers_len = snprintf(response->headers, HTTP_HEADER_BUFSIZE,
+                               "HTTP/1.1 206 Partial Content\r\n"
+                               "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                               "Content-Length: %zu\r\n%s",
+                               boundary, len, representation);
+    if (headers_len < 0 || headers_len >= HTTP_HEADER_BUFSIZE) {
+        fprintf(stderr, "Response headers too long\n");
+        free(body);
         return -1;
     }
 
-    // Clean up
-    if (fclose(socket_stream) != 0) {
-        perror("fclose");
+    drop_body(response);
+    response->body = body;
+    response->body_buf = body;
+    response->body_end = len;
+    response->headers_len = headers_len;
+    return 0;
+}
+
+/*
+ * Format the headers of a response for a file whose body is already set up,
+ * first applying the request's conditional and range headers (RFC 9110
+ * section 13.2.2): a matching If-None-Match, or failing that an
+ * If-Modified-Since no older than the file, gives a 304; a Range, unless an
+ * If-Range no longer matches, narrows the body for a 206 or gives a 416
+ * response: Holds the whole body, in 'encoding' (NULL for none)
+ * Returns 0 on success or -1 on error
+ */
+static int render_file_response(http_response_t *response, const char *mime_type,
+                                const http_file_info_t *info, const char *encoding,
+                                const http_conditions_t *conditions) {
+    off_t size = response->body_end;
+    int len;
+    if (conditions == NULL || !conditions->present) {
+        len = render_file_headers(response->headers, HTTP_HEADER_BUFSIZE, mime_type, info,
+                                  encoding, size);
+        if (len == -1)
+            return -1;
+        response->headers_len = len;
+        return 0;
+    }
+
+    char etag[HTTP_ETAG_LEN];
+    char representation[HTTP_HEADER_BUFSIZE / 2];
+    http_format_etag(etag, info, encoding);
+    if (render_representation(representation, sizeof(representation), mime_type, info,
+                              encoding) == -1)
         return -1;
+
+    int not_modified;
+    if (conditions->if_none_match[0] != '\0')
+        not_modified = etag_list_matches(conditions->if_none_match, etag);
+    else
+        not_modified = conditions->if_modified_since != -1 &&
+                       info->mtime.tv_sec <= conditions->if_modified_since;
+
+    // If-Range holds either the entity tag, compared strongly, or the date
+    // the client last saw
+    int use_ranges = conditions->n_ranges > 0;
+    if (use_ranges && conditions->if_range[0] != '\0') {
+        time_t if_range_date;
+        str_view_t if_range = { conditions->if_range, strlen(conditions->if_range) };
+        if (conditions->if_range[0] == '"')
+            use_ranges = strcmp(conditions->if_range, etag) == 0;
+        else
+            use_ranges = http_parse_date(if_range, &if_range_date) == 0 &&
+                         if_range_date == info->mtime.tv_sec;
+    }
+
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int n_ranges = use_ranges ? resolve_ranges(conditions, size, ranges) : 0;
+    if (not_modified) {
+        drop_body(response);
+        len = snprintf(response->headers, HTTP_HEADER_BUFSIZE, "HTTP/1.1 304 Not Modified\r\n%s",
+                       representation);
+    } else if (use_ranges && n_ranges == 0) {
+        drop_body(response);
+        len = snprintf(response->headers, HTTP_HEADER_BUFSIZE,
+                       "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                       "Content-Range: bytes */%jd\r\n"
+                       "Content-Length: 0\r\n", (intmax_t) size);
+    } else if (n_ranges == 1) {
+        response->body_offset = ranges[0].first;
+        response->body_end = ranges[0].last + 1;
+        len = snprintf(response->headers, HTTP_HEADER_BUFSIZE,
+                       "HTTP/1.1 206 Partial Content\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %jd\r\n"
+                       "Content-Range: bytes %jd-%jd/%jd\r\n%s",
+                       mime_type, (intmax_t) (response->body_end - response->body_offset),
+                       (intmax_t) ranges[0].first, (intmax_t) ranges[0].last,
+                       (intmax_t) size, representation);
+    } else {
+        if (n_ranges > 1) {
+            int result = render_multipart(response, mime_type, size, etag, representation,
+                                          ranges, n_ranges);
+            if (result != 1)
+                return result;
+        }
+        // No usable range, or too much to buffer: send the whole file
+        len = render_file_headers(response->headers, HTTP_HEADER_BUFSIZE, mime_type, info,
+                                  encoding, size);
     }
 
+    if (len < 0 || len >= HTTP_HEADER_BUFSIZE) {
+        fprintf(stderr, "Response headers too long\n");
+        return -1;
+    }
+    response->headers_len = len;
     return 0;
 }
 
-int write_http_response(int fd, const char *resource_path) {
-    char buf[BUFSIZE];
+int prepare_entry_response(http_response_t *response, file_cache_entry_t *entry,
+                           file_cache_t *cache, const http_conditions_t *conditions,
+                           int keep_alive) {
+    init_response(response);
+    response->entry = entry;
+    response->body = entry->data;
+    response->file_fd = entry->fd;     // Set instead for a file kept open
+    response->body_end = entry->size;
 
-    // Check if file exists and get size
-    struct stat statbuf;
-    if (stat(resource_path, &statbuf) == -1) {
-        // Print and return error if file does exist
-        if (errno != ENOENT) {
-            perror("stat");
+    // Use the first encoding the client accepts that is worth serving
+    file_cache_variant_t *variant = NULL;
+    content_encoding_t encoding = 0;
+    int accepted = conditions != NULL && cache != NULL ? conditions->accept_encodings : 0;
+    for (; accepted != 0 && encoding < N_ENCODINGS; encoding++) {
+        if ((accepted & (1 << encoding)) &&
+            (variant = file_cache_variant(cache, entry, encoding)) != NULL)
+            break;
+    }
+    if (variant != NULL) {
+        response->body = variant->data;
+        response->body_end = variant->size;
+    }
+
+    if (conditions == NULL || !conditions->present) {
+        // The usual case: headers rendered when the file or variant was cached
+        const char *headers = variant != NULL ? variant->headers : entry->headers;
+        size_t headers_len = variant != NULL ? variant->headers_len : entry->headers_len;
+        memcpy(response->headers, headers, headers_len);
+        response->headers_len = headers_len;
+    } else {
+        http_file_info_t info = { entry->size, entry->mtime, entry->ino };
+        if (render_file_response(response, entry->mime_type, &info,
+                                 variant != NULL ? http_encoding_name(encoding) : NULL,
+                                 conditions) == -1) {
+            free_http_response(response);
             return -1;
         }
+    }
+
+    if (finish_headers(response, keep_alive) == -1) {
+        free_http_response(response);
+        return -1;
+    }
+    return 0;
+}
+
+int prepare_not_found_response(http_response_t *response, int keep_alive) {
+    init_response(response);
+    stats_count(not_found, 1);
+
+    int len = snprintf(response->headers, HTTP_HEADER_BUFSIZE,
+                       "HTTP/1.1 404 Not Found\r\n"
+                       "Content-Length: 0\r\n");
+    if (len < 0) {
+        perror("snprintf");
+        return -1;
+    }
+    response->headers_len = len;
+    return finish_headers(response, keep_alive);
+}
 
-        // If file doesn't exist
+int prepare_bad_request_response(http_response_t *response) {
+    init_response(response);
 
-        // Format response
-        if (sprintf(buf, "HTTP/1.0 404 Not Found\r\n"
-                         "Content-Length: 0\r\n"
-                         "\r\n") < 0) {
-            perror("sprintf");
+    int len = snprintf(response->headers, HTTP_HEADER_BUFSIZE,
+                       "HTTP/1.1 400 Bad Request\r\n"
+                       "Content-Length: 0\r\n");
+    if (len < 0) {
+        perror("snprintf");
+        return -1;
+    }
+    response->headers_len = len;
+    if (finish_headers(response, 0) == -1)
+        return -1;
+    response->ready_ns = stats_now();
+    return 0;
+}
+
+int prepare_file_response(http_response_t *response, const char *resource_path, int file_fd,
+                          const http_file_info_t *info, const http_conditions_t *conditions,
+                          int keep_alive) {
+    init_response(response);
+    const char *mime_type = get_mime_type(resource_path);
+
+    // Format status line/headers
+    response->file_fd = file_fd;
+    response->body_end = info->size;
+    if (render_file_response(response, mime_type, info, NULL, conditions) == -1 ||
+        finish_headers(response, keep_alive) == -1) {
+        free_http_response(response);
+        return -1;
+    }
+    return 0;
+}
+
+int prepare_http_response(http_response_t *response, path_cache_t *paths,
+                          const char *resource_path, file_cache_t *cache,
+                          const http_conditions_t *conditions, int keep_alive,
+                          uint64_t start_ns) {
+    stats_count(requests, 1);
+
+    // Serve from the cache when possible
+    file_cache_entry_t *entry = cache != NULL ? file_cache_get(cache, resource_path) : NULL;
+    if (entry != NULL) {
+        if (prepare_entry_response(response, entry, cache, conditions, keep_alive) == -1)
             return -1;
-        }
+        response->ready_ns = stats_time(STATS_OPEN, start_ns);
+        return 0;
+    }
 
-        // Write response
-        if (write(fd, buf, strlen(buf)) < 0) {
-            perror("write");
+    // Check if file exists and get size, usually from the path cache
+    path_info_t path_info;
+    int file_fd = -1;
+    int error = ENOENT;     // Anything but a regular file is not found
+    if (path_cache_stat(paths, resource_path, &path_info) == -1)
+        error = errno;
+    else if (S_ISREG(path_info.mode) &&
+             (file_fd = path_cache_open(paths, resource_path, O_RDONLY)) == -1)
+        error = errno;
+
+    if (file_fd == -1) {
+        // Print and return error if file does exist
+        if (!path_error_not_found(error)) {
+            fprintf(stderr, "open: %s\n", strerror(error));
             return -1;
         }
 
-        return 0;
+        // If file doesn't exist, respond with an empty 404
+        int result = prepare_not_found_response(response, keep_alive);
+        response->ready_ns = stats_time(STATS_OPEN, start_ns);
+        return result;
     }
 
-    // Get file extension
-    char *extension = strrchr(resource_path, '.');
-    if (extension == NULL) {
-        fprintf(stderr, "Invalid request\n");
+    http_file_info_t info = { path_info.size, path_info.mtime, path_info.ino };
+    if (prepare_file_response(response, resource_path, file_fd, &info, conditions,
+                              keep_alive) == -1)
+        return -1;
+    response->ready_ns = stats_time(STATS_OPEN, start_ns);
+    return 0;
+}
+
+int prepare_stats_response(http_response_t *response, int json, int keep_alive) {
+    stats_count(requests, 1);
+    init_response(response);
+
+    response->body_buf = malloc(STATS_BUFSIZE);
+    if (response->body_buf == NULL) {
+        perror("malloc");
         return -1;
     }
+    response->body = response->body_buf;
 
-    // Get MIME type
-    const char *mime_type = get_mime_type(extension);
-    if (mime_type == NULL) {
-        fprintf(stderr, "Invalid request\n");
+    int body_len = stats_render(response->body_buf, STATS_BUFSIZE, json);
+    int len = body_len == -1 ? -1 : render_http_headers(response->headers, HTTP_HEADER_BUFSIZE,
+                                                        json ? "application/json" : "text/plain",
+                                                        body_len);
+    if (len == -1) {
+        fprintf(stderr, "Statistics too long\n");
+        free_http_response(response);
         return -1;
     }
 
-    // Open file
-    int file_fd = open(resource_path, O_RDONLY);
-    if (file_fd == -1) {
-        perror("open");
+    response->headers_len = len;
+    response->body_end = body_len;
+    if (finish_headers(response, keep_alive) == -1) {
+        free_http_response(response);
         return -1;
     }
+    response->ready_ns = stats_now();
+    return 0;
+}
 
-    // Format status line/headers
-    if (sprintf(buf, "HTTP/1.0 200 OK\r\n"
-                    "Content-Type: %s\r\n"
-                    "Content-Length: %jd\r\n"
-                    "\r\n",
-                    mime_type, statbuf.st_size) < 0) {
-        perror("sprintf");
-        close(file_fd);
+int resolve_http_target(const http_request_t *request, char *resource_path, size_t bufsize) {
+    // Split off the query string
+    str_view_t path = request->target;
+    str_view_t query = { path.ptr + path.len, 0 };
+    const char *mark = memchr(path.ptr, '?', path.len);
+    if (mark != NULL) {
+        query.ptr = mark + 1;
+        query.len = path.ptr + path.len - query.ptr;
+        path.len = mark - path.ptr;
+    }
+
+    if (str_view_eq(path, STATS_PATH)) {
+        const str_view_t *accept = http_request_header(request, "Accept");
+        int json = memmem(query.ptr, query.len, "format=json", strlen("format=json")) != NULL ||
+                   (accept != NULL && memmem(accept->ptr, accept->len, "application/json",
+                                             strlen("application/json")) != NULL);
+        return json ? TARGET_STATS_JSON : TARGET_STATS;
+    }
+
+    // Get path to resource, which can't leave the served directory
+    if (http_normalize_path(path, resource_path, bufsize) == -1) {
+        fprintf(stderr, "Invalid resource path\n");
+        stats_count(errors, 1);
         return -1;
     }
+    return TARGET_FILE;
+}
 
-    // Write status line and headers
-    if (write(fd, buf, strlen(buf)) < 0) {
-        perror("dprintf");
-        close(file_fd);
+int prepare_request_response(http_response_t *response, const http_request_t *request,
+                             uint64_t parsed_ns, path_cache_t *paths, file_cache_t *cache,
+                             int keep_alive) {
+    char res_path[BUFSIZE];
+    int target = resolve_http_target(request, res_path, BUFSIZE);
+    if (target == -1)
+        return prepare_bad_request_response(response) == -1 ? -1 : 1;
+    if (target != TARGET_FILE)
+        return prepare_stats_response(response, target == TARGET_STATS_JSON, keep_alive);
+
+    http_conditions_t conditions;
+    http_request_conditions(request, &conditions);
+    if (prepare_http_response(response, paths, res_path, cache, &conditions, keep_alive,
+                              parsed_ns) == -1) {
+        stats_count(errors, 1);
         return -1;
     }
+    return 0;
+}
+
+const char *http_response_body(const http_response_t *response) {
+    return response->body;
+}
+
+/*
+ * Write as much of a response's headers and in-memory body as the socket
+ * takes in one system call. Both go out in a single writev() so a small
+ * response fills one segment; headers ahead of a file body are sent with
+ * MSG_MORE so the kernel holds them back to share a segment with the start of
+ * the file.
+ * Returns the number of bytes written, or -1 with errno set
+ */
+static ssize_t write_response_head(int fd, http_response_t *response) {
+    size_t headers_left = response->headers_len - response->headers_sent;
+    const char *body = http_response_body(response);
+    size_t body_left = body != NULL ? response->body_end - response->body_offset : 0;
+
+    ssize_t bytes = -1;
+    if (body == NULL && response->file_fd != -1 &&
+        response->body_offset < response->body_end) {
+        bytes = send(fd, response->headers + response->headers_sent, headers_left,
+                     MSG_MORE | MSG_NOSIGNAL);
+        if (bytes == -1 && errno != ENOTSOCK)
+            return -1;
+    }
+    if (bytes == -1) {
+        struct iovec iov[2];
+        int n_iov = 0;
+        if (headers_left > 0) {
+            iov[n_iov].iov_base = response->headers + response->headers_sent;
+            iov[n_iov++].iov_len = headers_left;
+        }
+        if (body_left > 0) {
+            iov[n_iov].iov_base = (char *) body + response->body_offset;
+            iov[n_iov++].iov_len = body_left;
+        }
+        bytes = writev(fd, iov, n_iov);
+        if (bytes == -1)
+            return -1;
+    }
+
+    size_t headers_written = (size_t) bytes < headers_left ? (size_t) bytes : headers_left;
+    response->headers_sent += headers_written;
+    response->body_offset += bytes - headers_written;
+    return bytes;
+}
+
+// Checks whether a response still has headers or an in-memory body to write
+static int response_head_pending(const http_response_t *response) {
+    return response->headers_sent < response->headers_len ||
+           (http_response_body(response) != NULL &&
+            response->body_offset < response->body_end);
+}
 
-    // Write content
-    int bytes_read;
-    while ((bytes_read = read(file_fd, buf, BUFSIZE)) > 0) {
-        if (write(fd, buf, bytes_read) == -1) {
+int send_http_response(int fd, http_response_t *response) {
+    // Write status line and headers, along with the content if in memory
+    size_t total = 0;
+    while (response_head_pending(response)) {
+        ssize_t bytes = write_response_head(fd, response);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
             perror("write");
-            close(file_fd);
+            stats_count(errors, 1);
             return -1;
         }
+        total += bytes;
     }
 
-    // Check for errors
-    if (bytes_read == -1) {
-        perror("read");
-        close(file_fd);
-        return -1;
+    // Write content from a file
+    off_t length = response->body_end - response->body_offset;
+    if (response->file_fd != -1 && length > 0) {
+        if (write_file_body(fd, response->file_fd, response->body_offset, length,
+                            BODY_AUTO) == -1) {
+            stats_count(errors, 1);
+            return -1;
+        }
+        response->body_offset = response->body_end;
+        total += length;
     }
 
-    // Clean up
-    if (close(file_fd) == -1) {
-        perror("close");
-        return -1;
+    stats_count(bytes_sent, total);
+    stats_time(STATS_SEND, response->ready_ns);
+    return 0;
+}
+
+int continue_http_response(int fd, http_response_t *response) {
+    // Write whatever is left of the status line and headers, and of the
+    // content if in memory
+    while (response_head_pending(response)) {
+        ssize_t bytes = write_response_head(fd, response);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            perror("write");
+            stats_count(errors, 1);
+            return -1;
+        }
+        stats_count(bytes_sent, bytes);
+    }
+
+    // Write whatever is left of the content from a file
+    while (response->body_offset < response->body_end) {
+        // sendfile advances body_offset itself
+        off_t offset = response->body_offset;
+        ssize_t bytes = sendfile(fd, response->file_fd, &offset,
+                                 response->body_end - response->body_offset);
+        if (bytes == 0) {
+            fprintf(stderr, "sendfile: unexpected end of file\n");
+            stats_count(errors, 1);
+            return -1;
+        }
+
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            perror("sendfile");
+            stats_count(errors, 1);
+            return -1;
+        }
+        response->body_offset += bytes;
+        stats_count(bytes_sent, bytes);
     }
 
+    stats_time(STATS_SEND, response->ready_ns);
     return 0;
 }
+
+void free_http_response(http_response_t *response) {
+    // A cached entry's open file is closed with the entry
+    if (response->file_fd != -1) {
+        if (response->entry == NULL && close(response->file_fd) == -1)
+            perror("close");
+        response->file_fd = -1;
+    }
+
+    if (response->entry != NULL) {
+        file_cache_release(response->entry);
+        response->entry = NULL;
+    }
+
+    free(response->body_buf);
+    response->body_buf = NULL;
+    response->body = NULL;
+}
+
+int write_http_response(int fd, path_cache_t *paths, const char *resource_path,
+                        file_cache_t *cache, int keep_alive) {
+    http_response_t response;
+    if (prepare_http_response(&response, paths, resource_path, cache, NULL, keep_alive,
+                              stats_now()) == -1)
+        return -1;
+
+    int ret_val = send_http_response(fd, &response);
+    free_http_response(&response);
+    return ret_val;
+}
@@ -1,20 +1,314 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "file_cache.h"
+#include "http_parser.h"
+#include "path_cache.h"
+
+#define HTTP_HEADER_BUFSIZE 512
+#define HTTP_REQUEST_BUFSIZE 8192   // Longest request header block accepted
+#define HTTP_ETAG_LEN 64
+#define HTTP_CONDITION_LEN 256      // Longer If-None-Match/If-Range values are ignored
+#define HTTP_MULTIPART_MAX (4 << 20)    // Larger multi-range responses send the whole file
+
+// Strategies for copying a file's contents to a socket
+typedef enum {
+    BODY_AUTO,      // sendfile, falling back to splice and then BODY_COPY
+    BODY_SENDFILE,  // sendfile(2) only
+    BODY_SPLICE,    // splice(2) through a pipe only
+    BODY_COPY,      // read(2)/write(2) through a user space buffer
+} body_method_t;
+
 /*
- * Read an HTTP request from an active TCP connection socket
- * fd: The socket's file descriptor
- * resource_name: Set to the name of the requested resource on success
+ * Look up the MIME type for a file by its extension in the MIME registry
+ * (see mime_types.h)
+ * path: Path or name of the file
+ * Returns the MIME type, application/octet-stream if the file has no
+ * extension or one that isn't registered
+ */
+const char *get_mime_type(const char *path);
+
+// A client connection that requests are read from
+// Requests are received into 'buf' with as few recv() calls as possible and
+// parsed where they lie
+typedef struct {
+    int fd;
+    char buf[HTTP_REQUEST_BUFSIZE];
+    size_t start;       // Offset of the first unconsumed byte
+    size_t end;         // Offset one past the last received byte
+    size_t scanned;     // Bytes after 'start' known not to end the headers
+    size_t request_len; // Length of the request last returned
+    uint64_t start_ns;  // Where timing the next request's parse starts, or 0 to read the
+                        // clock once its bytes are buffered
+    uint64_t parsed_ns; // When the request last returned was parsed, for statistics
+} http_conn_t;
+
+// What identifies the current contents of a file, for its validators
+typedef struct {
+    off_t size;
+    struct timespec mtime;
+    ino_t ino;
+} http_file_info_t;
+
+// Returns the name of a content coding as used in HTTP headers
+const char *http_encoding_name(content_encoding_t encoding);
+
+/*
+ * Check whether files of a MIME type are worth compressing: text, JSON, XML
+ * and JavaScript are, while formats such as JPEG, PNG and PDF are compressed
+ * already
+ * Returns 1 if they are, 0 if not
+ */
+int http_mime_compressible(const char *mime_type);
+
+/*
+ * Format a file's strong entity tag, quotes included
+ * buf: Buffer to write into, at least HTTP_ETAG_LEN bytes
+ * encoding: Name of the content coding the file is sent in, or NULL
+ */
+void http_format_etag(char *buf, const http_file_info_t *info, const char *encoding);
+
+/*
+ * Format the status line and headers of a successful response for a whole
+ * file, with its validators, apart from the Connection header and the blank
+ * line that ends the headers
+ * encoding: Name of the content coding the body is in, or NULL
+ * content_length: Length of the body as sent
+ * Returns the length of the headers on success or -1 on error
+ */
+int render_file_headers(char *buf, size_t bufsize, const char *mime_type,
+                        const http_file_info_t *info, const char *encoding,
+                        off_t content_length);
+
+/*
+ * Format the status line and headers of a successful response, apart from
+ * the Connection header and the blank line that ends the headers
+ * buf: Buffer to write the headers into
+ * bufsize: Size of 'buf'
+ * mime_type: Value of the Content-Type header
+ * content_length: Value of the Content-Length header
+ * Returns the length of the headers on success or -1 on error
+ */
+int render_http_headers(char *buf, size_t bufsize, const char *mime_type, off_t content_length);
+
+/*
+ * Set up reading requests from an active TCP connection socket
+ * conn: Pointer to http_conn_t to be initialized
+ * fd: The socket's file descriptor, which remains owned by the caller
+ */
+void http_conn_init(http_conn_t *conn, int fd);
+
+/*
+ * Read the next GET request from a connection. Requests the client has
+ * pipelined behind the previous one are parsed from the connection's buffer
+ * without another read. Works with blocking and non-blocking sockets.
+ * conn: The connection to read from
+ * request: Filled in with the parsed request on success. It points into the
+ * connection's buffer and is valid until the next call.
+ * Returns 0 on success, 1 if the client closed the connection before a new
+ * request began, 2 if the socket would block (or its receive timeout expired)
+ * before a full request arrived, or -1 on error
+ */
+int read_http_request(http_conn_t *conn, http_request_t *request);
+
+/*
+ * Parse the next GET request from the bytes a connection has already
+ * buffered, without reading from its socket. For callers that receive data
+ * themselves and add it with http_conn_append().
+ * Returns 0 on success, 2 if a full request hasn't been buffered yet, or -1
+ * on error
+ */
+int next_http_request(http_conn_t *conn, http_request_t *request);
+
+/*
+ * Add received bytes to a connection's buffer
+ * Returns 0 on success or -1 if they don't fit behind a partial request
+ */
+int http_conn_append(http_conn_t *conn, const char *data, size_t len);
+
+/*
+ * Check whether a connection has received any part of a request it hasn't
+ * answered yet, as opposed to sitting idle between requests
+ * Returns 1 if it has, 0 if not
+ */
+int http_conn_busy(const http_conn_t *conn);
+
+// A request's conditional, range and Accept-Encoding headers, copied out of
+// the request so they stay valid while the file is looked up
+typedef struct {
+    int present;                                // Nonzero if any of these was sent
+    char if_none_match[HTTP_CONDITION_LEN];     // Empty if absent
+    time_t if_modified_since;                   // -1 if absent
+    char if_range[HTTP_CONDITION_LEN];          // Empty if absent
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int n_ranges;                               // 0 if absent or malformed
+    int accept_encodings;   // Bit (1 << content_encoding_t) set for each acceptable coding
+} http_conditions_t;
+
+/*
+ * Collect the If-None-Match, If-Modified-Since, If-Range, Range and
+ * Accept-Encoding headers of a request
+ */
+void http_request_conditions(const http_request_t *request, http_conditions_t *conditions);
+
+// An HTTP response that has been prepared but not necessarily fully written
+typedef struct {
+    char headers[HTTP_HEADER_BUFSIZE];  // Status line and headers to send
+    size_t headers_len;
+    size_t headers_sent;
+    file_cache_entry_t *entry;  // Cache entry the body comes from, or NULL
+    const char *body;           // In-memory body (cached, encoded or generated), or NULL
+    char *body_buf;             // Generated body owned by the response, or NULL
+    int file_fd;                // File to send the body from, or -1
+    off_t body_offset;          // Next byte of the body to send
+    off_t body_end;             // One past the last byte of the body to send
+    uint64_t ready_ns;          // When the response was prepared, for statistics; set
+                                // by whoever times the preparation
+} http_response_t;
+
+/*
+ * Work out the response to a request for a resource: look the resource up in
+ * the cache or file system, open it and format the headers. Conditional
+ * requests whose validators still match get a 304 Not Modified, and range
+ * requests a 206 Partial Content (as multipart/byteranges for several
+ * ranges) or a 416 Range Not Satisfiable. Cached files of compressible types
+ * are sent gzip or deflate encoded if the client accepts it.
+ * response: The response to fill in, released with free_http_response()
+ * paths: Resolves paths within the served directory
+ * resource_path: Path of the requested resource relative to the served
+ * directory, as normalized by http_normalize_path()
+ * cache: File cache to serve from, or NULL to always use the file system
+ * conditions: The request's conditional and range headers, or NULL
+ * keep_alive: Whether to tell the client the connection stays open
+ * start_ns: When the request was parsed, which the open time is measured
+ * from, so that the two share a clock read
+ * Returns 0 on success or -1 on error
+ */
+int prepare_http_response(http_response_t *response, path_cache_t *paths,
+                          const char *resource_path, file_cache_t *cache,
+                          const http_conditions_t *conditions, int keep_alive,
+                          uint64_t start_ns);
+
+/*
+ * The building blocks of prepare_http_response(), for callers that look up
+ * and open files themselves. Each resets 'response' first.
+ * prepare_entry_response() serves a cache entry from 'cache', taking over the
+ * reference (it is released on error as well).
+ * prepare_not_found_response() sets up an empty 404.
+ * prepare_bad_request_response() sets up an empty 400 that closes the
+ * connection, for requests resolve_http_target() rejects.
+ * prepare_file_response() sends the open 'file_fd', described by 'info',
+ * which the response takes over (it is closed on error as well).
+ * These two honor 'conditions' as prepare_http_response() does.
+ * prepare_stats_response() sets up the server's statistics as plain text or
+ * JSON.
+ * Apart from prepare_stats_response() and prepare_bad_request_response(),
+ * they leave 'ready_ns' for the caller
+ * to set when it stops timing the open.
+ * Each returns 0 on success or -1 on error
+ */
+int prepare_entry_response(http_response_t *response, file_cache_entry_t *entry,
+                           file_cache_t *cache, const http_conditions_t *conditions,
+                           int keep_alive);
+int prepare_not_found_response(http_response_t *response, int keep_alive);
+int prepare_bad_request_response(http_response_t *response);
+int prepare_file_response(http_response_t *response, const char *resource_path, int file_fd,
+                          const http_file_info_t *info, const http_conditions_t *conditions,
+                          int keep_alive);
+int prepare_stats_response(http_response_t *response, int json, int keep_alive);
+
+// What a request asks for, as worked out by resolve_http_target()
+typedef enum {
+    TARGET_FILE,        // A file under the serve directory
+    TARGET_STATS,       // The statistics as plain text
+    TARGET_STATS_JSON,  // The statistics as JSON
+} http_target_t;
+
+/*
+ * Work out what a parsed request asks for, splitting off any query string
+ * request: The parsed request
+ * resource_path: Filled in for TARGET_FILE with the file's path relative to
+ * the served directory, normalized by http_normalize_path()
+ * bufsize: Size of 'resource_path'
+ * Returns an http_target_t on success, or -1 if the path is malformed, too
+ * long or leads outside the served directory
+ */
+int resolve_http_target(const http_request_t *request, char *resource_path, size_t bufsize);
+
+/*
+ * Work out the response to a parsed request: requests for STATS_PATH get the
+ * server's statistics, as JSON if the query string asks for format=json or
+ * the Accept header for application/json, and anything else is served from
+ * the directory of 'paths' as with prepare_http_response()
+ * response: The response to fill in, released with free_http_response()
+ * request: The parsed request
+ * parsed_ns: When it was parsed, as left in the connection's 'parsed_ns'
+ * paths: Resolves paths within the served directory
+ * cache: File cache to serve from, or NULL to always use the file system
+ * keep_alive: Whether to tell the client the connection stays open
+ * Returns 0 on success, 1 if the request was malformed and gets a 400 after
+ * which the connection must be closed, or -1 on error
+ */
+int prepare_request_response(http_response_t *response, const http_request_t *request,
+                             uint64_t parsed_ns, path_cache_t *paths, file_cache_t *cache,
+                             int keep_alive);
+
+// Returns the in-memory body of a response, or NULL if it is sent from a file
+const char *http_response_body(const http_response_t *response);
+
+/*
+ * Write the rest of a prepared response to a blocking socket. The headers and
+ * an in-memory body are written together with writev(); headers ahead of a
+ * file body are sent with MSG_MORE to share a segment with it.
  * Returns 0 on success or -1 on error
  */
-int read_http_request(int fd, char *resource_name);
+int send_http_response(int fd, http_response_t *response);
+
+/*
+ * Write as much of a prepared response as a non-blocking socket accepts,
+ * recording progress so the call can be repeated once the socket is writable
+ * Returns 0 once the response is complete, 1 if the socket would block, or
+ * -1 on error
+ */
+int continue_http_response(int fd, http_response_t *response);
+
+/*
+ * Release the file and cache entry held by a prepared response
+ */
+void free_http_response(http_response_t *response);
 
 /*
  * Write an HTTP response to an active TCP connection socket
  * fd: The socket's file descriptor
- * resource_path: The path to the requested resource in the server's file system
+ * paths: Resolves paths within the served directory
+ * resource_path: Normalized path of the requested resource in that directory
+ * cache: File cache to serve from, or NULL to always use the file system
+ * keep_alive: Whether to tell the client the connection stays open
  * Returns 0 on success or -1 on error
  */
-int write_http_response(int fd, const char *resource_path);
+int write_http_response(int fd, path_cache_t *paths, const char *resource_path,
+                        file_cache_t *cache, int keep_alive);
+
+/*
+ * Write a range of a file's contents to an active TCP connection socket
+ * Partial sends are retried until the whole range has been written.
+ * fd: The socket's file descriptor
+ * file_fd: Descriptor of the open file to send
+ * offset: Position in the file to start sending from
+ * length: Number of bytes to send
+ * method: Copy strategy to use, normally BODY_AUTO
+ * Returns 0 on success or -1 on error
+ */
+int write_file_body(int fd, int file_fd, off_t offset, off_t length, body_method_t method);
+
+/*
+ * Write all 'len' bytes of 'buf' to 'fd', retrying on partial writes
+ * Returns 0 on success or -1 on error (errno is set)
+ */
+int write_all(int fd, const void *buf, size_t len);
 
 #endif // HTTP_H
@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+
+#define BUFSIZE 512
+#define MAX_FILES 256
+#define RECV_BUFSIZE 65536
+#define RESPONSE_HEADER_MAX 4096
+#define MAX_EVENTS 64
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION_SEC 10
+
+/*
+ * Load generator for http_server
+ * Keeps a number of keep-alive connections busy requesting a random mix of
+ * the files in a directory for a fixed time, then reports throughput and
+ * latency percentiles.
+ *
+ * In closed-loop mode every connection sends its next request as soon as the
+ * previous response arrives, which measures peak throughput. In open-loop
+ * mode requests arrive at a fixed rate whether or not the server keeps up;
+ * latency is measured from when a request was due, not when a connection
+ * was free to send it, so a saturated server shows up as growing latency
+ * instead of being hidden by the client slowing down.
+ */
+
+// One file that can be requested, with the body size the server must return
+typedef struct {
+    char name[BUFSIZE];
+    off_t size;
+} bench_file_t;
+
+typedef enum {
+    CONN_IDLE,
+    CONN_SENDING,
+    CONN_HEADERS,
+    CONN_BODY,
+} conn_state_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    char request[BUFSIZE];
+    size_t request_len;
+    size_t request_sent;
+    char headers[RESPONSE_HEADER_MAX];
+    size_t headers_len;
+    long body_left;
+    int close_after;    // Server said it will close after this response
+    const bench_file_t *file;
+    uint64_t start_ns;  // When the request was due (open loop) or sent
+} bench_conn_t;
+
+// Work done by one thread, on its own share of the connections and rate
+typedef struct {
+    pthread_t thread;
+    bench_conn_t *conns;
+    int n_conns;
+    double rate;            // Requests per second, or 0 for closed loop
+    unsigned seed;
+
+    histogram_t latency;    // Nanoseconds
+    unsigned long n_requests;
+    unsigned long n_errors;
+    unsigned long n_dropped; // Open loop arrivals never sent before the end
+    unsigned long bytes;
+} bench_thread_t;
+
+static struct addrinfo *server_addr;
+static const char *host;
+static bench_file_t files[MAX_FILES];
+static int n_files;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Loads the names and sizes of the regular files in a directory
+// Returns 0 on success or -1 on error
+static int load_files(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n_files < MAX_FILES) {
+        char path[BUFSIZE];
+        struct stat statbuf;
+        int len = snprintf(path, BUFSIZE, "%s/%s", dir_path, entry->d_name);
+        if (len < 0 || len >= BUFSIZE || stat(path, &statbuf) == -1 ||
+            !S_ISREG(statbuf.st_mode))
+            continue;
+
+        snprintf(files[n_files].name, BUFSIZE, "%s", entry->d_name);
+        files[n_files].size = statbuf.st_size;
+        n_files++;
+    }
+
+    closedir(dir);
+    if (n_files == 0) {
+        fprintf(stderr, "No files found in %s\n", dir_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Opens a non-blocking connection to the server and adds it to the epoll set
+// Returns 0 on success or -1 on error
+static int conn_open(bench_conn_t *conn, int epoll_fd) {
+    conn->fd = socket(server_addr->ai_family, server_addr->ai_socktype | SOCK_CLOEXEC,
+                      server_addr->ai_protocol);
+    if (conn->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // Connect while still blocking so requests can be written right away
+    if (connect(conn->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        perror("connect");
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int flags = fcntl(conn->fd, F_GETFL);
+    fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    conn->state = CONN_IDLE;
+    return 0;
+}
+
+// Replaces a connection the server closed, or that failed, with a new one
+static int conn_reopen(bench_conn_t *conn, int epoll_fd) {
+    close(conn->fd);
+    return conn_open(conn, epoll_fd);
+}
+
+// Picks a file and writes its request to the connection
+static void conn_start_request(bench_thread_t *self, bench_conn_t *conn, uint64_t due_ns) {
+    conn->file = &files[rand_r(&self->seed) % n_files];
+    conn->request_len = snprintf(conn->request, BUFSIZE, "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                 conn->file->name, host);
+    conn->request_sent = 0;
+    conn->headers_len = 0;
+    conn->close_after = 0;
+    conn->start_ns = due_ns;
+    conn->state = CONN_SENDING;
+}
+
+// Finds the end of the response headers and reads what they say about the body
+// Returns 1 once the headers are complete, 0 if more are needed or -1 on error
+static int parse_headers(bench_conn_t *conn, size_t *header_end) {
+    char *end = memmem(conn->headers, conn->headers_len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return conn->headers_len == RESPONSE_HEADER_MAX ? -1 : 0;
+    *header_end = end - conn->headers + 4;
+    *end = '\0';
+
+    int status;
+    if (sscanf(conn->headers, "HTTP/1.%*d %d", &status) != 1 || status != 200)
+        return -1;
+
+    char *length = strcasestr(conn->headers, "\r\nContent-Length:");
+    if (length == NULL)
+        return -1;
+    conn->body_left = strtol(length + strlen("\r\nContent-Length:"), NULL, 10);
+    if (conn->body_left != conn->file->size)
+        return -1;
+
+    conn->close_after = strcasestr(conn->headers, "\r\nConnection: close") != NULL;
+    return 1;
+}
+
+// Moves a connection as far through its request and response as the socket
+// allows without blocking
+// Returns 1 when the response is complete, 0 if it is still in progress or -1
+// on error
+static int conn_progress(bench_thread_t *self, bench_conn_t *conn, char *buf) {
+    while (conn->state == CONN_SENDING) {
+        ssize_t n = send(conn->fd, conn->request + conn->request_sent,
+                         conn->request_len - conn->request_sent, MSG_NOSIGNAL);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        conn->request_sent += n;
+        if (conn->request_sent == conn->request_len)
+            conn->state = CONN_HEADERS;
+    }
+
+    while (conn->state == CONN_HEADERS || conn->state == CONN_BODY) {
+        ssize_t n;
+        if (conn->state == CONN_HEADERS)
+            n = recv(conn->fd, conn->headers + conn->headers_len,
+                     RESPONSE_HEADER_MAX - conn->headers_len, 0);
+        else
+            n = recv(conn->fd, buf, conn->body_left < RECV_BUFSIZE ? conn->body_left
+                                                                  : RECV_BUFSIZE, 0);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (n == 0)
+            return -1;
+        self->bytes += n;
+
+        if (conn->state == CONN_HEADERS) {
+            conn->headers_len += n;
+            size_t header_end;
+            int result = parse_headers(conn, &header_end);
+            if (result != 1)
+                return result;
+
+            // Whatever came after the headers is the start of the body
+            conn->body_left -= conn->headers_len - header_end;
+            conn->state = CONN_BODY;
+        } else {
+            conn->body_left -= n;
+        }
+
+        if (conn->state == CONN_BODY && conn->body_left <= 0) {
+            conn->state = CONN_IDLE;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Records the outcome of a finished request and gets the connection ready for
+// the next one
+// result: 1 if the response arrived or -1 if the request failed
+// Returns 0 on success or -1 if the connection couldn't be replaced
+static int conn_finish(bench_thread_t *self, bench_conn_t *conn, int result, int epoll_fd) {
+    if (result == 1) {
+        self->n_requests++;
+        histogram_record(&self->latency, now_ns() - conn->start_ns);
+    } else {
+        self->n_errors++;
+    }
+
+    conn->state = CONN_IDLE;
+    if (result == -1 || conn->close_after)
+        return conn_reopen(conn, epoll_fd);
+    return 0;
+}
+
+void *bench_thread_func(void *arg) {
+    bench_thread_t *self = (bench_thread_t *) arg;
+
+    char *buf = malloc(RECV_BUFSIZE);
+    bench_conn_t **idle = malloc(self->n_conns * sizeof(bench_conn_t *));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (buf == NULL || idle == NULL || epoll_fd == -1) {
+        perror("bench thread setup");
+        free(buf);
+        free(idle);
+        return NULL;
+    }
+
+    int n_idle = 0;
+    for (int i = 0; i < self->n_conns; i++) {
+        if (conn_open(&self->conns[i], epoll_fd) == -1)
+            goto done;
+        idle[n_idle++] = &self->conns[i];
+    }
+
+    // Open loop: arrival number 'issued' is due at start_ns + issued * interval
+    uint64_t interval_ns = self->rate > 0 ? 1e9 / self->rate : 0;
+    unsigned long issued = 0;
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now = now_ns();
+    while (now < end_ns) {
+        // Hand due requests to free connections
+        uint64_t wait_ns = end_ns - now;
+        while (n_idle > 0) {
+            uint64_t due_ns = now;
+            if (interval_ns > 0) {
+                due_ns = start_ns + issued * interval_ns;
+                if (due_ns > now) {
+                    if (due_ns - now < wait_ns)
+                        wait_ns = due_ns - now;
+                    break;
+                }
+                issued++;
+            }
+
+            bench_conn_t *conn = idle[--n_idle];
+            conn_start_request(self, conn, due_ns);
+            int result = conn_progress(self, conn, buf);
+            if (result != 0 && conn_finish(self, conn, result, epoll_fd) == -1)
+                goto done;
+            if (conn->state == CONN_IDLE)
+                idle[n_idle++] = conn;
+        }
+
+        // Round the timeout up so the loop doesn't spin just short of a deadline
+        int timeout_ms = (wait_ns + 999999) / 1000000;
+        int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n_events == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        now = now_ns();
+        for (int i = 0; i < n_events; i++) {
+            bench_conn_t *conn = events[i].data.ptr;
+            if (conn->state == CONN_IDLE) {
+                // The server closed a connection left idle, replace it before
+                // a request is sent on it
+                if ((events[i].events & (EPOLLRDHUP | EPOLLHUP)) &&
+                    conn_reopen(conn, epoll_fd) == -1)
+                    goto done;
+                continue;
+            }
+
+            int result = conn_progress(self, conn, buf);
+            if (result == 0)
+                continue;
+            if (conn_finish(self, conn, result, epoll_fd) == -1)
+                goto done;
+            idle[n_idle++] = conn;
+        }
+    }
+
+    // Arrivals that came due but never found a free connection
+    if (interval_ns > 0 && end_ns > start_ns) {
+        unsigned long due = (end_ns - start_ns) / interval_ns;
+        if (due > issued)
+            self->n_dropped = due - issued;
+    }
+
+done:
+    for (int i = 0; i < self->n_conns; i++) {
+        if (self->conns[i].fd != -1)
+            close(self->conns[i].fd);
+    }
+    close(epoll_fd);
+    free(idle);
+    free(buf);
+    return NULL;
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [--connections=N] [--threads=N] [--duration=SEC] [--rate=REQ_PER_SEC]\n"
+           "       <directory> <host> <port>\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int n_conns = DEFAULT_CONNECTIONS;
+    int n_threads = 1;
+    int duration = DEFAULT_DURATION_SEC;
+    double rate = 0;
+
+    static const struct option options[] = {
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "rate", required_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        if (opt == 'c') {
+            n_conns = atoi(optarg);
+        } else if (opt == 't') {
+            n_threads = atoi(optarg);
+        } else if (opt == 'd') {
+            duration = atoi(optarg);
+        } else if (opt == 'r') {
+            rate = atof(optarg);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3 || n_conns < 1 || n_threads < 1 || duration < 1 || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (n_threads > n_conns)
+        n_threads = n_conns;
+
+    if (load_files(argv[optind]) == -1)
+        return 1;
+    host = argv[optind + 1];
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int result = getaddrinfo(host, argv[optind + 2], &hints, &server_addr);
+    if (result != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(result));
+        return 1;
+    }
+
+    bench_conn_t *conns = malloc(n_conns * sizeof(bench_conn_t));
+    bench_thread_t *threads = malloc(n_threads * sizeof(bench_thread_t));
+    if (conns == NULL || threads == NULL) {
+        perror("malloc");
+        freeaddrinfo(server_addr);
+        return 1;
+    }
+
+    // Split connections and the arrival rate evenly across threads
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t) duration * 1000000000;
+    int next_conn = 0;
+    for (int i = 0; i < n_threads; i++) {
+        bench_thread_t *thread = &threads[i];
+        thread->n_conns = n_conns / n_threads + (i < n_conns % n_threads);
+        thread->conns = conns + next_conn;
+        next_conn += thread->n_conns;
+        for (int j = 0; j < thread->n_conns; j++)
+            thread->conns[j].fd = -1;
+
+        thread->rate = rate / n_threads;
+        thread->seed = i + 1;
+        histogram_init(&thread->latency);
+        thread->n_requests = 0;
+        thread->n_errors = 0;
+        thread->n_dropped = 0;
+        thread->bytes = 0;
+
+        result = pthread_create(&thread->thread, NULL, bench_thread_func, thread);
+        if (result) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            n_threads = i;
+            break;
+        }
+    }
+
+    // Combine the threads' results
+    histogram_t latency;
+    histogram_init(&latency);
+    unsigned long n_requests = 0, n_errors = 0, n_dropped = 0, bytes = 0;
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        histogram_merge(&latency, &threads[i].latency);
+        n_requests += threads[i].n_requests;
+        n_errors += threads[i].n_errors;
+        n_dropped += threads[i].n_dropped;
+        bytes += threads[i].bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    if (rate > 0)
+        printf("Open loop at %.0f req/s", rate);
+    else
+        printf("Closed loop");
+    printf(", %d connections, %d threads, %.1f s\n", n_conns, n_threads, elapsed);
+    printf("Requests:   %lu ok, %lu errors", n_requests, n_errors);
+    if (rate > 0)
+        printf(", %lu never sent", n_dropped);
+    printf("\n");
+    printf("Throughput: %.0f req/s, %.1f MB/s\n", n_requests / elapsed,
+           bytes / elapsed / (1 << 20));
+    printf("Latency:    p50 %.0f us, p90 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n",
+           histogram_quantile(&latency, 0.5) / 1e3, histogram_quantile(&latency, 0.9) / 1e3,
+           histogram_quantile(&latency, 0.99) / 1e3, histogram_quantile(&latency, 0.999) / 1e3,
+           atomic_load(&latency.max) / 1e3);
+
+    free(threads);
+    free(conns);
+    freeaddrinfo(server_addr);
+    return 0;
+}
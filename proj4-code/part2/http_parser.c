@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+// Characters allowed in a method or header name (RFC 9110 "tchar")
+static const unsigned char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+    ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+};
+
+static int is_token_char(char c) {
+    return token_chars[(unsigned char) c];
+}
+
+size_t http_find_request_end(const char *buf, size_t len, size_t *scanned) {
+    const char *end = memmem(buf + *scanned, len - *scanned, "\r\n\r\n", 4);
+    if (end == NULL) {
+        // The terminator could straddle what we have and the next read
+        *scanned = len < 3 ? 0 : len - 3;
+        return 0;
+    }
+    return end - buf + 4;
+}
+
+/*
+ * Consume a run of token characters ending in 'delim'
+ * Returns a pointer just past the delimiter, or NULL if the run is empty or
+ * ends in anything else
+ */
+static const char *parse_token(const char *pos, const char *end, char delim, str_view_t *token) {
+    token->ptr = pos;
+    while (pos < end && is_token_char(*pos))
+        pos++;
+    token->len = pos - token->ptr;
+    if (token->len == 0 || pos == end || *pos != delim)
+        return NULL;
+    return pos + 1;
+}
+
+int http_parse_request(const char *buf, size_t len, http_request_t *request) {
+    const char *pos = buf;
+    const char *end = buf + len;
+
+    // Method
+    pos = parse_token(pos, end, ' ', &request->method);
+    if (pos == NULL)
+        return -1;
+
+    // Request target, any visible characters
+    request->target.ptr = pos;
+    while (pos < end && *pos > ' ' && *pos != 0x7f)
+        pos++;
+    request->target.len = pos - request->target.ptr;
+    if (request->target.len == 0 || pos == end || *pos != ' ')
+        return -1;
+    pos++;
+
+    // Version
+    if (end - pos < 10 || memcmp(pos, "HTTP/1.", 7) != 0 ||
+        pos[7] < '0' || pos[7] > '9' || pos[8] != '\r' || pos[9] != '\n')
+        return -1;
+    request->minor_version = pos[7] - '0';
+    pos += 10;
+
+    // Headers, up to the blank line
+    request->n_headers = 0;
+    while (1) {
+        if (end - pos < 2)
+            return -1;
+        if (pos[0] == '\r' && pos[1] == '\n')
+            break;
+
+        if (request->n_headers == HTTP_MAX_HEADERS)
+            return -1;
+        http_header_t *header = &request->headers[request->n_headers++];
+
+        pos = parse_token(pos, end, ':', &header->name);
+        if (pos == NULL)
+            return -1;
+
+        // Value without surrounding whitespace
+        while (pos < end && (*pos == ' ' || *pos == '\t'))
+            pos++;
+        const char *line_end = memchr(pos, '\r', end - pos);
+        if (line_end == NULL || line_end + 1 == end || line_end[1] != '\n')
+            return -1;
+        const char *value_end = line_end;
+        while (value_end > pos && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+        header->value.ptr = pos;
+        header->value.len = value_end - pos;
+
+        pos = line_end + 2;
+    }
+
+    // HTTP/1.1 connections persist unless the client asks otherwise,
+    // HTTP/1.0 connections only persist if the client asks
+    request->keep_alive = request->minor_version >= 1;
+    const str_view_t *connection = http_request_header(request, "Connection");
+    if (connection != NULL) {
+        if (str_view_has_token(*connection, "close"))
+            request->keep_alive = 0;
+        else if (str_view_has_token(*connection, "keep-alive"))
+            request->keep_alive = 1;
+    }
+
+    return 0;
+}
+
+const str_view_t *http_request_header(const http_request_t *request, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->n_headers; i++) {
+        const http_header_t *header = &request->headers[i];
+        if (header->name.len == name_len && strncasecmp(header->name.ptr, name, name_len) == 0)
+            return &header->value;
+    }
+    return NULL;
+}
+
+int str_view_eq(str_view_t view, const char *str) {
+    return strlen(str) == view.len && memcmp(view.ptr, str, view.len) == 0;
+}
+
+int str_view_has_token(str_view_t view, const char *token) {
+    size_t token_len = strlen(token);
+    const char *pos = view.ptr;
+    const char *end = view.ptr + view.len;
+
+    while (pos < end) {
+        // Find the bounds of the next list element
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        const char *elem = pos;
+        while (pos < end && *pos != ',')
+            pos++;
+        const char *elem_end = pos;
+        while (elem_end > elem && (elem_end[-1] == ' ' || elem_end[-1] == '\t'))
+            elem_end--;
+
+        if (elem_end - elem == token_len && strncasecmp(elem, token, token_len) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Parses a qvalue ("0", "0.5", "1.000") into thousandths
+// Returns the value or -1 if it is malformed
+static int parse_quality(const char *pos, const char *end) {
+    if (pos == end || (*pos != '0' && *pos != '1'))
+        return -1;
+    int quality = (*pos++ - '0') * 1000;
+    if (pos < end && *pos == '.') {
+        pos++;
+        for (int scale = 100; pos < end && *pos >= '0' && *pos <= '9' && scale > 0; scale /= 10)
+            quality += (*pos++ - '0') * scale;
+    }
+    if (pos != end || quality > 1000)
+        return -1;
+    return quality;
+}
+
+int http_token_quality(str_view_t value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *pos = value.ptr;
+    const char *end = value.ptr + value.len;
+    int wildcard = -1;
+
+    while (pos < end) {
+        // Find the bounds of the next list element and of its name
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        const char *elem = pos;
+        while (pos < end && *pos != ',')
+            pos++;
+        const char *elem_end = pos;
+        const char *name_end = memchr(elem, ';', elem_end - elem);
+        if (name_end == NULL)
+            name_end = elem_end;
+        const char *params = name_end;
+        while (name_end > elem && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+            name_end--;
+
+        // Only a q parameter is expected
+        int quality = 1000;
+        while (params < elem_end && (*params == ';' || *params == ' ' || *params == '\t'))
+            params++;
+        if (elem_end - params > 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+            const char *q_end = elem_end;
+            while (q_end > params && (q_end[-1] == ' ' || q_end[-1] == '\t'))
+                q_end--;
+            quality = parse_quality(params + 2, q_end);
+            if (quality == -1)
+                quality = 0;
+        }
+
+        if (name_end - elem == token_len && strncasecmp(elem, token, token_len) == 0)
+            return quality;
+        if (name_end - elem == 1 && *elem == '*')
+            wildcard = quality;
+    }
+
+    return wildcard;
+}
+
+// Returns the value of a hexadecimal digit, or -1 if it isn't one
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int http_normalize_path(str_view_t path, char *buf, size_t bufsize) {
+    if (path.len == 0 || path.ptr[0] != '/' || bufsize == 0)
+        return -1;
+
+    size_t out = 0;
+    size_t i = 0;
+    while (i < path.len) {
+        while (i < path.len && path.ptr[i] == '/')
+            i++;
+        if (i == path.len)
+            break;
+
+        // Copy the segment, decoded, after a separator unless it is the first
+        size_t segment = out;
+        if (out > 0) {
+            if (out + 1 >= bufsize)
+                return -1;
+            buf[out++] = '/';
+        }
+        size_t name = out;
+        while (i < path.len && path.ptr[i] != '/') {
+            char c = path.ptr[i++];
+            if (c == '%') {
+                int high = i + 1 < path.len ? hex_value(path.ptr[i]) : -1;
+                int low = high != -1 ? hex_value(path.ptr[i + 1]) : -1;
+                if (low == -1)
+                    return -1;
+                c = (char) (high << 4 | low);
+                i += 2;
+                if (c == '\0' || c == '/')
+                    return -1;
+            }
+            if (out + 1 >= bufsize)
+                return -1;
+            buf[out++] = c;
+        }
+
+        size_t name_len = out - name;
+        if (name_len == 1 && buf[name] == '.') {
+            out = segment;
+        } else if (name_len == 2 && buf[name] == '.' && buf[name + 1] == '.') {
+            if (segment == 0)
+                return -1;
+            // Back up over the previous segment and its separator
+            out = segment;
+            while (out > 0 && buf[out - 1] != '/')
+                out--;
+            if (out > 0)
+                out--;
+        }
+    }
+
+    buf[out] = '\0';
+    return out;
+}
+
+// Parses a run of decimal digits into a non-negative offset
+// Returns a pointer past the digits, or NULL if there are none or they overflow
+static const char *parse_offset(const char *pos, const char *end, off_t *value) {
+    const char *start = pos;
+    off_t result = 0;
+    while (pos < end && *pos >= '0' && *pos <= '9') {
+        int digit = *pos - '0';
+        if (result > (INT64_MAX - digit) / 10)
+            return NULL;
+        result = result * 10 + digit;
+        pos++;
+    }
+    if (pos == start)
+        return NULL;
+    *value = result;
+    return pos;
+}
+
+int http_parse_ranges(str_view_t value, http_range_t *ranges) {
+    const char *pos = value.ptr;
+    const char *end = value.ptr + value.len;
+    if (value.len < 6 || strncasecmp(pos, "bytes=", 6) != 0)
+        return -1;
+    pos += 6;
+
+    int n_ranges = 0;
+    while (1) {
+        while (pos < end && (*pos == ' ' || *pos == '\t'))
+            pos++;
+
+        // Empty list elements are allowed
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        if (pos == end)
+            break;
+
+        if (n_ranges == HTTP_MAX_RANGES)
+            return -1;
+        http_range_t *range = &ranges[n_ranges++];
+
+        if (*pos == '-') {
+            // Suffix range: the last N bytes
+            range->first = -1;
+            pos = parse_offset(pos + 1, end, &range->last);
+            if (pos == NULL)
+                return -1;
+        } else {
+            pos = parse_offset(pos, end, &range->first);
+            if (pos == NULL || pos == end || *pos != '-')
+                return -1;
+            pos++;
+            range->last = -1;
+            if (pos < end && *pos >= '0' && *pos <= '9') {
+                pos = parse_offset(pos, end, &range->last);
+                if (pos == NULL || range->last < range->first)
+                    return -1;
+            }
+        }
+
+        while (pos < end && (*pos == ' ' || *pos == '\t'))
+            pos++;
+        if (pos < end && *pos != ',')
+            return -1;
+    }
+
+    return n_ranges > 0 ? n_ranges : -1;
+}
+
+static const char *const weekdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *const months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+int http_parse_date(str_view_t value, time_t *time) {
+    // Fixed layout: "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (value.len != 29)
+        return -1;
+
+    char buf[30];
+    memcpy(buf, value.ptr, 29);
+    buf[29] = '\0';
+
+    char month[4];
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int used = 0;
+    if (sscanf(buf + 5, "%2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, month, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &used) != 6 || used != 24)
+        return -1;
+
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (strcmp(month, months[i]) == 0)
+            tm.tm_mon = i;
+    }
+    if (tm.tm_mon == -1)
+        return -1;
+    tm.tm_year -= 1900;
+
+    *time = timegm(&tm);
+    return *time == -1 ? -1 : 0;
+}
+
+void http_format_date(char *buf, time_t time) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    snprintf(buf, HTTP_DATE_LEN, "%s, %02d %s %04d %02d:%02d:%02d GMT", weekdays[tm.tm_wday],
+             tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
@@ -0,0 +1,125 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_RANGES 8   // Larger Range sets are ignored
+
+// A string inside a request buffer. Not null-terminated, and only valid while
+// the buffer it points into is unchanged.
+typedef struct {
+    const char *ptr;
+    size_t len;
+} str_view_t;
+
+typedef struct {
+    str_view_t name;
+    str_view_t value;
+} http_header_t;
+
+// A parsed HTTP request, pointing into the buffer it was parsed from
+typedef struct {
+    str_view_t method;
+    str_view_t target;
+    int minor_version;  // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int keep_alive;     // Nonzero if the client wants the connection kept open
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int n_headers;
+} http_request_t;
+
+/*
+ * Find the end of a request's header block
+ * buf: Buffered request data
+ * len: Number of bytes in 'buf'
+ * scanned: Number of bytes at the start of 'buf' already known not to contain
+ * the end of the headers, so that data arriving across several reads is only
+ * searched once. Updated when the end is not found.
+ * Returns the length of the request including its terminating blank line, or
+ * 0 if the request is incomplete
+ */
+size_t http_find_request_end(const char *buf, size_t len, size_t *scanned);
+
+/*
+ * Parse a request line and headers in place, without copying or allocating
+ * buf: A complete request header block, as found by http_find_request_end()
+ * len: Length of the header block
+ * request: Filled in with views into 'buf' on success
+ * Returns 0 on success or -1 if the request is malformed
+ */
+int http_parse_request(const char *buf, size_t len, http_request_t *request);
+
+/*
+ * Look up a request header by name, ignoring case
+ * Returns the header's value or NULL if the request doesn't have the header
+ */
+const str_view_t *http_request_header(const http_request_t *request, const char *name);
+
+/*
+ * Compare a view to a null-terminated string
+ * Returns 1 if they are equal, 0 otherwise
+ */
+int str_view_eq(str_view_t view, const char *str);
+
+/*
+ * Check whether a comma separated header value contains a token, ignoring case
+ * Returns 1 if the token is present, 0 otherwise
+ */
+int str_view_has_token(str_view_t view, const char *token);
+
+/*
+ * Find the quality a list such as Accept-Encoding gives a token, ignoring
+ * case: "gzip;q=0.5, *;q=0" gives gzip 0.5 and anything else 0
+ * Returns the quality from 0 to 1000 (1000 if no q= parameter is given), or
+ * -1 if neither the token nor "*" is listed
+ */
+int http_token_quality(str_view_t value, const char *token);
+
+/*
+ * Turn the path of a request target into the path of a file relative to the
+ * served directory: percent-escapes are decoded, empty and "." segments
+ * dropped, and each ".." removes the segment before it, so "/a//b/../%63"
+ * becomes "a/c" and "/" becomes ""
+ * path: The target's path, without any query string
+ * buf: Buffer for the result, null-terminated
+ * Returns the length of the result, or -1 if the path doesn't start with '/',
+ * has a malformed escape or an escaped '/' or NUL, would climb above the
+ * root with "..", or doesn't fit in 'buf'
+ */
+int http_normalize_path(str_view_t path, char *buf, size_t bufsize);
+
+// One byte range from a Range header, before it is checked against a size
+// 'first' is -1 for a suffix range of the last 'last' bytes, and 'last' is -1
+// for a range running to the end
+typedef struct {
+    off_t first;
+    off_t last;
+} http_range_t;
+
+/*
+ * Parse the value of a Range header in the "bytes" unit
+ * value: The header's value
+ * ranges: Filled in with up to HTTP_MAX_RANGES ranges on success
+ * Returns the number of ranges on success, or -1 if the value is malformed,
+ * uses another unit or has too many ranges, in which case the header should be
+ * ignored
+ */
+int http_parse_ranges(str_view_t value, http_range_t *ranges);
+
+/*
+ * Parse an HTTP date in the preferred IMF-fixdate form, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT"
+ * Returns 0 on success or -1 if the value isn't one
+ */
+int http_parse_date(str_view_t value, time_t *time);
+
+/*
+ * Format a time as an IMF-fixdate, for Last-Modified and similar headers
+ * buf: Buffer to write into, at least HTTP_DATE_LEN bytes
+ */
+#define HTTP_DATE_LEN 32
+void http_format_date(char *buf, time_t time);
+
+#endif // HTTP_PARSER_H
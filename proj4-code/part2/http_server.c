@@ -1,98 +1,162 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "connection_queue.h"
+#include "event_loop.h"
+#include "dir_watch.h"
+#include "file_cache.h"
 #include "http.h"
-
-#define BUFSIZE 512
-#define LISTEN_QUEUE_LEN 5
-#define N_THREADS 5
-
-int keep_going = 1;
-const char *serve_dir;
+#include "mime_types.h"
+#include "server_stats.h"
+#include "thread_pool.h"
+#ifdef HAVE_IO_URING
+#include "uring_loop.h"
+#endif
+
+#define THREADS_PER_CPU_MAX 4   // Default maximum pool size per CPU
+#define KEEPALIVE_TIMEOUT_SEC 5
+#define KEEPALIVE_MAX_REQUESTS 100
+#define WORKER_STARTUP_MS 1000  // A worker failing sooner isn't restarted
+#define DRAIN_TIMEOUT_SEC 10    // Default time in-flight requests get to finish
+#define DRAIN_POLL_MS 100       // How often a pool worker waiting on a client checks for SIGINT
+#define STATS_SPARE_BLOCKS 8    // Shared statistics blocks per worker beyond its pool and loops
+
+// How connections are spread across threads
+typedef enum {
+    MODE_POOL,   // Acceptor thread feeding a pool of blocking workers
+    MODE_EPOLL,  // One non-blocking event loop per CPU
+    MODE_URING,  // One io_uring loop per CPU
+} server_mode_t;
+
+// Settings taken from the command line
+typedef struct {
+    server_mode_t mode;
+    scheduler_t scheduler;
+    int min_threads;    // Pool workers kept running when idle
+    int max_threads;    // Pool workers running under load
+    int backlog;        // Pending connections each listening socket holds
+    int n_loops;        // Event loops per process
+    int workers;        // Processes to prefork, or 0 to serve from this one
+    int pin_cpus;       // Whether each worker is pinned to its own CPU
+    int max_open_files;
+    int watch_dir;
+    int drain_timeout;  // Seconds to finish requests in after SIGINT
+    const char *serve_dir;
+    const char *port;
+} server_config_t;
+
+// Cleared by the SIGINT handler; lock-free, so safe both there and for the
+// pool workers that check it between requests
+atomic_int keep_going = 1;
+path_cache_t path_cache;
+file_cache_t file_cache;
+dir_watch_t dir_watch;
 
 void handle_sigint(int signo) {
     keep_going = 0;
 }
 
-void *thread_func(void *arg) {
-    connection_queue_t *queue = (connection_queue_t*) arg;
-
-    while (1) {
-        int client_fd = connection_dequeue(queue);
-        if (client_fd == -1) {
-            if (queue->shutdown)
-                return NULL;
-            continue;
-        }
+// Only there so that a worker exiting interrupts sigsuspend()
+void handle_sigchld(int signo) {
+}
 
-        // Read request from client
-        char res_name[BUFSIZE];
-        if (read_http_request(client_fd, res_name) == -1) {
-            if (close(client_fd) == -1)
-                perror("close");
-            continue;
-        }
+// Current monotonic time in milliseconds
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        // Get path to resource
-        char res_path[BUFSIZE];
-        strcpy(res_path, serve_dir);
-        strcat(res_path, res_name);
-
-        // Write response to client
-        write_http_response(client_fd, res_path);
-
-        // if (write_http_response(client_fd, res_path) == -1) {
-        //     if (close(client_fd) == -1)
-        //         perror("close");
-        //     continue;
-        // }
-        //
-        // Note: Error handling logic not necessary since the code below
-        // does the same cleanup steps
-
-        // Clean up
-        if (close(client_fd) == -1)
-            perror("close");
+/*
+ * Serve requests from one client until it closes the connection, goes idle
+ * for KEEPALIVE_TIMEOUT_SEC, or has sent KEEPALIVE_MAX_REQUESTS requests.
+ * After SIGINT, a request already under way is still answered, but the
+ * connection is closed after it or right away if it is idle.
+ */
+void serve_connection(int client_fd, uint64_t taken_ns) {
+    // Wake up every so often to see whether the server is draining
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = DRAIN_POLL_MS * 1000 };
+    if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("setsockopt");
+        return;
     }
 
-    return NULL;
+    http_conn_t conn;
+    http_conn_init(&conn, client_fd);
+    conn.start_ns = taken_ns;   // The first parse carries on from the queue wait
+
+    for (int n_requests = 1;; n_requests++) {
+        // Read request from client, bounding how long an idle client can hold
+        // on to this worker; a client still sending resets the clock. The
+        // clock starts at the first receive timeout, so requests that arrive
+        // in time cost no clock read, and idle clients get up to
+        // DRAIN_POLL_MS longer.
+        http_request_t request;
+        long idle_since = 0;
+        size_t buffered = 0;
+        int result;
+        while ((result = read_http_request(&conn, &request)) == 2) {
+            if (idle_since == 0 || conn.end - conn.start != buffered) {
+                buffered = conn.end - conn.start;
+                idle_since = now_ms();
+            }
+            if ((!keep_going && !http_conn_busy(&conn)) ||
+                now_ms() - idle_since >= KEEPALIVE_TIMEOUT_SEC * 1000)
+                break;
+        }
+        if (result != 0)
+            break;
+
+        // Write response to client, from the cache when possible
+        int keep_alive = request.keep_alive && n_requests < KEEPALIVE_MAX_REQUESTS && keep_going;
+        http_response_t response;
+        int prepared = prepare_request_response(&response, &request, conn.parsed_ns,
+                                                &path_cache, &file_cache, keep_alive);
+        if (prepared == -1)
+            break;
+        if (prepared == 1)
+            keep_alive = 0;
+
+        result = send_http_response(client_fd, &response);
+        free_http_response(&response);
+        if (result == -1)
+            break;
+
+        if (!keep_alive)
+            break;
+    }
 }
 
-int main(int argc, char **argv) {
+/*
+ * Create a socket listening on 'port'
+ * backlog: Maximum number of pending connections
+ * reuseport: If nonzero, set SO_REUSEPORT so several sockets can share the port
+ * Returns the socket's file descriptor or -1 on error
+ */
+int open_listen_socket(const char *port, int backlog, int reuseport) {
     int result;
 
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
-        return 1;
-    }
-
-    // Read arguments
-    serve_dir = argv[1];
-    const char *port = argv[2];
-
-    // Setup sigaction struct
-    struct sigaction sigact;
-    sigact.sa_handler = handle_sigint;
-    sigfillset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-
-    // Set action for signal
-    result = sigaction(SIGINT, &sigact, NULL);
-    if (result == -1) {
-        perror("sigaction");
-        return 1;
-    }
-
     // Set up arguments
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -105,7 +169,7 @@ int main(int argc, char **argv) {
     result = getaddrinfo(NULL, port, &hints, &server);
     if (result != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(result));
-        return 1;
+        return -1;
     }
 
     // Get socket descriptor
@@ -113,7 +177,36 @@ int main(int argc, char **argv) {
     if (sock_fd == -1) {
         perror("socket");
         freeaddrinfo(server);
-        return 1;
+        return -1;
+    }
+
+    // Keep-alive connections are usually closed by the server, so let a
+    // restarted server bind the port while old connections sit in TIME_WAIT
+    int one = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        freeaddrinfo(server);
+        close(sock_fd);
+        return -1;
+    }
+
+    // Responses are written whole (see send_http_response), so there are no
+    // small writes for Nagle's algorithm to merge; it would only hold back the
+    // last segment of each response until the client's delayed ACK. Accepted
+    // connections inherit the option.
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        freeaddrinfo(server);
+        close(sock_fd);
+        return -1;
+    }
+
+    // Allow other sockets to bind the same port
+    if (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        freeaddrinfo(server);
+        close(sock_fd);
+        return -1;
     }
 
     // Bind socket to receive at port
@@ -122,106 +215,619 @@ int main(int argc, char **argv) {
         perror("bind");
         freeaddrinfo(server);
         close(sock_fd);
-        return 1;
+        return -1;
     }
 
     // Cleanup address info
     freeaddrinfo(server);
 
     // Designate server socket
-    result = listen(sock_fd, LISTEN_QUEUE_LEN);
+    result = listen(sock_fd, backlog);
     if (result == -1) {
         perror("listen");
         close(sock_fd);
-        return 1;
+        return -1;
     }
 
-    // Set up signal mask struct for worker threads
-    sigset_t newset;
-    if (sigfillset(&newset) == -1) {
-        perror("sigfillset");
+    return sock_fd;
+}
+
+/*
+ * Serve with an acceptor thread handing connections to a pool of workers
+ * Returns 0 on success or 1 on error
+ */
+int run_pool(const server_config_t *config) {
+    // Workers each listen on their own socket
+    int sock_fd = open_listen_socket(config->port, config->backlog, config->workers > 0);
+    if (sock_fd == -1)
+        return 1;
+
+    // Workers are started with signals blocked, so SIGINT interrupts accept()
+    thread_pool_t pool;
+    if (thread_pool_init(&pool, config->scheduler, config->min_threads, config->max_threads,
+                         serve_connection) == -1) {
         close(sock_fd);
         return 1;
     }
 
-    // Set signal mask
+    // Begin accept loop
+    int ret_val = 0;
+    while (keep_going) {
+        // Wait for client request
+        int client_fd = accept(sock_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EINTR)
+                break;
+            perror("accept");
+            ret_val = 1;
+            break;
+        }
+
+        if (thread_pool_submit(&pool, client_fd) == -1)
+            close(client_fd);
+    }
+
+    // Clean up and return
+    if (close(sock_fd) == -1) {
+        perror("close");
+        ret_val = 1;
+    }
+
+    if (thread_pool_shutdown(&pool, config->drain_timeout * 1000) == -1)
+        ret_val = 1;
+
+    return ret_val;
+}
+
+// Event loops hold many connections open, so allow as many descriptors as the
+// hard limit permits
+void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+            perror("setrlimit");
+    }
+}
+
+/*
+ * Serve with config->n_loops epoll event loops, each on its own SO_REUSEPORT
+ * socket
+ * Returns 0 on success or 1 on error
+ */
+int run_epoll(const server_config_t *config) {
+    int n_loops = config->n_loops;
+
+    raise_fd_limit();
+
+    event_loop_t *loops = malloc(n_loops * sizeof(event_loop_t));
+    if (loops == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // Block signals so only the main thread handles SIGINT
+    sigset_t newset;
     sigset_t oldset;
+    sigfillset(&newset);
     if (sigprocmask(SIG_SETMASK, &newset, &oldset) == -1) {
         perror("sigprocmask");
-        close(sock_fd);
+        free(loops);
         return 1;
     }
 
-    // Initialize queue
-    connection_queue_t queue;
-    if (connection_queue_init(&queue) == -1) {
-        close(sock_fd);
-        return 1;
-    }
+    int ret_val = 0;
+    int n_started = 0;
+    for (; n_started < n_loops; n_started++) {
+        event_loop_t *loop = &loops[n_started];
 
-    // Create worker threads
-    pthread_t threads[N_THREADS];
-    for (int i = 0; i < N_THREADS; i++) {
-        result = pthread_create(threads + i, NULL, thread_func, &queue);
+        int sock_fd = open_listen_socket(config->port, config->backlog, 1);
+        if (sock_fd == -1) {
+            ret_val = 1;
+            break;
+        }
 
-        if (result) {
-            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        if (event_loop_init(loop, sock_fd, &path_cache, &file_cache,
+                            KEEPALIVE_TIMEOUT_SEC, KEEPALIVE_MAX_REQUESTS,
+                            config->drain_timeout) == -1) {
             close(sock_fd);
-            connection_queue_shutdown(&queue);
-            for (int j = 0; j < i; j++)
-                pthread_join(threads[j], NULL);
-            connection_queue_free(&queue);
-            return 1;
+            ret_val = 1;
+            break;
+        }
+
+        if (event_loop_start(loop) == -1) {
+            event_loop_free(loop);
+            close(sock_fd);
+            ret_val = 1;
+            break;
         }
     }
 
-    // Restore signal mask
+    // Wait for SIGINT, atomically unblocking it so it can't slip in between
+    // the check and the wait
+    while (ret_val == 0 && keep_going)
+        sigsuspend(&oldset);
+
     if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1) {
         perror("sigprocmask");
-        close(sock_fd);
-        connection_queue_shutdown(&queue);
-        for (int i = 0; i < N_THREADS; i++)
-            pthread_join(threads[i], NULL);
-        connection_queue_free(&queue);
+        ret_val = 1;
+    }
+
+    // Have every loop drain at once, then wait for each and clean up
+    for (int i = 0; i < n_started; i++) {
+        if (event_loop_drain(&loops[i]) == -1)
+            ret_val = 1;
+    }
+    for (int i = 0; i < n_started; i++) {
+        if (event_loop_stop(&loops[i]) == -1)
+            ret_val = 1;
+
+        if (close(loops[i].listen_fd) == -1) {
+            perror("close");
+            ret_val = 1;
+        }
+
+        if (event_loop_free(&loops[i]) == -1)
+            ret_val = 1;
+    }
+
+    free(loops);
+    return ret_val;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Serve with config->n_loops io_uring loops, each on its own SO_REUSEPORT socket
+ * Returns 0 on success or 1 on error
+ */
+int run_uring(const server_config_t *config) {
+    int n_loops = config->n_loops;
+
+    raise_fd_limit();
+
+    uring_loop_t *loops = malloc(n_loops * sizeof(uring_loop_t));
+    if (loops == NULL) {
+        perror("malloc");
         return 1;
     }
 
-    // Begin accept loop
-    while (keep_going) {
-        // Wait for client request
-        int client_fd = accept(sock_fd, NULL, NULL);
-        if (client_fd == -1) {
-            if (errno == EINTR)
-                break;
-            perror("accept");
+    // Block signals so only the main thread handles SIGINT
+    sigset_t newset;
+    sigset_t oldset;
+    sigfillset(&newset);
+    if (sigprocmask(SIG_SETMASK, &newset, &oldset) == -1) {
+        perror("sigprocmask");
+        free(loops);
+        return 1;
+    }
+
+    int ret_val = 0;
+    int n_started = 0;
+    for (; n_started < n_loops; n_started++) {
+        uring_loop_t *loop = &loops[n_started];
+
+        int sock_fd = open_listen_socket(config->port, config->backlog, 1);
+        if (sock_fd == -1) {
+            ret_val = 1;
+            break;
+        }
+
+        if (uring_loop_init(loop, sock_fd, &path_cache, &file_cache,
+                            KEEPALIVE_TIMEOUT_SEC, KEEPALIVE_MAX_REQUESTS,
+                            config->drain_timeout) == -1) {
             close(sock_fd);
-            return 1;
+            ret_val = 1;
+            break;
         }
 
-        connection_enqueue(&queue, client_fd);
+        if (uring_loop_start(loop) == -1) {
+            uring_loop_free(loop);
+            close(sock_fd);
+            ret_val = 1;
+            break;
+        }
     }
 
-    // Clean up and return
-    int ret_val = 0;
+    // Wait for SIGINT, atomically unblocking it so it can't slip in between
+    // the check and the wait
+    while (ret_val == 0 && keep_going)
+        sigsuspend(&oldset);
 
-    if (connection_queue_shutdown(&queue) == -1)
+    if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1) {
+        perror("sigprocmask");
         ret_val = 1;
+    }
 
-    if (close(sock_fd) == -1) {
-        perror("close");
+    // Have every loop drain at once, then wait for each and clean up
+    for (int i = 0; i < n_started; i++) {
+        if (uring_loop_drain(&loops[i]) == -1)
+            ret_val = 1;
+    }
+    for (int i = 0; i < n_started; i++) {
+        if (uring_loop_stop(&loops[i]) == -1)
+            ret_val = 1;
+
+        if (close(loops[i].listen_fd) == -1) {
+            perror("close");
+            ret_val = 1;
+        }
+
+        if (uring_loop_free(&loops[i]) == -1)
+            ret_val = 1;
+    }
+
+    free(loops);
+    return ret_val;
+}
+#endif // HAVE_IO_URING
+
+/*
+ * Set up the caches for the served directory and serve until SIGINT
+ * Returns 0 on success or 1 on error
+ */
+int serve(const server_config_t *config) {
+    // Open the directory to serve; files are only ever opened beneath it
+    if (path_cache_init(&path_cache, config->serve_dir) == -1)
+        return 1;
+
+    // Initialize file cache
+    if (file_cache_init(&file_cache, FILE_CACHE_MAX_BYTES, config->max_open_files,
+                        &path_cache) == -1) {
+        path_cache_free(&path_cache);
+        return 1;
+    }
+
+    // Have the caches hear about changes to the served files rather than
+    // revalidate them on a timer. Should any step fail, the watch is left
+    // incomplete and the timer is used anyway.
+    int watch_started = 0;
+    int watching = config->watch_dir && dir_watch_init(&dir_watch, config->serve_dir) == 0;
+    if (watching) {
+        path_cache_watch(&path_cache, &dir_watch);
+        file_cache_watch(&file_cache, &dir_watch);
+        watch_started = dir_watch_start(&dir_watch) == 0;
+    }
+
+    int ret_val;
+#ifdef HAVE_IO_URING
+    if (config->mode == MODE_URING)
+        ret_val = run_uring(config);
+    else
+#endif
+    if (config->mode == MODE_EPOLL)
+        ret_val = run_epoll(config);
+    else
+        ret_val = run_pool(config);
+
+    if (watch_started && dir_watch_stop(&dir_watch) == -1)
         ret_val = 1;
+
+    // Worker processes share their statistics, so the parent reports the total
+    if (config->workers == 0)
+        printf("Drain: %lu requests dropped\n", stats_dropped());
+
+    if (file_cache_free(&file_cache) == -1)
+        ret_val = 1;
+    if (path_cache_free(&path_cache) == -1)
+        ret_val = 1;
+    if (watching && dir_watch_free(&dir_watch) == -1)
+        ret_val = 1;
+
+    return ret_val;
+}
+
+/*
+ * Fork a worker process that serves on its own SO_REUSEPORT socket
+ * index: The worker's number, which picks its CPU if workers are pinned
+ * oldset: Signal mask to restore in the worker
+ * Returns the worker's pid to the parent, or -1 on error
+ */
+pid_t start_worker(const server_config_t *config, int index, const sigset_t *oldset) {
+    pid_t parent = getpid();
+
+    // Don't have buffered output written twice
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
     }
+    if (pid > 0)
+        return pid;
 
-    for (int i = 0; i < N_THREADS; i++) {
-        result = pthread_join(threads[i], NULL);
-        if (result) {
-            fprintf(stderr, "pthread_join: %s\n", gai_strerror(result));
+    // Stop along with the parent, should it die without telling us
+    if (prctl(PR_SET_PDEATHSIG, SIGINT) == -1)
+        perror("prctl");
+    if (getppid() != parent)
+        exit(0);
+
+    signal(SIGCHLD, SIG_DFL);
+    if (sigprocmask(SIG_SETMASK, oldset, NULL) == -1) {
+        perror("sigprocmask");
+        exit(1);
+    }
+
+    // Threads started from here on inherit the affinity
+    if (config->pin_cpus) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % (n_cpus > 0 ? n_cpus : 1), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+            perror("sched_setaffinity");
+    }
+
+    exit(serve(config));
+}
+
+/*
+ * Prefork config->workers processes, each serving on its own SO_REUSEPORT
+ * socket so the kernel spreads connections across them, and supervise them:
+ * a worker that crashes or exits is restarted, unless it reported an error
+ * while starting (e.g. the port is taken), and SIGINT is passed on to every
+ * worker so they stop the way a single process would. The workers'
+ * statistics live in shared memory, so /__stats on any of them and the drain
+ * count printed at exit cover them all.
+ * Returns 0 on success or 1 on error
+ */
+int run_workers(const server_config_t *config) {
+    int n_blocks = config->max_threads + config->n_loops + STATS_SPARE_BLOCKS;
+    if (stats_share(config->workers * n_blocks) == -1)
+        return 1;
+
+    pid_t *pids = calloc(config->workers, sizeof(pid_t));
+    long *started = calloc(config->workers, sizeof(long));
+    if (pids == NULL || started == NULL) {
+        perror("calloc");
+        free(pids);
+        free(started);
+        return 1;
+    }
+
+    struct sigaction sigact;
+    sigact.sa_handler = handle_sigchld;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sigact, NULL) == -1) {
+        perror("sigaction");
+        free(pids);
+        free(started);
+        return 1;
+    }
+
+    // Block SIGINT and SIGCHLD so neither can slip in between checking for
+    // it and waiting
+    sigset_t newset;
+    sigset_t oldset;
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &newset, &oldset) == -1) {
+        perror("sigprocmask");
+        free(pids);
+        free(started);
+        return 1;
+    }
+
+    int ret_val = 0;
+    for (int i = 0; i < config->workers && ret_val == 0; i++) {
+        pids[i] = start_worker(config, i, &oldset);
+        started[i] = now_ms();
+        if (pids[i] == -1)
             ret_val = 1;
+    }
+
+    while (ret_val == 0 && keep_going) {
+        sigsuspend(&oldset);
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int i = 0;
+            while (i < config->workers && pids[i] != pid)
+                i++;
+            if (i == config->workers)
+                continue;
+            pids[i] = 0;
+            if (!keep_going)
+                continue;
+
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "Worker %d (pid %d) killed by signal %d\n", i, pid,
+                        WTERMSIG(status));
+            else
+                fprintf(stderr, "Worker %d (pid %d) exited with status %d\n", i, pid,
+                        WEXITSTATUS(status));
+
+            // One that can't even start would only fail again
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0 &&
+                now_ms() - started[i] < WORKER_STARTUP_MS) {
+                ret_val = 1;
+                break;
+            }
+
+            pids[i] = start_worker(config, i, &oldset);
+            started[i] = now_ms();
+            if (pids[i] == -1) {
+                pids[i] = 0;
+                ret_val = 1;
+                break;
+            }
         }
     }
 
-    if (connection_queue_free(&queue) == -1)
+    // Have the workers finish up, and wait for them
+    for (int i = 0; i < config->workers; i++) {
+        if (pids[i] > 0 && kill(pids[i], SIGINT) == -1)
+            perror("kill");
+    }
+    for (int i = 0; i < config->workers; i++) {
+        int status;
+        if (pids[i] > 0 && (waitpid(pids[i], &status, 0) == -1 ||
+                            !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            ret_val = 1;
+    }
+    printf("Drain: %lu requests dropped\n", stats_dropped());
+
+    if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1) {
+        perror("sigprocmask");
         ret_val = 1;
+    }
+
+    free(pids);
+    free(started);
+    return ret_val;
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [--mode=pool|epoll|uring] [--scheduler=queue|steal] [--min-threads=N]\n"
+           "       [--max-threads=N] [--backlog=N] [--mime-types=FILE] [--max-open-files=N]\n"
+           "       [--no-watch] [--workers=N] [--pin-cpus] [--drain-timeout=SEC]\n"
+           "       <directory> <port>\n", prog);
+}
+
+// Parses a positive integer option value
+// Returns the value or -1 if it isn't one
+int parse_count(const char *str) {
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno || end == str || *end != '\0' || value < 1 || value > INT_MAX)
+        return -1;
+    return value;
+}
+
+int main(int argc, char **argv) {
+    int result;
+
+    // Pool sizes and event loops default to one per CPU, shared between any
+    // workers; pools grow up to THREADS_PER_CPU_MAX workers per CPU under load
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1)
+        n_cpus = 1;
+
+    server_config_t config;
+    config.mode = MODE_POOL;
+    config.scheduler = SCHED_QUEUE;
+    config.min_threads = -1;
+    config.max_threads = -1;
+    config.backlog = SOMAXCONN;
+    config.workers = 0;
+    config.pin_cpus = 0;
+    config.max_open_files = FILE_CACHE_MAX_FDS;
+    config.watch_dir = 1;
+    config.drain_timeout = DRAIN_TIMEOUT_SEC;
+
+    // The system's MIME types are used if it has them
+    const char *mime_types_path = access(MIME_TYPES_FILE, R_OK) == 0 ? MIME_TYPES_FILE : NULL;
+
+    // Parse options
+    static const struct option options[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "scheduler", required_argument, NULL, 's' },
+        { "min-threads", required_argument, NULL, 'n' },
+        { "max-threads", required_argument, NULL, 'x' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "mime-types", required_argument, NULL, 't' },
+        { "max-open-files", required_argument, NULL, 'f' },
+        { "no-watch", no_argument, NULL, 'w' },
+        { "workers", required_argument, NULL, 'W' },
+        { "pin-cpus", no_argument, NULL, 'p' },
+        { "drain-timeout", required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        if (opt == 'm' && strcmp(optarg, "pool") == 0) {
+            config.mode = MODE_POOL;
+        } else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            config.mode = MODE_EPOLL;
+        } else if (opt == 'm' && strcmp(optarg, "uring") == 0) {
+            config.mode = MODE_URING;
+        } else if (opt == 's' && strcmp(optarg, "queue") == 0) {
+            config.scheduler = SCHED_QUEUE;
+        } else if (opt == 's' && strcmp(optarg, "steal") == 0) {
+            config.scheduler = SCHED_STEAL;
+        } else if (opt == 'n' && (config.min_threads = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'x' && (config.max_threads = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'b' && (config.backlog = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'f' && strcmp(optarg, "0") == 0) {
+            config.max_open_files = 0;  // Never keep files open
+        } else if (opt == 'f' && (config.max_open_files = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'w') {
+            config.watch_dir = 0;
+        } else if (opt == 'W' && (config.workers = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'd' && strcmp(optarg, "0") == 0) {
+            config.drain_timeout = 0;   // Drop whatever is under way
+        } else if (opt == 'd' && (config.drain_timeout = parse_count(optarg)) != -1) {
+            continue;
+        } else if (opt == 'p') {
+            config.pin_cpus = 1;
+        } else if (opt == 't') {
+            mime_types_path = optarg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    long process_cpus = config.workers > n_cpus ? 1 : config.workers > 0 ? n_cpus / config.workers
+                                                                          : n_cpus;
+    config.n_loops = process_cpus;
+    if (config.min_threads == -1)
+        config.min_threads = process_cpus;
+    if (config.max_threads == -1)
+        config.max_threads = config.min_threads > process_cpus * THREADS_PER_CPU_MAX
+                           ? config.min_threads : process_cpus * THREADS_PER_CPU_MAX;
+
+    // First command is directory to serve, second command is port
+    if (argc - optind != 2 || config.max_threads < config.min_threads) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Read arguments
+    config.serve_dir = argv[optind];
+    config.port = argv[optind + 1];
+
+    // Setup sigaction struct
+    struct sigaction sigact;
+    sigact.sa_handler = handle_sigint;
+    sigfillset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+
+    // Set action for signal
+    result = sigaction(SIGINT, &sigact, NULL);
+    if (result == -1) {
+        perror("sigaction");
+        return 1;
+    }
+
+    // Load MIME types before any thread looks one up; workers inherit them
+    if (mime_types_init(mime_types_path) == -1)
+        return 1;
+
+    // io_uring may be compiled out, too old or disabled; epoll is the closest
+    // alternative
+#ifdef HAVE_IO_URING
+    if (config.mode == MODE_URING && !uring_supported()) {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        config.mode = MODE_EPOLL;
+    }
+#else
+    if (config.mode == MODE_URING) {
+        fprintf(stderr, "Built without io_uring support, using epoll\n");
+        config.mode = MODE_EPOLL;
+    }
+#endif
 
+    int ret_val = config.workers > 0 ? run_workers(&config) : serve(&config);
+    mime_types_free();
     return ret_val;
 }
@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mime_types.h"
+
+// A registered extension; the table is a power of two in size and kept at
+// most half full, so an empty slot always ends a probe
+typedef struct {
+    const char *extension;
+    const char *type;
+} mime_entry_t;
+
+typedef struct {
+    mime_entry_t *slots;
+    size_t mask;        // Number of slots minus one
+    size_t count;
+    char *file_data;    // Contents of the mime.types file, which entries point into
+} mime_table_t;
+
+// Types that are known even without a mime.types file
+static const mime_entry_t builtin_types[] = {
+    { "txt", "text/plain" },
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "js", "text/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "png", "image/png" },
+    { "gif", "image/gif" },
+    { "svg", "image/svg+xml" },
+    { "ico", "image/vnd.microsoft.icon" },
+    { "pdf", "application/pdf" },
+    { "gz", "application/gzip" },
+    { "tar", "application/x-tar" },
+    { "zip", "application/zip" },
+};
+
+static mime_table_t registry;
+
+static char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a hash of an extension, which must already be lowercase
+static uint32_t hash_extension(const char *extension) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = extension; *c; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Finds the slot holding 'extension', or the empty slot it would go in
+static mime_entry_t *table_slot(const mime_table_t *table, const char *extension) {
+    size_t i = hash_extension(extension) & table->mask;
+    while (table->slots[i].extension != NULL && strcmp(table->slots[i].extension, extension) != 0)
+        i = (i + 1) & table->mask;
+    return &table->slots[i];
+}
+
+/*
+ * Register a lowercase extension, replacing any type it already had
+ * Returns 0 on success or -1 on error
+ */
+static int table_insert(mime_table_t *table, const char *extension, const char *type) {
+    // Double the table when it would become more than half full
+    if ((table->count + 1) * 2 > table->mask + 1) {
+        mime_table_t grown = *table;
+        grown.mask = table->mask * 2 + 1;
+        grown.slots = calloc(grown.mask + 1, sizeof(mime_entry_t));
+        if (grown.slots == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i <= table->mask; i++) {
+            if (table->slots[i].extension != NULL)
+                *table_slot(&grown, table->slots[i].extension) = table->slots[i];
+        }
+        free(table->slots);
+        *table = grown;
+    }
+
+    mime_entry_t *slot = table_slot(table, extension);
+    if (slot->extension == NULL)
+        table->count++;
+    slot->extension = extension;
+    slot->type = type;
+    return 0;
+}
+
+/*
+ * Read a whole file into a NUL-terminated buffer
+ * Returns the buffer or NULL on error
+ */
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat statbuf;
+    if (fstat(fileno(file), &statbuf) == -1) {
+        perror("fstat");
+        fclose(file);
+        return NULL;
+    }
+
+    char *data = malloc(statbuf.st_size + 1);
+    if (data == NULL) {
+        perror("malloc");
+        fclose(file);
+        return NULL;
+    }
+
+    size_t len = fread(data, 1, statbuf.st_size, file);
+    if (ferror(file)) {
+        perror("fread");
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    data[len] = '\0';
+    fclose(file);
+    return data;
+}
+
+/*
+ * Register every type in a mime.types file that has been read into memory,
+ * splitting and lowercasing it in place
+ * Returns 0 on success or -1 on error
+ */
+static int load_types(mime_table_t *table, char *data) {
+    char *line = data;
+    while (line != NULL) {
+        char *next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char *save;
+        const char *type = strtok_r(line, " \t\r", &save);
+        if (type != NULL && strchr(type, '/') != NULL) {
+            char *extension;
+            while ((extension = strtok_r(NULL, " \t\r", &save)) != NULL) {
+                if (strlen(extension) > MIME_EXTENSION_MAX)
+                    continue;
+                for (char *c = extension; *c; c++)
+                    *c = ascii_lower(*c);
+                if (table_insert(table, extension, type) == -1)
+                    return -1;
+            }
+        }
+
+        line = next;
+    }
+    return 0;
+}
+
+int mime_types_init(const char *path) {
+    mime_table_t table;
+    table.mask = 63;
+    table.count = 0;
+    table.file_data = NULL;
+    table.slots = calloc(table.mask + 1, sizeof(mime_entry_t));
+    if (table.slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (table_insert(&table, builtin_types[i].extension, builtin_types[i].type) == -1) {
+            free(table.slots);
+            return -1;
+        }
+    }
+
+    // Types from the file override the built-in ones
+    if (path != NULL) {
+        table.file_data = read_file(path);
+        if (table.file_data == NULL || load_types(&table, table.file_data) == -1) {
+            free(table.file_data);
+            free(table.slots);
+            return -1;
+        }
+    }
+
+    mime_types_free();
+    registry = table;
+    return 0;
+}
+
+const char *mime_types_lookup(const char *extension) {
+    if (registry.slots == NULL)
+        return NULL;
+
+    // Lowercase into a bounded buffer; anything longer can't be registered
+    char key[MIME_EXTENSION_MAX + 1];
+    size_t len = 0;
+    for (; extension[len] != '\0'; len++) {
+        if (len == MIME_EXTENSION_MAX)
+            return NULL;
+        key[len] = ascii_lower(extension[len]);
+    }
+    key[len] = '\0';
+
+    return table_slot(&registry, key)->type;
+}
+
+void mime_types_free(void) {
+    free(registry.slots);
+    free(registry.file_data);
+    memset(&registry, 0, sizeof(registry));
+}
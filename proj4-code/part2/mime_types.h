@@ -0,0 +1,35 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#define MIME_TYPES_FILE "/etc/mime.types"   // Loaded by default if present
+#define MIME_TYPE_DEFAULT "application/octet-stream"
+#define MIME_EXTENSION_MAX 15               // Longer extensions are never registered
+
+// Process-wide registry mapping file extensions to MIME types
+// A few common types are built in; a mime.types file (lines of a type
+// followed by its extensions, '#' starting a comment) adds to or overrides
+// them. The registry is built into an open-addressing hash table keyed on the
+// lowercased extension, so lookups take constant time and allocate nothing.
+// It is read-only once built and may be used from any thread.
+
+/*
+ * Build the registry from the built-in types and, optionally, a mime.types
+ * file. Must be called before any thread looks a type up.
+ * path: mime.types file to load, or NULL for the built-in types only
+ * Returns 0 on success or -1 on error, leaving the registry unchanged
+ */
+int mime_types_init(const char *path);
+
+/*
+ * Look up the MIME type for a file extension, ignoring case
+ * extension: The extension, without the leading '.'
+ * Returns the MIME type, or NULL if the extension isn't registered
+ */
+const char *mime_types_lookup(const char *extension);
+
+/*
+ * Deallocates the registry, leaving it empty
+ */
+void mime_types_free(void);
+
+#endif // MIME_TYPES_H
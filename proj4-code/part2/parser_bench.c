@@ -0,0 +1,233 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "http_parser.h"
+#include "mime_types.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define PIPELINE_DEPTH 64
+
+/*
+ * Microbenchmark for the HTTP request parser
+ * Reports parsed requests per second for whole requests, for requests that
+ * arrive one byte at a time, and for pipelined requests read from a socket,
+ * and the cost of looking up a requested file's MIME type.
+ */
+
+static const char curl_request[] =
+    "GET /gatsby.txt HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-Modified-Since: Tue, 09 May 2023 00:00:00 GMT\r\n"
+    "\r\n";
+
+double elapsed_sec(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void report(const char *name, long n_requests, const struct timespec *start,
+            const struct timespec *end) {
+    double sec = elapsed_sec(start, end);
+    printf("%-28s %12.0f req/s %8.1f ns/req\n", name, n_requests / sec, sec * 1e9 / n_requests);
+}
+
+// Parses a complete request 'iterations' times
+// Returns 0 on success or -1 if the request didn't parse
+int bench_whole(const char *name, const char *req, long iterations) {
+    size_t len = strlen(req);
+    http_request_t request;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        size_t scanned = 0;
+        size_t req_len = http_find_request_end(req, len, &scanned);
+        if (req_len != len || http_parse_request(req, req_len, &request) == -1) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(name, iterations, &start, &end);
+    return 0;
+}
+
+// Feeds a request to the parser one more byte at a time, as if every byte
+// arrived in its own read
+// Returns 0 on success or -1 if the request didn't parse
+int bench_split(const char *name, const char *req, long iterations) {
+    size_t len = strlen(req);
+    http_request_t request;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        size_t scanned = 0;
+        size_t req_len = 0;
+        for (size_t avail = 1; avail <= len && req_len == 0; avail++)
+            req_len = http_find_request_end(req, avail, &scanned);
+        if (req_len != len || http_parse_request(req, req_len, &request) == -1) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(name, iterations, &start, &end);
+    return 0;
+}
+
+// Looks up the MIME types of a mix of requested paths with the system's
+// mime.types loaded
+// Returns 0 on success or -1 on error
+int bench_mime(const char *name, long iterations) {
+    static const char *const paths[] = {
+        "downloaded_files/gatsby.txt", "downloaded_files/index.html",
+        "downloaded_files/africa.jpg", "downloaded_files/hard_drive.png",
+        "downloaded_files/Lec01.pdf", "downloaded_files/style.CSS",
+        "downloaded_files/archive.tar.gz", "downloaded_files/README",
+    };
+    const int n_paths = sizeof(paths) / sizeof(paths[0]);
+
+    if (mime_types_init(access(MIME_TYPES_FILE, R_OK) == 0 ? MIME_TYPES_FILE : NULL) == -1)
+        return -1;
+
+    struct timespec start, end;
+    size_t total_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++)
+        total_len += strlen(get_mime_type(paths[i % n_paths]));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    mime_types_free();
+    if (total_len == 0)
+        return -1;
+    report(name, iterations, &start, &end);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    long n_requests;
+} writer_args_t;
+
+// Writes pipelined requests in batches of PIPELINE_DEPTH, then hangs up
+void *writer_func(void *arg) {
+    writer_args_t *args = (writer_args_t *) arg;
+    size_t len = strlen(curl_request);
+    char *batch = malloc(len * PIPELINE_DEPTH);
+    if (batch == NULL) {
+        perror("malloc");
+        close(args->fd);
+        return NULL;
+    }
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+        memcpy(batch + i * len, curl_request, len);
+
+    for (long sent = 0; sent < args->n_requests; sent += PIPELINE_DEPTH) {
+        if (write_all(args->fd, batch, len * PIPELINE_DEPTH) == -1) {
+            perror("write");
+            break;
+        }
+    }
+
+    free(batch);
+    close(args->fd);
+    return NULL;
+}
+
+// Reads pipelined requests through read_http_request() on a socket pair
+// Returns 0 on success or -1 on error
+int bench_pipelined(const char *name, long iterations) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    writer_args_t args = { fds[1], iterations };
+    pthread_t writer;
+    int result = pthread_create(&writer, NULL, writer_func, &args);
+    if (result) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    http_conn_t *conn = malloc(sizeof(http_conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close(fds[0]);
+        pthread_join(writer, NULL);
+        return -1;
+    }
+    http_conn_init(conn, fds[0]);
+
+    long n_parsed = 0;
+    http_request_t request;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (read_http_request(conn, &request) == 0)
+        n_parsed++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_join(writer, NULL);
+    close(fds[0]);
+    free(conn);
+
+    report(name, n_parsed, &start, &end);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long iterations = argc == 2 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) {
+        fprintf(stderr, "Invalid iteration count: %s\n", argv[1]);
+        return 1;
+    }
+
+    if (bench_whole("curl request", curl_request, iterations) == -1 ||
+        bench_whole("browser request", browser_request, iterations) == -1 ||
+        bench_split("curl request, 1 byte reads", curl_request, iterations / 10) == -1 ||
+        bench_split("browser request, 1 byte reads", browser_request, iterations / 10) == -1 ||
+        bench_pipelined("pipelined over socket", iterations) == -1 ||
+        bench_mime("MIME type lookup", iterations) == -1)
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "path_cache.h"
+#include "server_stats.h"
+
+// FNV-1a hash of a path
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Current monotonic time in seconds, read without a system call
+static long now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int sys_openat2(int dir_fd, const char *path, struct open_how *how) {
+    return syscall(SYS_openat2, dir_fd, path, how, sizeof(*how));
+}
+
+int path_error_not_found(int error) {
+    // EXDEV and ELOOP are how RESOLVE_BENEATH and RESOLVE_NO_MAGICLINKS refuse
+    // a path that leads out of the directory
+    return error == ENOENT || error == ENOTDIR || error == ENAMETOOLONG || error == EXDEV ||
+           error == ELOOP;
+}
+
+int path_cache_open(path_cache_t *cache, const char *path, int flags) {
+    if (!cache->beneath)
+        return openat(cache->dir_fd, path, flags | O_CLOEXEC);
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    return sys_openat2(cache->dir_fd, path, &how);
+}
+
+// Finds an entry in a shard, caller must hold the shard's lock
+static path_cache_entry_t *shard_find(path_cache_shard_t *shard, uint32_t hash,
+                                      const char *path) {
+    path_cache_entry_t *entry = shard->buckets[hash % PATH_CACHE_BUCKETS];
+    while (entry != NULL && strcmp(entry->path, path) != 0)
+        entry = entry->next;
+    return entry;
+}
+
+// Frees the first entry of the next non-empty bucket, going round the shard
+// Caller must hold the shard's write lock
+static void shard_evict(path_cache_shard_t *shard) {
+    while (shard->buckets[shard->evict_bucket] == NULL)
+        shard->evict_bucket = (shard->evict_bucket + 1) % PATH_CACHE_BUCKETS;
+
+    path_cache_entry_t *entry = shard->buckets[shard->evict_bucket];
+    shard->buckets[shard->evict_bucket] = entry->next;
+    shard->evict_bucket = (shard->evict_bucket + 1) % PATH_CACHE_BUCKETS;
+    shard->n_entries--;
+    free(entry->path);
+    free(entry);
+}
+
+int path_cache_init(path_cache_t *cache, const char *serve_dir) {
+    int result;
+
+    cache->dir_fd = open(serve_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cache->dir_fd == -1) {
+        perror(serve_dir);
+        return -1;
+    }
+
+    // openat2() arrived in Linux 5.6; without it, normalized paths still
+    // can't climb out with "..", but a symbolic link could lead elsewhere
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int fd = sys_openat2(cache->dir_fd, ".", &how);
+    cache->beneath = fd != -1 || errno != ENOSYS;
+    if (fd != -1)
+        close(fd);
+    if (!cache->beneath)
+        fprintf(stderr, "openat2 is not available, symbolic links are followed\n");
+
+    cache->watch = NULL;
+
+    for (int i = 0; i < PATH_CACHE_SHARDS; i++) {
+        path_cache_shard_t *shard = &cache->shards[i];
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->n_entries = 0;
+        shard->evict_bucket = 0;
+        atomic_init(&shard->generation, 0);
+
+        result = pthread_rwlock_init(&shard->lock, NULL);
+        if (result) {
+            fprintf(stderr, "pthread_rwlock_init: %s\n", strerror(result));
+            for (int j = 0; j < i; j++)
+                pthread_rwlock_destroy(&cache->shards[j].lock);
+            close(cache->dir_fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int path_cache_find(path_cache_t *cache, const char *path, path_info_t *info, int *error) {
+    int result;
+    uint32_t hash = hash_path(path);
+    path_cache_shard_t *shard = &cache->shards[hash % PATH_CACHE_SHARDS];
+
+    result = pthread_rwlock_rdlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_rdlock: %s\n", strerror(result));
+        return 0;
+    }
+
+    // Entries are copied out, so none has to outlive the lock
+    int found = 0;
+    path_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL && ((cache->watch != NULL && dir_watch_complete(cache->watch)) ||
+                          now_sec() - entry->resolved < PATH_CACHE_TTL_SEC)) {
+        *info = entry->info;
+        *error = entry->error;
+        found = 1;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found)
+        stats_count(path_cache_hits, 1);
+    else
+        stats_count(path_cache_misses, 1);
+    return found;
+}
+
+unsigned long path_cache_generation(path_cache_t *cache, const char *path) {
+    path_cache_shard_t *shard = &cache->shards[hash_path(path) % PATH_CACHE_SHARDS];
+    return atomic_load(&shard->generation);
+}
+
+void path_cache_record(path_cache_t *cache, const char *path, const path_info_t *info,
+                       int error, unsigned long generation) {
+    int result;
+    if (error != 0 && !path_error_not_found(error))
+        return;
+
+    uint32_t hash = hash_path(path);
+    path_cache_shard_t *shard = &cache->shards[hash % PATH_CACHE_SHARDS];
+
+    result = pthread_rwlock_wrlock(&shard->lock);
+    if (result) {
+        fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+        return;
+    }
+
+    // Invalidated while it was being resolved
+    if (atomic_load(&shard->generation) != generation) {
+        pthread_rwlock_unlock(&shard->lock);
+        return;
+    }
+
+    path_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry == NULL) {
+        // A failure to cache just means resolving the path again next time
+        entry = malloc(sizeof(path_cache_entry_t));
+        char *path_copy = entry != NULL ? strdup(path) : NULL;
+        if (path_copy == NULL) {
+            perror("malloc");
+            free(entry);
+            pthread_rwlock_unlock(&shard->lock);
+            return;
+        }
+
+        if (shard->n_entries >= PATH_CACHE_MAX_ENTRIES)
+            shard_evict(shard);
+        entry->path = path_copy;
+        entry->next = shard->buckets[hash % PATH_CACHE_BUCKETS];
+        shard->buckets[hash % PATH_CACHE_BUCKETS] = entry;
+        shard->n_entries++;
+    }
+
+    entry->error = error;
+    if (error == 0)
+        entry->info = *info;
+    entry->resolved = now_sec();
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+int path_cache_stat(path_cache_t *cache, const char *path, path_info_t *info) {
+    int error;
+    if (path_cache_find(cache, path, info, &error)) {
+        if (error != 0) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Open just the path, so the lookup gets the same protection as opening
+    // the file itself
+    unsigned long generation = path_cache_generation(cache, path);
+    struct stat statbuf;
+    int fd = path_cache_open(cache, path, O_PATH);
+    if (fd == -1 || fstat(fd, &statbuf) == -1) {
+        error = errno;
+        if (fd != -1)
+            close(fd);
+        path_cache_record(cache, path, NULL, error, generation);
+        errno = error;
+        return -1;
+    }
+    close(fd);
+
+    info->mode = statbuf.st_mode;
+    info->size = statbuf.st_size;
+    info->mtime = statbuf.st_mtim;
+    info->ino = statbuf.st_ino;
+    path_cache_record(cache, path, info, 0, generation);
+    return 0;
+}
+
+// Removes a path's entry, or every entry if 'path' is NULL, from a shard
+// Caller must hold the shard's write lock
+static void shard_drop(path_cache_shard_t *shard, uint32_t hash, const char *path) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        if (path != NULL && i != hash % PATH_CACHE_BUCKETS)
+            continue;
+        path_cache_entry_t **link = &shard->buckets[i];
+        while (*link != NULL) {
+            path_cache_entry_t *entry = *link;
+            if (path != NULL && strcmp(entry->path, path) != 0) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            shard->n_entries--;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    atomic_fetch_add(&shard->generation, 1);
+}
+
+void path_cache_invalidate(path_cache_t *cache, const char *path) {
+    int result;
+    uint32_t hash = path != NULL ? hash_path(path) : 0;
+
+    for (int i = 0; i < PATH_CACHE_SHARDS; i++) {
+        if (path != NULL && i != hash % PATH_CACHE_SHARDS)
+            continue;
+        path_cache_shard_t *shard = &cache->shards[i];
+        result = pthread_rwlock_wrlock(&shard->lock);
+        if (result) {
+            fprintf(stderr, "pthread_rwlock_wrlock: %s\n", strerror(result));
+            continue;
+        }
+        shard_drop(shard, hash, path);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+static void invalidate_listener(void *arg, const char *path) {
+    path_cache_invalidate(arg, path);
+}
+
+int path_cache_watch(path_cache_t *cache, dir_watch_t *watch) {
+    if (dir_watch_listen(watch, invalidate_listener, cache) == -1)
+        return -1;
+    cache->watch = watch;
+    return 0;
+}
+
+
+int path_cache_free(path_cache_t *cache) {
+    int ret_val = 0;
+    int result;
+
+    for (int i = 0; i < PATH_CACHE_SHARDS; i++) {
+        path_cache_shard_t *shard = &cache->shards[i];
+        for (int j = 0; j < PATH_CACHE_BUCKETS; j++) {
+            path_cache_entry_t *entry = shard->buckets[j];
+            while (entry != NULL) {
+                path_cache_entry_t *next = entry->next;
+                free(entry->path);
+                free(entry);
+                entry = next;
+            }
+        }
+
+        result = pthread_rwlock_destroy(&shard->lock);
+        if (result) {
+            fprintf(stderr, "pthread_rwlock_destroy: %s\n", strerror(result));
+            ret_val = -1;
+        }
+    }
+
+    if (close(cache->dir_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+    return ret_val;
+}
@@ -0,0 +1,133 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dir_watch.h"
+
+#define PATH_CACHE_SHARDS 16
+#define PATH_CACHE_BUCKETS 256          // Hash buckets per shard
+#define PATH_CACHE_MAX_ENTRIES 4096     // Per shard
+#define PATH_CACHE_TTL_SEC 1            // How long a resolution is trusted
+
+// What a path resolved to
+typedef struct {
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+    ino_t ino;
+} path_info_t;
+
+// A cached resolution: the file's metadata, or the error resolving it gave
+typedef struct path_cache_entry {
+    char *path;
+    int error;          // 0, or the errno of a path that doesn't resolve
+    path_info_t info;
+    long resolved;      // Monotonic second the path was resolved
+    struct path_cache_entry *next;
+} path_cache_entry_t;
+
+// One independently locked slice of the cache
+typedef struct {
+    pthread_rwlock_t lock;
+    path_cache_entry_t *buckets[PATH_CACHE_BUCKETS];
+    int n_entries;
+    int evict_bucket;   // Where the search for an entry to evict resumes
+    atomic_ulong generation;    // Bumped whenever a path in the shard is invalidated
+} path_cache_shard_t;
+
+// Resolves request paths within the served directory, which is opened once
+// Files are only ever opened relative to the directory with openat2(2) and
+// RESOLVE_BENEATH, so neither ".." nor a symbolic link can reach anything
+// outside it. Resolutions, including those of paths that don't exist, are
+// cached for PATH_CACHE_TTL_SEC seconds so repeated requests don't walk the
+// path again, or while a complete directory watch says nothing changed.
+// Thread-safe.
+typedef struct {
+    int dir_fd;
+    int beneath;    // Whether openat2() is available; openat() is used if not
+    dir_watch_t *watch;     // Invalidates changed paths, or NULL
+    path_cache_shard_t shards[PATH_CACHE_SHARDS];
+} path_cache_t;
+
+/*
+ * Initialize an empty path cache for a directory
+ * cache: Pointer to the path_cache_t to be initialized
+ * serve_dir: Directory requested paths are resolved in
+ * Returns 0 on success or -1 on error
+ */
+int path_cache_init(path_cache_t *cache, const char *serve_dir);
+
+/*
+ * Check whether an error resolving a path means that there is nothing there
+ * to serve (it doesn't exist, or would leave the served directory), as
+ * opposed to a failure such as running out of file descriptors
+ * Returns 1 if it does, 0 if not
+ */
+int path_error_not_found(int error);
+
+/*
+ * Look a path up in the cache only, without touching the file system
+ * path: Path relative to the served directory, as normalized by
+ * http_normalize_path()
+ * info: Set to the file's metadata if the path is cached as resolving
+ * error: Set to 0 if it is, or the errno it failed with if not
+ * Returns 1 if the path is cached, 0 if not
+ */
+int path_cache_find(path_cache_t *cache, const char *path, path_info_t *info, int *error);
+
+/*
+ * Get a path's metadata, from the cache or else by resolving it (beneath the
+ * served directory) and caching the result
+ * Returns 0 on success or -1 with errno set on error
+ */
+int path_cache_stat(path_cache_t *cache, const char *path, path_info_t *info);
+
+/*
+ * Get the generation a path's resolution must be started in to be recorded
+ */
+unsigned long path_cache_generation(path_cache_t *cache, const char *path);
+
+/*
+ * Cache the result of resolving a path some other way, e.g. asynchronously
+ * info: The file's metadata if 'error' is 0
+ * error: 0, or the errno resolving the path failed with; only errors for
+ * which path_error_not_found() holds are cached
+ * generation: path_cache_generation() from before the path was resolved; if
+ * the path has been invalidated since, the result may be stale and isn't
+ * cached
+ */
+void path_cache_record(path_cache_t *cache, const char *path, const path_info_t *info,
+                       int error, unsigned long generation);
+
+/*
+ * Drop a path's cached resolution
+ * path: The path that changed, or NULL to drop every resolution
+ */
+void path_cache_invalidate(path_cache_t *cache, const char *path);
+
+/*
+ * Have a directory watch invalidate the cache, which then trusts resolutions
+ * for as long as the watch is complete. Must be called before the watch is
+ * started.
+ * Returns 0 on success or -1 on error
+ */
+int path_cache_watch(path_cache_t *cache, dir_watch_t *watch);
+
+/*
+ * Open a path beneath the served directory. Not cached.
+ * flags: Flags for open(2); O_CLOEXEC is always added
+ * Returns the file descriptor, or -1 with errno set on error
+ */
+int path_cache_open(path_cache_t *cache, const char *path, int flags);
+
+/*
+ * Deallocates all cached resolutions and closes the directory
+ * Returns 0 on success or -1 on error
+ */
+int path_cache_free(path_cache_t *cache);
+
+#endif // PATH_CACHE_H
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "connection_queue.h"
+
+#define DEFAULT_ITEMS 1000000
+#define QUEUE_CAPACITY 64
+#define MAX_THREADS 64
+
+/*
+ * Contention benchmark for connection_queue_t
+ * Built once per implementation; runs N producers against N consumers for
+ * N = 1, 2, 4, ..., 64 and reports queue operations per second.
+ */
+
+typedef struct {
+    connection_queue_t *queue;
+    long n_items;           // Items each producer enqueues
+    long total;             // Items all producers enqueue together
+    atomic_long *consumed;
+} bench_args_t;
+
+void *producer_func(void *arg) {
+    bench_args_t *args = (bench_args_t *) arg;
+    for (long i = 0; i < args->n_items; i++) {
+        if (connection_enqueue(args->queue, i & 0xffff) == -1)
+            break;
+    }
+    return NULL;
+}
+
+void *consumer_func(void *arg) {
+    bench_args_t *args = (bench_args_t *) arg;
+    while (connection_dequeue(args->queue) != -1) {
+        // Whoever takes the last item releases the other consumers
+        if (atomic_fetch_add(args->consumed, 1) + 1 == args->total)
+            connection_queue_shutdown(args->queue);
+    }
+    return NULL;
+}
+
+double elapsed_sec(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Runs one configuration, returns enqueue+dequeue pairs per second or -1
+double bench(int n_threads, long n_items) {
+    connection_queue_t queue;
+    if (connection_queue_init(&queue, QUEUE_CAPACITY) == -1)
+        return -1;
+
+    atomic_long consumed;
+    atomic_init(&consumed, 0);
+    bench_args_t args = { &queue, n_items / n_threads, n_items / n_threads * n_threads, &consumed };
+
+    pthread_t producers[MAX_THREADS];
+    pthread_t consumers[MAX_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < n_threads; i++) {
+        int result = pthread_create(&consumers[i], NULL, consumer_func, &args);
+        if (result == 0)
+            result = pthread_create(&producers[i], NULL, producer_func, &args);
+        if (result) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    connection_queue_free(&queue);
+    return args.total / elapsed_sec(&start, &end);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        printf("Usage: %s [items]\n", argv[0]);
+        return 1;
+    }
+
+    long n_items = argc == 2 ? atol(argv[1]) : DEFAULT_ITEMS;
+    if (n_items < MAX_THREADS) {
+        fprintf(stderr, "Invalid item count: %s\n", argv[1]);
+        return 1;
+    }
+
+#ifdef CONNECTION_QUEUE_LOCKFREE
+    printf("lock-free ring, capacity %d\n", QUEUE_CAPACITY);
+#else
+    printf("mutex/condvar queue, capacity %d\n", QUEUE_CAPACITY);
+#endif
+    printf("%10s %16s\n", "threads", "ops/s");
+
+    for (int n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+        double rate = bench(n_threads, n_items);
+        if (rate < 0)
+            return 1;
+        printf("%4d + %-3d %16.0f\n", n_threads, n_threads, rate);
+    }
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "server_stats.h"
+
+_Thread_local server_stats_t *stats_local;
+
+// Blocks shared with forked processes, mapped at the same address in each
+typedef struct {
+    _Atomic(server_stats_t *) head;     // Shared blocks handed out, newest first
+    atomic_int n_used;
+    int n_blocks;
+    server_stats_t blocks[];
+} stats_arena_t;
+
+// Every block this process has made privately, newest first
+static _Atomic(server_stats_t *) stats_head;
+
+// Set by stats_share(), or NULL
+static stats_arena_t *stats_arena;
+
+// Hands a thread's block back when the thread exits
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static const char *timer_names[STATS_N_TIMERS] = {
+    [STATS_PARSE] = "parse_ns",
+    [STATS_OPEN] = "open_ns",
+    [STATS_SEND] = "send_ns",
+    [STATS_QUEUE_WAIT] = "queue_wait_ns",
+};
+
+static void stats_detach(void *arg) {
+    server_stats_t *stats = (server_stats_t *) arg;
+    atomic_store(&stats->in_use, 0);
+}
+
+// The shared blocks, or NULL, and then the private ones
+static server_stats_t *list_head(int shared) {
+    if (shared)
+        return stats_arena != NULL ? atomic_load(&stats_arena->head) : NULL;
+    return atomic_load(&stats_head);
+}
+
+// Takes over a free block, or one left by a process that has died
+// Returns 1 if it did, 0 if the block is in use
+static int stats_claim(server_stats_t *stats, pid_t pid) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&stats->in_use, &expected, 1)) {
+        atomic_store(&stats->owner, pid);
+        return 1;
+    }
+
+    int owner = atomic_load(&stats->owner);
+    return stats_arena != NULL && owner != pid && kill(owner, 0) == -1 && errno == ESRCH &&
+           atomic_compare_exchange_strong(&stats->owner, &owner, pid);
+}
+
+// Sets up a new block, held by the calling thread
+static void stats_init(server_stats_t *stats, pid_t pid) {
+    atomic_init(&stats->requests, 0);
+    atomic_init(&stats->not_found, 0);
+    atomic_init(&stats->errors, 0);
+    atomic_init(&stats->dropped, 0);
+    atomic_init(&stats->bytes_sent, 0);
+    for (int i = 0; i < STATS_N_TIMERS; i++)
+        histogram_init(&stats->timers[i]);
+    atomic_init(&stats->in_use, 1);
+    atomic_init(&stats->owner, pid);
+}
+
+// Blocks are only ever added, so a plain compare-and-swap push is safe
+static void stats_push(_Atomic(server_stats_t *) *head, server_stats_t *stats) {
+    stats->next = atomic_load(head);
+    while (!atomic_compare_exchange_weak(head, &stats->next, stats))
+        ;
+}
+
+int stats_share(int n_blocks) {
+    size_t size = sizeof(stats_arena_t) + n_blocks * sizeof(server_stats_t);
+    stats_arena_t *arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                -1, 0);
+    if (arena == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    atomic_init(&arena->head, NULL);
+    atomic_init(&arena->n_used, 0);
+    arena->n_blocks = n_blocks;
+    stats_arena = arena;
+    return 0;
+}
+
+static void make_key(void) {
+    int result = pthread_key_create(&stats_key, stats_detach);
+    if (result)
+        fprintf(stderr, "pthread_key_create: %s\n", strerror(result));
+}
+
+server_stats_t *stats_attach(void) {
+    pthread_once(&stats_key_once, make_key);
+
+    // Take over the block of a thread or process that has exited, if any
+    pid_t pid = getpid();
+    server_stats_t *stats = NULL;
+    for (int shared = 1; shared >= 0 && stats == NULL; shared--) {
+        for (stats = list_head(shared); stats != NULL; stats = stats->next) {
+            if (stats_claim(stats, pid))
+                break;
+        }
+    }
+
+    // Otherwise make one, shared if there is room
+    if (stats == NULL && stats_arena != NULL) {
+        int slot = atomic_fetch_add(&stats_arena->n_used, 1);
+        if (slot < stats_arena->n_blocks) {
+            stats = &stats_arena->blocks[slot];
+            stats_init(stats, pid);
+            stats_push(&stats_arena->head, stats);
+        }
+    }
+    if (stats == NULL) {
+        stats = aligned_alloc(_Alignof(server_stats_t), sizeof(server_stats_t));
+        if (stats == NULL) {
+            perror("aligned_alloc");
+            return NULL;
+        }
+        stats_init(stats, pid);
+        stats_push(&stats_head, stats);
+    }
+
+    pthread_setspecific(stats_key, stats);
+    stats_local = stats;
+    return stats;
+}
+
+// Appends formatted text to a buffer, tracking the length written
+// Returns 0 on success or -1 if the buffer is full
+static int append(char *buf, size_t bufsize, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, bufsize - *len, format, args);
+    va_end(args);
+
+    if (n < 0 || n >= bufsize - *len)
+        return -1;
+    *len += n;
+    return 0;
+}
+
+int stats_render(char *buf, size_t bufsize, int json) {
+    // Sum every thread's block, including those of threads that have exited
+    // and, once shared, those of other processes
+    unsigned long requests = 0, not_found = 0, errors = 0, dropped = 0, bytes_sent = 0;
+    unsigned long file_hits = 0, file_misses = 0, path_hits = 0, path_misses = 0;
+    unsigned long watch_events = 0;
+    histogram_t timers[STATS_N_TIMERS];
+    for (int i = 0; i < STATS_N_TIMERS; i++)
+        histogram_init(&timers[i]);
+
+    for (int shared = 1; shared >= 0; shared--) {
+        for (server_stats_t *stats = list_head(shared); stats != NULL; stats = stats->next) {
+            requests += atomic_load_explicit(&stats->requests, memory_order_relaxed);
+            not_found += atomic_load_explicit(&stats->not_found, memory_order_relaxed);
+            errors += atomic_load_explicit(&stats->errors, memory_order_relaxed);
+            dropped += atomic_load_explicit(&stats->dropped, memory_order_relaxed);
+            bytes_sent += atomic_load_explicit(&stats->bytes_sent, memory_order_relaxed);
+            file_hits += atomic_load_explicit(&stats->file_cache_hits, memory_order_relaxed);
+            file_misses += atomic_load_explicit(&stats->file_cache_misses, memory_order_relaxed);
+            path_hits += atomic_load_explicit(&stats->path_cache_hits, memory_order_relaxed);
+            path_misses += atomic_load_explicit(&stats->path_cache_misses, memory_order_relaxed);
+            watch_events += atomic_load_explicit(&stats->watch_events, memory_order_relaxed);
+            for (int i = 0; i < STATS_N_TIMERS; i++)
+                histogram_merge(&timers[i], &stats->timers[i]);
+        }
+    }
+
+    size_t len = 0;
+    int result = 0;
+    if (json) {
+        result |= append(buf, bufsize, &len, "{\"requests\":%lu,\"not_found\":%lu,"
+                         "\"errors\":%lu,\"dropped\":%lu,\"bytes_sent\":%lu,"
+                         "\"file_cache_hits\":%lu,\"file_cache_misses\":%lu,"
+                         "\"path_cache_hits\":%lu,\"path_cache_misses\":%lu,"
+                         "\"watch_events\":%lu", requests, not_found, errors, dropped,
+                         bytes_sent, file_hits, file_misses, path_hits, path_misses,
+                         watch_events);
+    } else {
+        result |= append(buf, bufsize, &len, "requests %lu\nnot_found %lu\nerrors %lu\n"
+                         "dropped %lu\nbytes_sent %lu\nfile_cache_hits %lu\n"
+                         "file_cache_misses %lu\npath_cache_hits %lu\npath_cache_misses %lu\n"
+                         "watch_events %lu\n", requests, not_found, errors, dropped, bytes_sent,
+                         file_hits, file_misses, path_hits, path_misses, watch_events);
+    }
+
+    for (int i = 0; i < STATS_N_TIMERS; i++) {
+        histogram_t *hist = &timers[i];
+        const char *format = json
+            ? ",\"%s\":{\"count\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+              "\"p99.9\":%lu,\"max\":%lu}"
+            : "%s count %lu p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n";
+        result |= append(buf, bufsize, &len, format, timer_names[i],
+                         atomic_load(&hist->total),
+                         (unsigned long) histogram_quantile(hist, 0.5),
+                         (unsigned long) histogram_quantile(hist, 0.9),
+                         (unsigned long) histogram_quantile(hist, 0.99),
+                         (unsigned long) histogram_quantile(hist, 0.999),
+                         atomic_load(&hist->max));
+    }
+
+    if (json)
+        result |= append(buf, bufsize, &len, "}\n");
+
+    return result ? -1 : len;
+}
+
+unsigned long stats_dropped(void) {
+    unsigned long dropped = 0;
+    for (int shared = 1; shared >= 0; shared--) {
+        for (server_stats_t *stats = list_head(shared); stats != NULL; stats = stats->next)
+            dropped += atomic_load_explicit(&stats->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
@@ -0,0 +1,111 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+#define STATS_PATH "/__stats"   // Reserved path the statistics are served from
+
+// Durations recorded for every request, in nanoseconds
+typedef enum {
+    STATS_PARSE,        // Finding and parsing a received request; a pool connection's
+                        // first request is timed from the end of its queue wait
+    STATS_OPEN,         // Cache lookup, stat() and open() of the resource
+    STATS_SEND,         // From the response being ready to it being written
+    STATS_QUEUE_WAIT,   // From accept() to a pool worker taking the connection
+    STATS_N_TIMERS,
+} stats_timer_t;
+
+// Counters and histograms owned by one thread
+// Only the owning thread writes, so updates are plain relaxed loads and
+// stores with no locked instructions; readers sum every thread's block
+typedef struct server_stats {
+    _Alignas(64) atomic_ulong requests;
+    atomic_ulong not_found;
+    atomic_ulong errors;
+    atomic_ulong dropped;   // Requests abandoned when shutdown ran out of time
+    atomic_ulong bytes_sent;
+    atomic_ulong file_cache_hits;
+    atomic_ulong file_cache_misses;
+    atomic_ulong path_cache_hits;
+    atomic_ulong path_cache_misses;
+    atomic_ulong watch_events;     // inotify events handled by the directory watch
+    histogram_t timers[STATS_N_TIMERS];
+
+    atomic_int in_use;              // Owned by a live thread
+    atomic_int owner;               // Process of the thread that last took it
+    struct server_stats *next;      // Every block ever made, never freed
+} server_stats_t;
+
+// The calling thread's block, or NULL until its first use
+extern _Thread_local server_stats_t *stats_local;
+
+/*
+ * Give the calling thread a statistics block, reusing one left by a thread
+ * that has exited so totals carry over
+ * Returns the block, or NULL if one couldn't be allocated
+ */
+server_stats_t *stats_attach(void);
+
+/*
+ * Hand out blocks from here on from a mapping shared with processes forked
+ * afterwards, so that every process's totals include all of theirs. Blocks
+ * held by a process that has died are taken over like those of exited
+ * threads. Once all 'n_blocks' are in use, further blocks are private.
+ * Call before forking, from a process that has no other threads yet.
+ * Returns 0 on success or -1 on error
+ */
+int stats_share(int n_blocks);
+
+static inline server_stats_t *stats_thread(void) {
+    return stats_local != NULL ? stats_local : stats_attach();
+}
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds to one of the calling thread's counters, given as a field name
+#define stats_count(field, n) do { \
+        server_stats_t *stats_ = stats_thread(); \
+        if (stats_ != NULL) \
+            atomic_store_explicit(&stats_->field, \
+                atomic_load_explicit(&stats_->field, memory_order_relaxed) + (n), \
+                memory_order_relaxed); \
+    } while (0)
+
+/*
+ * Record the time since 'start_ns' in one of the calling thread's timers
+ * Returns the current time, so consecutive intervals can share a clock read
+ */
+static inline uint64_t stats_time(stats_timer_t timer, uint64_t start_ns) {
+    uint64_t now = stats_now();
+    server_stats_t *stats = stats_thread();
+    if (stats != NULL)
+        histogram_record(&stats->timers[timer], now - start_ns);
+    return now;
+}
+
+/*
+ * Add up every thread's statistics, across processes once stats_share() has
+ * been called, and format them as plain text or JSON
+ * buf: Buffer to write into
+ * bufsize: Size of 'buf'
+ * json: Nonzero for JSON, zero for plain text
+ * Returns the length written on success or -1 if 'buf' is too small
+ */
+int stats_render(char *buf, size_t bufsize, int json);
+
+/*
+ * Add up every thread's count of dropped requests, across processes once
+ * stats_share() has been called
+ */
+unsigned long stats_dropped(void);
+
+#endif // SERVER_STATS_H
@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server_stats.h"
+
+#define DEFAULT_ITERATIONS 10000000
+#define MAX_THREADS 8
+
+/*
+ * Cost of the per-request instrumentation in server_stats.h
+ * Times each building block on its own, then the full set of calls made for
+ * one request, on 1 to MAX_THREADS threads at once to show that threads
+ * recording into their own blocks don't slow each other down.
+ */
+
+static long n_iterations = DEFAULT_ITERATIONS;
+
+// Keeps the compiler from optimizing the measured calls away
+static volatile uint64_t sink;
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void run_clock(void) {
+    uint64_t sum = 0;
+    for (long i = 0; i < n_iterations; i++)
+        sum += stats_now();
+    sink = sum;
+}
+
+static void run_counter(void) {
+    for (long i = 0; i < n_iterations; i++)
+        stats_count(bytes_sent, i);
+}
+
+static void run_histogram(void) {
+    server_stats_t *stats = stats_thread();
+    for (long i = 0; i < n_iterations; i++)
+        histogram_record(&stats->timers[STATS_SEND], i & 0xfffff);
+}
+
+// The calls one request through the thread pool makes: two counters, four
+// timers and the five clock reads they need
+static void run_request(void) {
+    for (long i = 0; i < n_iterations; i++) {
+        uint64_t queued = stats_now();
+        uint64_t taken = stats_time(STATS_QUEUE_WAIT, queued);
+        uint64_t parsed = stats_time(STATS_PARSE, taken);
+        stats_count(requests, 1);
+        uint64_t ready = stats_time(STATS_OPEN, parsed);
+        stats_count(bytes_sent, 1000);
+        stats_time(STATS_SEND, ready);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} cases[] = {
+    { "clock read", run_clock },
+    { "counter", run_counter },
+    { "histogram", run_histogram },
+    { "full request", run_request },
+};
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+static void *thread_func(void *arg) {
+    void (*func)(void) = arg;
+    func();
+    return NULL;
+}
+
+// Runs a case on 'n_threads' threads, returns nanoseconds per iteration or -1
+static double bench(void (*func)(void), int n_threads) {
+    pthread_t threads[MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func, func) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            for (int j = 0; j < i; j++)
+                pthread_join(threads[j], NULL);
+            return -1;
+        }
+    }
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Every thread does the full count, so with enough cores the time per
+    // iteration stays flat as threads are added
+    return elapsed_ns(&start, &end) / n_iterations;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        n_iterations = atol(argv[1]);
+    if (n_iterations < 1) {
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Instrumentation cost, ns per iteration (%ld CPUs)\n", n_cpus);
+    printf("%-14s", "threads");
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+        printf("%10d", n);
+    printf("\n");
+
+    for (int i = 0; i < N_CASES; i++) {
+        printf("%-14s", cases[i].name);
+        for (int n = 1; n <= MAX_THREADS; n *= 2)
+            printf("%10.1f", bench(cases[i].func, n));
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server_stats.h"
+#include "thread_pool.h"
+
+// Value pushed in place of a connection to make the worker that takes it exit
+#define RETIRE_TOKEN -2
+// Held in a worker's 'client_fd' while shutdown shuts its connection down
+#define CLIENT_FD_CLAIMED -2
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int sched_init(thread_pool_t *pool) {
+    if (pool->scheduler == SCHED_STEAL)
+        return steal_sched_init(&pool->steal, pool->max_threads, THREAD_POOL_QUEUE_LEN);
+    return connection_queue_init(&pool->queue, THREAD_POOL_QUEUE_LEN);
+}
+
+static int sched_push(thread_pool_t *pool, int client_fd) {
+    if (pool->scheduler == SCHED_STEAL)
+        return steal_sched_push(&pool->steal, client_fd);
+    return connection_enqueue(&pool->queue, client_fd);
+}
+
+static int sched_pop(thread_pool_t *pool, int worker) {
+    if (pool->scheduler == SCHED_STEAL)
+        return steal_sched_pop(&pool->steal, worker);
+    return connection_dequeue(&pool->queue);
+}
+
+static int sched_is_shutdown(thread_pool_t *pool) {
+    if (pool->scheduler == SCHED_STEAL)
+        return pool->steal.shutdown;
+    return pool->queue.shutdown;
+}
+
+static int sched_shutdown(thread_pool_t *pool) {
+    if (pool->scheduler == SCHED_STEAL)
+        return steal_sched_shutdown(&pool->steal);
+    return connection_queue_shutdown(&pool->queue);
+}
+
+static int sched_free(thread_pool_t *pool) {
+    if (pool->scheduler == SCHED_STEAL)
+        return steal_sched_free(&pool->steal);
+    return connection_queue_free(&pool->queue);
+}
+
+// Marks a worker's slot as done; the manager joins the thread later
+static void worker_retire(pool_worker_t *worker) {
+    thread_pool_t *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->scheduler == SCHED_STEAL)
+        steal_sched_set_active(&pool->steal, worker->id, 0);
+    worker->state = WORKER_EXITED;
+    atomic_fetch_sub(&pool->n_threads, 1);
+    atomic_fetch_sub(&pool->retiring, 1);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Clears the worker's published connection before it is closed, first
+// waiting out a shutdown that has claimed it, so the fd shutdown touches is
+// never one already reused
+// Returns 1 if the connection was released here, or 0 if shutdown took it
+static int worker_release(pool_worker_t *worker, int client_fd) {
+    int expected = client_fd;
+    if (atomic_compare_exchange_strong(&worker->client_fd, &expected, -1))
+        return 1;
+    while (atomic_load(&worker->client_fd) == CLIENT_FD_CLAIMED)
+        sched_yield();
+    atomic_store(&worker->client_fd, -1);
+    return 0;
+}
+
+static void *worker_func(void *arg) {
+    pool_worker_t *worker = (pool_worker_t*) arg;
+    thread_pool_t *pool = worker->pool;
+
+    while (1) {
+        int client_fd = sched_pop(pool, worker->id);
+        if (client_fd == RETIRE_TOKEN) {
+            worker_retire(worker);
+            return NULL;
+        }
+        if (client_fd == -1) {
+            if (sched_is_shutdown(pool))
+                return NULL;
+            continue;
+        }
+
+        atomic_fetch_sub(&pool->queued, 1);
+        atomic_fetch_add(&pool->busy, 1);
+        uint64_t taken_ns = 0;
+        if (client_fd < pool->max_fds)
+            taken_ns = stats_time(STATS_QUEUE_WAIT, pool->submitted_ns[client_fd]);
+
+        // Published before checking 'abandon', so that shutdown either sees
+        // the connection or this sees that time ran out; whichever of the two
+        // releases it counts it as dropped
+        atomic_store(&worker->client_fd, client_fd);
+        if (atomic_load(&pool->abandon)) {
+            if (worker_release(worker, client_fd))
+                stats_count(dropped, 1);
+        } else {
+            pool->handler(client_fd, taken_ns);
+            worker_release(worker, client_fd);
+        }
+
+        // Clean up
+        if (close(client_fd) == -1)
+            perror("close");
+
+        atomic_fetch_sub(&pool->busy, 1);
+    }
+
+    return NULL;
+}
+
+// Creates a thread with every signal blocked, so signals stay with the caller
+static int create_blocked_thread(pthread_t *thread, void *(*func)(void*), void *arg) {
+    sigset_t newset;
+    sigset_t oldset;
+    sigfillset(&newset);
+    pthread_sigmask(SIG_SETMASK, &newset, &oldset);
+
+    int result = pthread_create(thread, NULL, func, arg);
+    if (result)
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return result ? -1 : 0;
+}
+
+// Joins workers that have retired, freeing their slots
+// Must be called with the pool's lock held
+static void reap_workers(thread_pool_t *pool) {
+    for (int i = 0; i < pool->max_threads; i++) {
+        pool_worker_t *worker = &pool->workers[i];
+        if (worker->state != WORKER_EXITED)
+            continue;
+
+        int result = pthread_join(worker->thread, NULL);
+        if (result)
+            fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        worker->state = WORKER_FREE;
+    }
+}
+
+// Starts one more worker if the pool is below its maximum
+// Must be called with the pool's lock held
+// Returns 0 on success or -1 on error or if the pool is full
+static int spawn_worker(thread_pool_t *pool) {
+    if (atomic_load(&pool->n_threads) >= pool->max_threads)
+        return -1;
+
+    reap_workers(pool);
+
+    pool_worker_t *worker = NULL;
+    for (int i = 0; worker == NULL && i < pool->max_threads; i++) {
+        if (pool->workers[i].state == WORKER_FREE)
+            worker = &pool->workers[i];
+    }
+    if (worker == NULL)
+        return -1;
+
+    if (create_blocked_thread(&worker->thread, worker_func, worker) == -1)
+        return -1;
+
+    worker->state = WORKER_RUNNING;
+    atomic_fetch_add(&pool->n_threads, 1);
+    if (pool->scheduler == SCHED_STEAL)
+        steal_sched_set_active(&pool->steal, worker->id, 1);
+    return 0;
+}
+
+static void *manager_func(void *arg) {
+    thread_pool_t *pool = (thread_pool_t*) arg;
+
+    // When connections started waiting with no free worker, and when some
+    // workers started having nothing to do, or 0 if they aren't
+    long waiting_since = 0;
+    long idle_since = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += THREAD_POOL_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int result = pthread_cond_timedwait(&pool->stop_cond, &pool->lock, &deadline);
+        if (result && result != ETIMEDOUT)
+            fprintf(stderr, "pthread_cond_timedwait: %s\n", strerror(result));
+        if (pool->stopping)
+            break;
+
+        reap_workers(pool);
+
+        long now = now_ms();
+        int n_threads = atomic_load(&pool->n_threads) - atomic_load(&pool->retiring);
+        int busy = atomic_load(&pool->busy);
+        int queued = atomic_load(&pool->queued);
+
+        // Connections waiting too long for a worker
+        if (queued > 0 && busy >= n_threads) {
+            if (waiting_since == 0) {
+                waiting_since = now;
+            } else if (now - waiting_since >= THREAD_POOL_GROW_WAIT_MS) {
+                spawn_worker(pool);
+                waiting_since = 0;
+            }
+        } else {
+            waiting_since = 0;
+        }
+
+        // Workers idle for long enough, retire the surplus
+        int surplus = n_threads - busy;
+        if (n_threads - pool->min_threads < surplus)
+            surplus = n_threads - pool->min_threads;
+        if (queued == 0 && surplus > 0) {
+            if (idle_since == 0) {
+                idle_since = now;
+            } else if (now - idle_since >= THREAD_POOL_IDLE_MS) {
+                atomic_fetch_add(&pool->retiring, surplus);
+                pthread_mutex_unlock(&pool->lock);
+                for (int i = 0; i < surplus; i++)
+                    sched_push(pool, RETIRE_TOKEN);
+                pthread_mutex_lock(&pool->lock);
+                idle_since = 0;
+            }
+        } else {
+            idle_since = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Joins every worker, which must have been told to exit
+// Returns 0 on success or -1 on error
+static int join_workers(thread_pool_t *pool) {
+    int ret_val = 0;
+
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].state == WORKER_FREE)
+            continue;
+
+        int result = pthread_join(pool->workers[i].thread, NULL);
+        if (result) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(result));
+            ret_val = -1;
+        }
+        pool->workers[i].state = WORKER_FREE;
+    }
+
+    return ret_val;
+}
+
+// Releases everything thread_pool_init() allocated
+static int destroy_pool(thread_pool_t *pool) {
+    int ret_val = 0;
+
+    if (sched_free(pool) == -1)
+        ret_val = -1;
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->stop_cond);
+    free(pool->workers);
+    free(pool->submitted_ns);
+    return ret_val;
+}
+
+int thread_pool_init(thread_pool_t *pool, scheduler_t scheduler, int min_threads,
+                     int max_threads, thread_pool_handler_t handler) {
+    pool->scheduler = scheduler;
+    pool->handler = handler;
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->stopping = 0;
+    atomic_init(&pool->n_threads, 0);
+    atomic_init(&pool->busy, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->retiring, 0);
+    atomic_init(&pool->abandon, 0);
+
+    // Size the submit times for every descriptor the process may open, up to
+    // a cap: containers often allow a billion or so, and a table that size
+    // would be gigabytes
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return -1;
+    }
+    pool->max_fds = limit.rlim_cur < THREAD_POOL_TIMED_FDS ? limit.rlim_cur
+                                                            : THREAD_POOL_TIMED_FDS;
+
+    pool->submitted_ns = calloc(pool->max_fds, sizeof(uint64_t));
+    pool->workers = malloc(max_threads * sizeof(pool_worker_t));
+    if (pool->submitted_ns == NULL || pool->workers == NULL) {
+        perror("malloc");
+        free(pool->submitted_ns);
+        free(pool->workers);
+        return -1;
+    }
+
+    for (int i = 0; i < max_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->workers[i].state = WORKER_FREE;
+        atomic_init(&pool->workers[i].client_fd, -1);
+    }
+
+    if (sched_init(pool) == -1) {
+        free(pool->submitted_ns);
+        free(pool->workers);
+        return -1;
+    }
+
+    // The manager sleeps on a monotonic clock so wall clock changes can't
+    // stall or rush it
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int result = pthread_cond_init(&pool->stop_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (result == 0) {
+        result = pthread_mutex_init(&pool->lock, NULL);
+        if (result)
+            pthread_cond_destroy(&pool->stop_cond);
+    }
+
+    if (result) {
+        fprintf(stderr, "Failed to initialize thread pool: %s\n", strerror(result));
+        sched_free(pool);
+        free(pool->submitted_ns);
+        free(pool->workers);
+        return -1;
+    }
+
+    // Start the minimum number of workers and the manager
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < min_threads && result == 0; i++)
+        result = spawn_worker(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (result == 0)
+        result = create_blocked_thread(&pool->manager, manager_func, pool);
+
+    if (result) {
+        sched_shutdown(pool);
+        join_workers(pool);
+        destroy_pool(pool);
+        return -1;
+    }
+
+    return 0;
+}
+
+int thread_pool_submit(thread_pool_t *pool, int client_fd) {
+    if (client_fd < pool->max_fds)
+        pool->submitted_ns[client_fd] = stats_now();
+
+    atomic_fetch_add(&pool->queued, 1);
+    if (sched_push(pool, client_fd) == -1) {
+        atomic_fetch_sub(&pool->queued, 1);
+        return -1;
+    }
+
+    // A burst is piling up behind busy workers, don't wait for the manager
+    if (atomic_load(&pool->queued) >= THREAD_POOL_GROW_DEPTH &&
+        atomic_load(&pool->busy) >= atomic_load(&pool->n_threads)) {
+        pthread_mutex_lock(&pool->lock);
+        spawn_worker(pool);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
+
+// Waits up to timeout_ms for every worker to exit, then cuts off any
+// connection still being served
+static void finish_workers(thread_pool_t *pool, int timeout_ms) {
+    // pthread_timedjoin_np() takes a CLOCK_REALTIME deadline
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int timed_out = 0;
+    for (int i = 0; i < pool->max_threads && !timed_out; i++) {
+        if (pool->workers[i].state == WORKER_FREE)
+            continue;
+
+        int result = pthread_timedjoin_np(pool->workers[i].thread, NULL, &deadline);
+        if (result == ETIMEDOUT) {
+            timed_out = 1;
+        } else {
+            if (result)
+                fprintf(stderr, "pthread_join: %s\n", strerror(result));
+            pool->workers[i].state = WORKER_FREE;
+        }
+    }
+    if (!timed_out)
+        return;
+
+    // Shutting a socket down fails any read or write blocked on it, so the
+    // worker returns promptly; connections still queued are closed unserved
+    atomic_store(&pool->abandon, 1);
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].state == WORKER_FREE)
+            continue;
+
+        // Only a connection claimed from its worker is shut down, as once the
+        // worker has released it the fd may already belong to something else
+        atomic_int *slot = &pool->workers[i].client_fd;
+        int client_fd = atomic_load(slot);
+        if (client_fd >= 0 && atomic_compare_exchange_strong(slot, &client_fd,
+                                                             CLIENT_FD_CLAIMED)) {
+            shutdown(client_fd, SHUT_RDWR);
+            stats_count(dropped, 1);
+            atomic_store(slot, client_fd);
+        }
+    }
+}
+
+int thread_pool_shutdown(thread_pool_t *pool, int timeout_ms) {
+    int ret_val = 0;
+
+    // Stop the manager first so no workers are added or retired meanwhile
+    // Shutting down the scheduler also frees it if it is blocked retiring
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_signal(&pool->stop_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (sched_shutdown(pool) == -1)
+        ret_val = -1;
+
+    int result = pthread_join(pool->manager, NULL);
+    if (result) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    finish_workers(pool, timeout_ms);
+    if (join_workers(pool) == -1)
+        ret_val = -1;
+
+    if (destroy_pool(pool) == -1)
+        ret_val = -1;
+
+    return ret_val;
+}
@@ -0,0 +1,113 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "connection_queue.h"
+#include "work_steal.h"
+
+#define THREAD_POOL_QUEUE_LEN 5         // Connections queued per scheduler queue
+#define THREAD_POOL_GROW_DEPTH 4        // Queued connections that add a worker at once
+#define THREAD_POOL_GROW_WAIT_MS 50     // Time connections may wait before a worker is added
+#define THREAD_POOL_IDLE_MS 5000        // Time workers may sit idle before one retires
+#define THREAD_POOL_TICK_MS 10          // How often the pool re-checks its size
+#define THREAD_POOL_TIMED_FDS 65536     // Most descriptors whose queue wait is timed
+
+// How the acceptor hands connections to workers
+typedef enum {
+    SCHED_QUEUE,  // One connection queue shared by every worker
+    SCHED_STEAL,  // Per-worker deques, idle workers steal from busy ones
+} scheduler_t;
+
+// Called by a worker to serve one connection, which is closed afterwards
+// taken_ns: When the worker took the connection off the queue, as read for
+// the queue wait statistics, or 0 if it wasn't timed
+typedef void (*thread_pool_handler_t)(int client_fd, uint64_t taken_ns);
+
+struct thread_pool;
+
+// One worker slot; slots are reused as workers come and go
+typedef enum {
+    WORKER_FREE,     // No thread
+    WORKER_RUNNING,  // Thread is serving connections
+    WORKER_EXITED,   // Thread retired and is waiting to be joined
+} worker_state_t;
+
+typedef struct {
+    struct thread_pool *pool;
+    int id;
+    worker_state_t state;
+    pthread_t thread;
+    atomic_int client_fd;   // Connection being served, -1, or CLIENT_FD_CLAIMED while
+                            // shutdown is shutting it down
+} pool_worker_t;
+
+// A pool of blocking workers that grows under load and shrinks when idle
+// Between min_threads and max_threads workers run at any time. The acceptor
+// adds a worker as soon as THREAD_POOL_GROW_DEPTH connections are waiting with
+// every worker busy, and a manager thread adds one when connections have been
+// waiting for THREAD_POOL_GROW_WAIT_MS or retires one after THREAD_POOL_IDLE_MS
+// of some workers doing nothing
+typedef struct thread_pool {
+    scheduler_t scheduler;
+    connection_queue_t queue;
+    steal_sched_t steal;
+    thread_pool_handler_t handler;
+    int min_threads;
+    int max_threads;
+
+    // Worker slots and manager state, protected by 'lock'
+    pool_worker_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t stop_cond;
+    int stopping;
+    pthread_t manager;
+
+    atomic_int n_threads;   // Running workers, changed only under 'lock'
+    atomic_int busy;        // Workers serving a connection
+    atomic_int queued;      // Connections submitted but not yet taken
+    atomic_int retiring;    // Retire requests not yet taken by a worker
+    atomic_int abandon;     // Set when shutdown runs out of time
+
+    // When each queued connection was submitted, indexed by descriptor, for
+    // those below 'max_fds'
+    // The queue's own synchronization makes the acceptor's write visible to
+    // the worker that takes the descriptor
+    uint64_t *submitted_ns;
+    int max_fds;
+} thread_pool_t;
+
+/*
+ * Initialize a thread pool and start its first min_threads workers. Threads
+ * are started with all signals blocked.
+ * pool: Pointer to thread_pool_t to be initialized
+ * scheduler: How connections are spread across workers
+ * min_threads: Workers kept running even when idle, at least 1
+ * max_threads: Upper bound on workers, at least min_threads
+ * handler: Function that serves one connection
+ * Returns 0 on success or -1 on error
+ */
+int thread_pool_init(thread_pool_t *pool, scheduler_t scheduler, int min_threads,
+                     int max_threads, thread_pool_handler_t handler);
+
+/*
+ * Queue a connection for a worker, adding a worker if the backlog calls for
+ * it. Blocks if the queue is full. Call right after accept(): the time spent
+ * queued is recorded from here.
+ * Returns 0 on success or -1 on error
+ */
+int thread_pool_submit(thread_pool_t *pool, int client_fd);
+
+/*
+ * Stop the pool: queued connections are still served, then all threads exit
+ * and are joined. Resources are released as well.
+ * timeout_ms: How long to wait for the workers to finish. After that,
+ * connections being served are shut down under them and queued ones are
+ * closed unserved, each counted as a dropped request.
+ * Returns 0 on success or -1 on error
+ */
+int thread_pool_shutdown(thread_pool_t *pool, int timeout_ms);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,1186 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "server_stats.h"
+#include "uring_loop.h"
+
+#define BUFSIZE 512
+#define SWEEP_INTERVAL_SEC 1
+#define BUF_GROUP 0
+
+// What a completion is for, kept in the low bits of its user_data next to the
+// connection it belongs to (connections are malloc()ed, so 16-byte aligned)
+typedef enum {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_TIMEOUT,
+    OP_CANCEL,
+    OP_RECV,
+    OP_SEND,
+    OP_STATX,
+    OP_OPEN,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+} op_t;
+#define OP_MASK 15
+
+// The kernel's side of the rings, mapped into our address space
+struct uring_ring {
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit;     // Queued but not yet passed to io_uring_enter()
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+
+    // Receive buffers handed to the kernel, which picks one per completion
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    unsigned short buf_tail;
+};
+
+// Where a connection is in its request/response cycle
+typedef enum {
+    CONN_READING_HEADERS,
+    CONN_LOOKING_UP,    // Waiting for statx and openat of a file not cached
+    CONN_WRITING,
+} conn_state_t;
+
+// Per-connection state, referenced by every operation in flight for it
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    http_conn_t http;
+    int n_requests;
+    int keep_alive;
+    long last_active;
+    http_response_t response;
+
+    int in_flight;      // Operations the kernel holds that refer to this
+    int closing;
+    int recv_armed;
+
+    // File lookup, submitted as a statx and an openat2 in one batch, or just
+    // the openat2 if the path cache knows the file
+    char path[BUFSIZE];
+    struct statx stx;
+    struct open_how how;
+    path_info_t info;
+    unsigned long generation;   // Path cache generation the lookup started in
+    int lookups_left;
+    int stat_result;
+    int open_result;
+    uint64_t start_ns;
+    http_conditions_t conditions;
+
+    // Sending, with the iovecs kept here until the kernel is done with them
+    struct iovec iov[2];
+    struct msghdr msg;
+    int pipe_fds[2];    // Created the first time a file is spliced
+    size_t pipe_bytes;  // Body bytes read into the pipe but not yet sent
+
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+// State owned by one loop thread, so no locking is needed
+// The connection list is kept in order of last activity, oldest first
+typedef struct {
+    uring_loop_t *loop;
+    struct uring_ring *ring;
+    conn_t *head;
+    conn_t *tail;
+    int n_conns;            // Including those closed but still referenced
+    int accept_armed;
+    int draining;           // Set once asked to stop: no more accepts or keep-alive
+    long deadline_ms;       // When draining gives up on the connections left
+    int pipe_size;
+    uint64_t wake_value;
+    struct __kernel_timespec sweep_interval;
+} loop_state_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return syscall(SYS_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(SYS_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static long now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t pack(void *ptr, op_t op) {
+    return (uintptr_t) ptr | op;
+}
+
+// Passes queued submissions to the kernel, optionally waiting for a completion
+// Returns 0 on success or -1 on error
+static int ring_submit(int ring_fd, struct uring_ring *ring, int wait) {
+    while (1) {
+        int result = sys_io_uring_enter(ring_fd, ring->to_submit, wait,
+                                        wait ? IORING_ENTER_GETEVENTS : 0);
+        if (result >= 0) {
+            ring->to_submit -= result;
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+// Returns a zeroed submission queue entry, flushing the queue if it is full,
+// or NULL on error
+static struct io_uring_sqe *get_sqe(loop_state_t *state) {
+    struct uring_ring *ring = state->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+    if (tail - head == ring->sq_entries) {
+        if (ring_submit(state->loop->ring_fd, ring, 0) == -1)
+            return NULL;
+        head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+        if (tail - head == ring->sq_entries) {
+            fprintf(stderr, "io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+
+    unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+// Hands a receive buffer back to the kernel
+static void recycle_buffer(struct uring_ring *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_LOOP_RECV_BUFS - 1)];
+    buf->addr = (uintptr_t) (ring->bufs + (size_t) bid * URING_LOOP_RECV_BUFSIZE);
+    buf->len = URING_LOOP_RECV_BUFSIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    atomic_store_explicit((_Atomic unsigned short *) &ring->buf_ring->tail, ring->buf_tail,
+                          memory_order_release);
+}
+
+static void list_remove(loop_state_t *state, conn_t *conn) {
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        state->head = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    else
+        state->tail = conn->prev;
+}
+
+static void list_append(loop_state_t *state, conn_t *conn) {
+    conn->prev = state->tail;
+    conn->next = NULL;
+    if (state->tail != NULL)
+        state->tail->next = conn;
+    else
+        state->head = conn;
+    state->tail = conn;
+}
+
+static void touch(loop_state_t *state, conn_t *conn) {
+    conn->last_active = now_sec();
+    list_remove(state, conn);
+    list_append(state, conn);
+}
+
+// Releases a closed connection once the kernel holds no more references to it
+static void conn_release(loop_state_t *state, conn_t *conn) {
+    if (!conn->closing || conn->in_flight > 0)
+        return;
+
+    if (conn->state == CONN_WRITING)
+        free_http_response(&conn->response);
+    if (conn->pipe_fds[0] != -1) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    if (close(conn->fd) == -1)
+        perror("close");
+
+    state->n_conns--;
+    free(conn);
+}
+
+// Starts closing a connection: shutting the socket down ends its multishot
+// receive, and anything else still queued on it is cancelled
+static void conn_close(loop_state_t *state, conn_t *conn) {
+    if (conn->closing)
+        return;
+    conn->closing = 1;
+    list_remove(state, conn);
+
+    if (conn->in_flight > 0) {
+        shutdown(conn->fd, SHUT_RDWR);
+        struct io_uring_sqe *sqe = get_sqe(state);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = pack(NULL, OP_CANCEL);
+        }
+    }
+
+    conn_release(state, conn);
+}
+
+// Returns 0 on success or -1 on error
+static int arm_recv(loop_state_t *state, conn_t *conn) {
+    struct io_uring_sqe *sqe = get_sqe(state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = pack(conn, OP_RECV);
+    conn->in_flight++;
+    conn->recv_armed = 1;
+    return 0;
+}
+
+static int arm_accept(loop_state_t *state) {
+    struct io_uring_sqe *sqe = get_sqe(state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = state->loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = pack(NULL, OP_ACCEPT);
+    state->accept_armed = 1;
+    return 0;
+}
+
+static int arm_wake(loop_state_t *state) {
+    struct io_uring_sqe *sqe = get_sqe(state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = state->loop->wake_fd;
+    sqe->addr = (uintptr_t) &state->wake_value;
+    sqe->len = sizeof(state->wake_value);
+    sqe->user_data = pack(NULL, OP_WAKE);
+    return 0;
+}
+
+static int arm_timeout(loop_state_t *state) {
+    struct io_uring_sqe *sqe = get_sqe(state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &state->sweep_interval;
+    sqe->len = 1;
+    sqe->user_data = pack(NULL, OP_TIMEOUT);
+    return 0;
+}
+
+// Queues the next piece of the response: headers and in-memory bodies go out
+// in one sendmsg, file bodies are spliced through the connection's pipe
+// Returns 0 if an operation was queued, 1 if the response is complete, or -1
+// on error
+static int queue_send(loop_state_t *state, conn_t *conn) {
+    http_response_t *response = &conn->response;
+    const char *body = http_response_body(response);
+    size_t headers_left = response->headers_len - response->headers_sent;
+    struct io_uring_sqe *sqe;
+
+    if (headers_left > 0 || (body != NULL && response->body_offset < response->body_end)) {
+        sqe = get_sqe(state);
+        if (sqe == NULL)
+            return -1;
+
+        int n_iov = 0;
+        if (headers_left > 0) {
+            conn->iov[n_iov].iov_base = response->headers + response->headers_sent;
+            conn->iov[n_iov++].iov_len = headers_left;
+        }
+        if (body != NULL && response->body_offset < response->body_end) {
+            conn->iov[n_iov].iov_base = (char *) body + response->body_offset;
+            conn->iov[n_iov++].iov_len = response->body_end - response->body_offset;
+        }
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = n_iov;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uintptr_t) &conn->msg;
+        // A file body follows straight after the headers
+        sqe->msg_flags = MSG_NOSIGNAL | (response->file_fd != -1 ? MSG_MORE : 0);
+        sqe->user_data = pack(conn, OP_SEND);
+        conn->in_flight++;
+        return 0;
+    }
+
+    if (response->file_fd == -1 || response->body_offset == response->body_end)
+        return 1;
+
+    if (conn->pipe_fds[0] == -1) {
+        if (pipe2(conn->pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            conn->pipe_fds[0] = -1;
+            return -1;
+        }
+        fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, URING_LOOP_PIPE_SIZE);
+    }
+
+    sqe = get_sqe(state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SPLICE;
+    if (conn->pipe_bytes > 0) {
+        // Drain the pipe into the socket
+        sqe->fd = conn->fd;
+        sqe->off = (uint64_t) -1;
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t) -1;
+        sqe->len = conn->pipe_bytes;
+        sqe->user_data = pack(conn, OP_SPLICE_OUT);
+    } else {
+        // Fill the pipe from the file
+        off_t remaining = response->body_end - response->body_offset;
+        sqe->fd = conn->pipe_fds[1];
+        sqe->off = (uint64_t) -1;
+        sqe->splice_fd_in = response->file_fd;
+        sqe->splice_off_in = response->body_offset;
+        sqe->len = remaining < state->pipe_size ? remaining : state->pipe_size;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = pack(conn, OP_SPLICE_IN);
+    }
+    conn->in_flight++;
+    return 0;
+}
+
+static void conn_send(loop_state_t *state, conn_t *conn);
+
+// Serves requests the connection has buffered until one needs the kernel
+static void conn_next_request(loop_state_t *state, conn_t *conn) {
+    uring_loop_t *loop = state->loop;
+
+    while (conn->state == CONN_READING_HEADERS) {
+        http_request_t request;
+        int result = next_http_request(&conn->http, &request);
+        if (result == 2) {
+            // Nothing more is coming once the loop is draining
+            if (state->draining && !http_conn_busy(&conn->http))
+                conn_close(state, conn);
+            return;
+        }
+        if (result == -1) {
+            conn_close(state, conn);
+            return;
+        }
+
+        conn->n_requests++;
+        conn->keep_alive = request.keep_alive && conn->n_requests < loop->max_requests &&
+                           !state->draining;
+
+        int target = resolve_http_target(&request, conn->path, BUFSIZE);
+        if (target == -1) {
+            if (prepare_bad_request_response(&conn->response) == -1) {
+                conn_close(state, conn);
+                return;
+            }
+            conn->keep_alive = 0;
+            conn->state = CONN_WRITING;
+            conn_send(state, conn);
+            return;
+        }
+        if (target != TARGET_FILE) {
+            if (prepare_stats_response(&conn->response, target == TARGET_STATS_JSON,
+                                       conn->keep_alive) == -1) {
+                stats_count(errors, 1);
+                conn_close(state, conn);
+                return;
+            }
+            conn->state = CONN_WRITING;
+            conn_send(state, conn);
+            return;
+        }
+
+        conn->start_ns = conn->http.parsed_ns;
+        stats_count(requests, 1);
+        http_request_conditions(&request, &conn->conditions);
+
+        // Cache hits are served from memory straight away
+        file_cache_entry_t *entry = loop->cache != NULL ? file_cache_find(loop->cache, conn->path)
+                                                        : NULL;
+        if (entry != NULL) {
+            if (prepare_entry_response(&conn->response, entry, loop->cache, &conn->conditions,
+                                       conn->keep_alive) == -1) {
+                stats_count(errors, 1);
+                conn_close(state, conn);
+                return;
+            }
+            conn->response.ready_ns = stats_time(STATS_OPEN, conn->start_ns);
+            conn->state = CONN_WRITING;
+            conn_send(state, conn);
+            return;
+        }
+
+        // Paths resolved lately only need opening, and those known not to
+        // resolve get a 404 straight away
+        int error;
+        conn->generation = path_cache_generation(loop->paths, conn->path);
+        int cached = path_cache_find(loop->paths, conn->path, &conn->info, &error);
+        if (cached && (error != 0 || !S_ISREG(conn->info.mode))) {
+            if (prepare_not_found_response(&conn->response, conn->keep_alive) == -1) {
+                stats_count(errors, 1);
+                conn_close(state, conn);
+                return;
+            }
+            conn->response.ready_ns = stats_time(STATS_OPEN, conn->start_ns);
+            conn->state = CONN_WRITING;
+            conn_send(state, conn);
+            return;
+        }
+
+        // Otherwise look the file up and open it at the same time
+        struct io_uring_sqe *stat_sqe = cached ? NULL : get_sqe(state);
+        struct io_uring_sqe *open_sqe = cached || stat_sqe != NULL ? get_sqe(state) : NULL;
+        if (open_sqe == NULL) {
+            if (stat_sqe != NULL) {
+                // Already queued; turn it into a no-op
+                stat_sqe->opcode = IORING_OP_NOP;
+                stat_sqe->user_data = pack(NULL, OP_CANCEL);
+            }
+            conn_close(state, conn);
+            return;
+        }
+
+        conn->stat_result = 0;
+        if (stat_sqe != NULL) {
+            stat_sqe->opcode = IORING_OP_STATX;
+            stat_sqe->fd = loop->paths->dir_fd;
+            stat_sqe->addr = (uintptr_t) conn->path;
+            stat_sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO;
+            stat_sqe->off = (uintptr_t) &conn->stx;
+            stat_sqe->user_data = pack(conn, OP_STATX);
+        }
+
+        // Like path_cache_open(), never opening anything outside the directory
+        open_sqe->fd = loop->paths->dir_fd;
+        open_sqe->addr = (uintptr_t) conn->path;
+        if (loop->paths->beneath) {
+            memset(&conn->how, 0, sizeof(conn->how));
+            conn->how.flags = O_RDONLY | O_CLOEXEC;
+            conn->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+            open_sqe->opcode = IORING_OP_OPENAT2;
+            open_sqe->len = sizeof(conn->how);
+            open_sqe->off = (uintptr_t) &conn->how;
+        } else {
+            open_sqe->opcode = IORING_OP_OPENAT;
+            open_sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+        open_sqe->user_data = pack(conn, OP_OPEN);
+
+        conn->lookups_left = cached ? 1 : 2;
+        conn->in_flight += conn->lookups_left;
+        conn->state = CONN_LOOKING_UP;
+    }
+}
+
+// Continues sending the current response, or moves on to the next request
+// once it is complete
+static void conn_send(loop_state_t *state, conn_t *conn) {
+    int result = queue_send(state, conn);
+    if (result == 0)
+        return;
+    if (result == -1) {
+        stats_count(errors, 1);
+        conn_close(state, conn);
+        return;
+    }
+
+    stats_time(STATS_SEND, conn->response.ready_ns);
+    free_http_response(&conn->response);
+    conn->state = CONN_READING_HEADERS;
+    if (!conn->keep_alive) {
+        conn_close(state, conn);
+        return;
+    }
+    conn_next_request(state, conn);
+}
+
+// Builds the response once both halves of a file lookup have completed
+static void conn_lookup_done(loop_state_t *state, conn_t *conn) {
+    int keep_alive = conn->keep_alive;
+    int file_fd = conn->open_result;
+    int result;
+
+    // Anything that doesn't resolve beneath the directory, or isn't a regular
+    // file, isn't there to be served
+    int error = conn->stat_result < 0 ? -conn->stat_result : file_fd < 0 ? -file_fd : 0;
+    if ((error != 0 && path_error_not_found(error)) ||
+        (error == 0 && !S_ISREG(conn->info.mode))) {
+        if (file_fd >= 0)
+            close(file_fd);
+        result = prepare_not_found_response(&conn->response, keep_alive);
+    } else if (conn->stat_result < 0 || file_fd < 0) {
+        int error = conn->stat_result < 0 ? conn->stat_result : file_fd;
+        fprintf(stderr, "%s: %s\n", conn->stat_result < 0 ? "statx" : "openat", strerror(-error));
+        if (file_fd >= 0)
+            close(file_fd);
+        result = -1;
+    } else {
+        // The file is handed to the cache, so later requests for it make no
+        // system calls to look it up. Files small enough are read in now,
+        // while fresh in the page cache; that read blocks the loop, but only
+        // once per version of the file. Larger ones are kept open.
+        file_cache_entry_t *entry = NULL;
+        if (state->loop->cache != NULL)
+            entry = file_cache_adopt(state->loop->cache, conn->path, file_fd);
+
+        if (entry != NULL) {
+            result = prepare_entry_response(&conn->response, entry, state->loop->cache,
+                                            &conn->conditions, keep_alive);
+        } else {
+            http_file_info_t info = { conn->info.size, conn->info.mtime, conn->info.ino };
+            result = prepare_file_response(&conn->response, conn->path, file_fd, &info,
+                                           &conn->conditions, keep_alive);
+        }
+    }
+
+    if (result == -1) {
+        stats_count(errors, 1);
+        conn->state = CONN_READING_HEADERS;
+        conn_close(state, conn);
+        return;
+    }
+
+    conn->response.ready_ns = stats_time(STATS_OPEN, conn->start_ns);
+    conn->state = CONN_WRITING;
+    conn_send(state, conn);
+}
+
+static void handle_accept(loop_state_t *state, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        state->accept_armed = 0;
+
+    // Shutting the listening socket down when draining fails the accept
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && cqe->res != -ECONNABORTED && cqe->res != -EINTR &&
+            !(state->draining && cqe->res == -EINVAL))
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    // Accepted before the cancellation took effect, so treated like those
+    // left in the backlog
+    if (state->draining) {
+        close(cqe->res);
+        return;
+    }
+
+    conn_t *conn = malloc(sizeof(conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close(cqe->res);
+        return;
+    }
+
+    conn->fd = cqe->res;
+    conn->state = CONN_READING_HEADERS;
+    http_conn_init(&conn->http, conn->fd);
+    conn->n_requests = 0;
+    conn->keep_alive = 0;
+    conn->last_active = now_sec();
+    conn->in_flight = 0;
+    conn->closing = 0;
+    conn->recv_armed = 0;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    conn->pipe_bytes = 0;
+    list_append(state, conn);
+    state->n_conns++;
+
+    if (arm_recv(state, conn) == -1)
+        conn_close(state, conn);
+}
+
+static void handle_recv(loop_state_t *state, conn_t *conn, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->in_flight--;
+        conn->recv_armed = 0;
+    }
+
+    // The buffer goes back to the kernel whether or not the data is wanted
+    int appended = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->closing && cqe->res > 0)
+            appended = http_conn_append(&conn->http, state->ring->bufs +
+                                        (size_t) bid * URING_LOOP_RECV_BUFSIZE, cqe->res);
+        recycle_buffer(state->ring, bid);
+    }
+
+    if (conn->closing) {
+        conn_release(state, conn);
+        return;
+    }
+
+    if (cqe->res == -ENOBUFS) {
+        // Every buffer was in use; they have been handed back by now
+        if (!conn->recv_armed && arm_recv(state, conn) == -1)
+            conn_close(state, conn);
+        return;
+    }
+
+    if (cqe->res == 0 || appended == -1) {
+        // Client closed the connection, or sent more than fits
+        conn_close(state, conn);
+        return;
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNRESET)
+            fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+        conn_close(state, conn);
+        return;
+    }
+
+    touch(state, conn);
+    if (!conn->recv_armed && arm_recv(state, conn) == -1) {
+        conn_close(state, conn);
+        return;
+    }
+
+    // Pipelined requests wait in the buffer until the response before them
+    // has been written
+    if (conn->state == CONN_READING_HEADERS)
+        conn_next_request(state, conn);
+}
+
+static void handle_send(loop_state_t *state, conn_t *conn, struct io_uring_cqe *cqe, op_t op) {
+    conn->in_flight--;
+    if (conn->closing) {
+        conn_release(state, conn);
+        return;
+    }
+
+    http_response_t *response = &conn->response;
+    if (cqe->res < 0 || (op == OP_SPLICE_IN && cqe->res == 0)) {
+        if (cqe->res == 0)
+            fprintf(stderr, "splice: unexpected end of file\n");
+        else if (cqe->res != -EPIPE && cqe->res != -ECONNRESET)
+            fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+        stats_count(errors, 1);
+        conn_close(state, conn);
+        return;
+    }
+
+    size_t bytes = cqe->res;
+    if (op == OP_SEND) {
+        size_t headers_left = response->headers_len - response->headers_sent;
+        size_t from_headers = bytes < headers_left ? bytes : headers_left;
+        response->headers_sent += from_headers;
+        response->body_offset += bytes - from_headers;
+        stats_count(bytes_sent, bytes);
+    } else if (op == OP_SPLICE_IN) {
+        conn->pipe_bytes += bytes;
+    } else {
+        conn->pipe_bytes -= bytes;
+        response->body_offset += bytes;
+        stats_count(bytes_sent, bytes);
+    }
+
+    touch(state, conn);
+    conn_send(state, conn);
+}
+
+static void handle_lookup(loop_state_t *state, conn_t *conn, struct io_uring_cqe *cqe, op_t op) {
+    conn->in_flight--;
+    if (op == OP_STATX) {
+        // Remember how the path resolved for later requests
+        conn->stat_result = cqe->res;
+        if (cqe->res == 0) {
+            conn->info.mode = conn->stx.stx_mode;
+            conn->info.size = conn->stx.stx_size;
+            conn->info.mtime.tv_sec = conn->stx.stx_mtime.tv_sec;
+            conn->info.mtime.tv_nsec = conn->stx.stx_mtime.tv_nsec;
+            conn->info.ino = conn->stx.stx_ino;
+        }
+        path_cache_record(state->loop->paths, conn->path, &conn->info, -cqe->res,
+                          conn->generation);
+    } else {
+        conn->open_result = cqe->res;
+    }
+
+    if (--conn->lookups_left > 0)
+        return;
+
+    if (conn->closing) {
+        if (conn->open_result >= 0)
+            close(conn->open_result);
+        conn->state = CONN_READING_HEADERS;
+        conn_release(state, conn);
+        return;
+    }
+    conn_lookup_done(state, conn);
+}
+
+// Closes connections that have made no progress within the idle timeout
+static void close_idle_connections(loop_state_t *state) {
+    long cutoff = now_sec() - state->loop->idle_timeout;
+    while (state->head != NULL && state->head->last_active <= cutoff)
+        conn_close(state, state->head);
+}
+
+// Stops accepting and closes the connections that are waiting for a request,
+// leaving those with one under way to finish
+static void start_draining(loop_state_t *state) {
+    state->draining = 1;
+    state->deadline_ms = now_ms() + state->loop->drain_timeout * 1000L;
+
+    // Shutting the listening socket down stops it listening, so new
+    // connections are refused and those in the backlog are reset
+    shutdown(state->loop->listen_fd, SHUT_RD);
+    if (state->accept_armed) {
+        struct io_uring_sqe *sqe = get_sqe(state);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = state->loop->listen_fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD;
+            sqe->user_data = pack(NULL, OP_CANCEL);
+        }
+    }
+
+    conn_t *conn = state->head;
+    while (conn != NULL) {
+        conn_t *next = conn->next;
+        if (conn->state == CONN_READING_HEADERS && !http_conn_busy(&conn->http))
+            conn_close(state, conn);
+        conn = next;
+    }
+}
+
+// Handles every completion the kernel has posted
+// Returns 0 to keep going or 1 once the loop should stop
+static int reap(loop_state_t *state) {
+    struct uring_ring *ring = state->ring;
+    int stop = 0;
+
+    unsigned head = *ring->cq_head;
+    while (1) {
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail,
+                                             memory_order_acquire);
+        if (head == tail)
+            break;
+
+        // Copy the entry out so its slot can be reused right away
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        head++;
+        atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head, memory_order_release);
+
+        conn_t *conn = (conn_t *) (uintptr_t) (cqe.user_data & ~(uint64_t) OP_MASK);
+        op_t op = cqe.user_data & OP_MASK;
+        switch (op) {
+        case OP_ACCEPT:
+            handle_accept(state, &cqe);
+            break;
+        case OP_WAKE:
+            if (!state->draining)
+                start_draining(state);
+            break;
+        case OP_TIMEOUT:
+            close_idle_connections(state);
+            // Wake up in time for the drain deadline
+            if (state->draining) {
+                long remaining = state->deadline_ms - now_ms();
+                if (remaining > 0 && remaining < SWEEP_INTERVAL_SEC * 1000) {
+                    state->sweep_interval.tv_sec = 0;
+                    state->sweep_interval.tv_nsec = remaining * 1000000;
+                }
+            }
+            if (arm_timeout(state) == -1)
+                stop = 1;
+            break;
+        case OP_CANCEL:
+            break;
+        case OP_RECV:
+            handle_recv(state, conn, &cqe);
+            break;
+        case OP_STATX:
+        case OP_OPEN:
+            handle_lookup(state, conn, &cqe, op);
+            break;
+        case OP_SEND:
+        case OP_SPLICE_IN:
+        case OP_SPLICE_OUT:
+            handle_send(state, conn, &cqe, op);
+            break;
+        }
+    }
+
+    // Done once the connections have finished, or time has run out on them
+    if (state->draining && (state->head == NULL || now_ms() >= state->deadline_ms))
+        stop = 1;
+    return stop;
+}
+
+void *uring_loop_func(void *arg) {
+    loop_state_t state;
+    state.loop = (uring_loop_t *) arg;
+    state.ring = state.loop->ring;
+    state.head = NULL;
+    state.tail = NULL;
+    state.n_conns = 0;
+    state.accept_armed = 0;
+    state.draining = 0;
+    state.sweep_interval.tv_sec = SWEEP_INTERVAL_SEC;
+    state.sweep_interval.tv_nsec = 0;
+
+    // Splices move at most a pipe's worth of the file at a time
+    int pipe_fds[2];
+    state.pipe_size = 1 << 16;
+    if (pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        int size = fcntl(pipe_fds[1], F_SETPIPE_SZ, URING_LOOP_PIPE_SIZE);
+        if (size > 0)
+            state.pipe_size = size;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+
+    int keep_going = arm_accept(&state) == 0 && arm_wake(&state) == 0 &&
+                     arm_timeout(&state) == 0;
+    while (keep_going) {
+        // A multishot accept ends if, say, too many files are open
+        if (!state.accept_armed && !state.draining && arm_accept(&state) == -1)
+            break;
+
+        // Submit everything queued and wait for at least one completion
+        if (ring_submit(state.loop->ring_fd, state.ring, 1) == -1)
+            break;
+
+        if (reap(&state))
+            keep_going = 0;
+    }
+
+    // Close any connections still open, which didn't finish in time, and
+    // wait until the kernel has let go of them
+    while (state.head != NULL) {
+        if (state.head->state != CONN_READING_HEADERS || http_conn_busy(&state.head->http))
+            stats_count(dropped, 1);
+        conn_close(&state, state.head);
+    }
+    while (state.n_conns > 0) {
+        if (ring_submit(state.loop->ring_fd, state.ring, 1) == -1)
+            break;
+        reap(&state);
+    }
+
+    return NULL;
+}
+
+// Unmaps whatever parts of a ring have been mapped
+static void unmap_ring(struct uring_ring *ring) {
+    if (ring->bufs != NULL)
+        munmap(ring->bufs, (size_t) URING_LOOP_RECV_BUFS * URING_LOOP_RECV_BUFSIZE);
+    if (ring->buf_ring != NULL)
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_len);
+}
+
+// Maps the rings of a newly set up io_uring instance
+// Returns 0 on success or -1 on error
+static int map_ring(struct uring_ring *ring, int ring_fd, const struct io_uring_params *params) {
+    ring->sq_map_len = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params->sq_entries * sizeof(struct io_uring_sqe);
+
+    // Both rings may share one mapping
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len)
+            ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            perror("mmap");
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *) (sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params->sq_off.array);
+    ring->sq_entries = params->sq_entries;
+    ring->to_submit = 0;
+
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *) (cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+    return 0;
+}
+
+// Registers the ring of receive buffers the kernel picks from
+// Returns 0 on success or -1 on error
+static int setup_buffers(struct uring_ring *ring, int ring_fd) {
+    ring->buf_ring_len = URING_LOOP_RECV_BUFS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    ring->bufs = mmap(NULL, (size_t) URING_LOOP_RECV_BUFS * URING_LOOP_RECV_BUFSIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) ring->buf_ring;
+    reg.ring_entries = URING_LOOP_RECV_BUFS;
+    reg.bgid = BUF_GROUP;
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    ring->buf_tail = 0;
+    for (int i = 0; i < URING_LOOP_RECV_BUFS; i++)
+        recycle_buffer(ring, i);
+    return 0;
+}
+
+// Sets up an io_uring instance, preferring to run completion work only when
+// the loop enters the kernel anyway
+// Returns the ring's descriptor or -1 on error
+static int setup_ring(struct io_uring_params *params) {
+    memset(params, 0, sizeof(*params));
+    params->flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params->cq_entries = URING_LOOP_CQ_ENTRIES;
+    int ring_fd = sys_io_uring_setup(URING_LOOP_ENTRIES, params);
+    if (ring_fd == -1 && errno == EINVAL) {
+        // Cooperative task running arrived in 5.19
+        memset(params, 0, sizeof(*params));
+        params->flags = IORING_SETUP_CQSIZE;
+        params->cq_entries = URING_LOOP_CQ_ENTRIES;
+        ring_fd = sys_io_uring_setup(URING_LOOP_ENTRIES, params);
+    }
+    return ring_fd;
+}
+
+int uring_supported(void) {
+    struct io_uring_params params;
+    int ring_fd = setup_ring(&params);
+    if (ring_fd == -1)
+        return 0;
+
+    // Completions must never be dropped when the completion queue is full
+    int supported = (params.features & IORING_FEAT_NODROP) != 0;
+
+    // IORING_OP_SEND_ZC arrived in the same release as multishot receive,
+    // which can't be probed for directly
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_STATX,
+        IORING_OP_OPENAT, IORING_OP_OPENAT2, IORING_OP_SPLICE, IORING_OP_TIMEOUT, IORING_OP_READ,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC,
+    };
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (probe == NULL ||
+        sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        supported = 0;
+    } else {
+        for (int i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op ||
+                !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = 0;
+        }
+    }
+
+    free(probe);
+    close(ring_fd);
+    return supported;
+}
+
+int uring_loop_init(uring_loop_t *loop, int listen_fd, path_cache_t *paths,
+                    file_cache_t *cache, int idle_timeout, int max_requests,
+                    int drain_timeout) {
+    loop->listen_fd = listen_fd;
+    loop->paths = paths;
+    loop->cache = cache;
+    loop->idle_timeout = idle_timeout;
+    loop->max_requests = max_requests;
+    loop->drain_timeout = drain_timeout;
+
+    loop->ring = calloc(1, sizeof(struct uring_ring));
+    if (loop->ring == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    struct io_uring_params params;
+    loop->ring_fd = setup_ring(&params);
+    if (loop->ring_fd == -1) {
+        perror("io_uring_setup");
+        free(loop->ring);
+        return -1;
+    }
+
+    if (map_ring(loop->ring, loop->ring_fd, &params) == -1 ||
+        setup_buffers(loop->ring, loop->ring_fd) == -1) {
+        unmap_ring(loop->ring);
+        close(loop->ring_fd);
+        free(loop->ring);
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        perror("eventfd");
+        unmap_ring(loop->ring);
+        close(loop->ring_fd);
+        free(loop->ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+int uring_loop_start(uring_loop_t *loop) {
+    int result = pthread_create(&loop->thread, NULL, uring_loop_func, loop);
+    if (result) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return -1;
+    }
+    return 0;
+}
+
+int uring_loop_drain(uring_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+int uring_loop_stop(uring_loop_t *loop) {
+    int ret_val = 0;
+
+    if (uring_loop_drain(loop) == -1)
+        ret_val = -1;
+
+    int result = pthread_join(loop->thread, NULL);
+    if (result) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
+
+int uring_loop_free(uring_loop_t *loop) {
+    int ret_val = 0;
+
+    if (close(loop->wake_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+
+    // Closing the ring cancels whatever is still queued, such as the accept
+    unmap_ring(loop->ring);
+    if (close(loop->ring_fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+    free(loop->ring);
+
+    return ret_val;
+}
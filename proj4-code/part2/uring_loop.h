@@ -0,0 +1,91 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <pthread.h>
+
+#include "file_cache.h"
+
+struct uring_ring;
+
+#define URING_LOOP_ENTRIES 256          // Submission queue slots
+#define URING_LOOP_CQ_ENTRIES 4096      // Completion queue slots
+#define URING_LOOP_RECV_BUFS 256        // Receive buffers shared by a loop's connections
+#define URING_LOOP_RECV_BUFSIZE 4096
+#define URING_LOOP_PIPE_SIZE (256 << 10)    // Pipe capacity asked for when splicing files
+
+// A single-threaded HTTP server loop driven by io_uring
+// Like event_loop_t, each loop owns its own listening socket (normally bound
+// with SO_REUSEPORT) and serves any number of connections from one thread,
+// but instead of waiting for readiness it hands the kernel the work itself:
+// one multishot accept, one multishot receive per connection into a ring of
+// provided buffers, and statx/openat/splice/sendmsg for responses. Most
+// iterations submit everything queued and wait for completions in a single
+// system call.
+typedef struct {
+    int listen_fd;
+    int ring_fd;
+    int wake_fd;    // eventfd written to ask the loop to stop
+    path_cache_t *paths;    // Resolves paths within the served directory
+    file_cache_t *cache;
+    int idle_timeout;   // Seconds a connection may go without progress
+    int max_requests;   // Requests served on one connection before closing it
+    int drain_timeout;  // Seconds connections get to finish once stopping
+    pthread_t thread;
+
+    // Submission/completion rings and provided buffers, used only by the
+    // loop thread once started
+    struct uring_ring *ring;
+} uring_loop_t;
+
+/*
+ * Check whether the running kernel supports everything a uring_loop_t needs
+ * (io_uring with multishot accept/receive and provided buffer rings, 6.0 or
+ * later). io_uring may also be missing or turned off by sysctl or seccomp.
+ * Returns 1 if it does, 0 if it doesn't
+ */
+int uring_supported(void);
+
+/*
+ * Initialize an io_uring event loop
+ * loop: Pointer to uring_loop_t to be initialized
+ * listen_fd: Listening socket the loop accepts connections from
+ * paths: Resolves paths within the directory the resources are served from
+ * cache: File cache to serve from, or NULL
+ * idle_timeout: Seconds after which a connection making no progress is closed
+ * max_requests: Number of keep-alive requests served on one connection
+ * drain_timeout: Seconds requests under way get to finish once the loop is
+ * asked to stop
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_init(uring_loop_t *loop, int listen_fd, path_cache_t *paths,
+                    file_cache_t *cache, int idle_timeout, int max_requests,
+                    int drain_timeout);
+
+/*
+ * Start running a loop on a new thread
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_start(uring_loop_t *loop);
+
+/*
+ * Ask a running loop to drain without waiting for it, the way
+ * event_loop_drain() does
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_drain(uring_loop_t *loop);
+
+/*
+ * Drain a running loop, if not already asked to, and wait for its thread to
+ * exit
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_stop(uring_loop_t *loop);
+
+/*
+ * Deallocates the resources associated with a loop. The listening socket is
+ * not closed.
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_free(uring_loop_t *loop);
+
+#endif // URING_LOOP_H
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "work_steal.h"
+
+// Adds a connection to the back of a deque
+// Returns 0 on success or -1 if the deque is full
+static int deque_push_back(worker_deque_t *deque, int fd) {
+    int result = pthread_mutex_lock(&deque->lock);
+    if (result) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
+        return -1;
+    }
+
+    int ret_val = -1;
+    if (deque->length < deque->capacity) {
+        deque->client_fds[(deque->head + deque->length) % deque->capacity] = fd;
+        deque->length++;
+        ret_val = 0;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return ret_val;
+}
+
+// Takes the oldest connection from a deque, for its owner
+// Returns the connection or -1 if the deque is empty
+static int deque_pop_front(worker_deque_t *deque) {
+    int result = pthread_mutex_lock(&deque->lock);
+    if (result) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
+        return -1;
+    }
+
+    int fd = -1;
+    if (deque->length > 0) {
+        fd = deque->client_fds[deque->head];
+        if (++deque->head == deque->capacity)
+            deque->head = 0;
+        deque->length--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return fd;
+}
+
+// Takes the newest connection from a deque, for a thief
+// Returns the connection or -1 if the deque is empty
+static int deque_pop_back(worker_deque_t *deque) {
+    // Peek without the lock so idle thieves don't bounce the cache line of
+    // every empty deque; a stale answer is settled under the lock
+    if (__atomic_load_n(&deque->length, __ATOMIC_RELAXED) == 0)
+        return -1;
+
+    int result = pthread_mutex_lock(&deque->lock);
+    if (result) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
+        return -1;
+    }
+
+    int fd = -1;
+    if (deque->length > 0) {
+        deque->length--;
+        fd = deque->client_fds[(deque->head + deque->length) % deque->capacity];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return fd;
+}
+
+// Tries every deque starting from the round-robin position, first only the
+// deques of active workers and then any deque at all
+// Returns 0 on success or -1 if all deques are full
+static int try_push(steal_sched_t *sched, int fd) {
+    unsigned start = atomic_fetch_add(&sched->next, 1);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < sched->n_workers; i++) {
+            worker_deque_t *deque = &sched->deques[(start + i) % sched->n_workers];
+            if (pass == 0 && !atomic_load(&deque->active))
+                continue;
+            if (deque_push_back(deque, fd) == 0)
+                return 0;
+        }
+    }
+    return -1;
+}
+
+// Tries the worker's own deque, then steals from the others
+// Returns a connection or -1 if no work was found
+static int try_pop(steal_sched_t *sched, int worker) {
+    int fd = deque_pop_front(&sched->deques[worker]);
+    for (int i = 1; fd == -1 && i < sched->n_workers; i++)
+        fd = deque_pop_back(&sched->deques[(worker + i) % sched->n_workers]);
+    return fd;
+}
+
+// Wakes one thread sleeping on 'cond' if the waiter count says there is one
+static void wake_one(steal_sched_t *sched, atomic_int *waiters, pthread_cond_t *cond) {
+    if (atomic_load(waiters) == 0)
+        return;
+
+    pthread_mutex_lock(&sched->idle_lock);
+    int result = pthread_cond_signal(cond);
+    if (result)
+        fprintf(stderr, "pthread_cond_signal: %s\n", strerror(result));
+    pthread_mutex_unlock(&sched->idle_lock);
+}
+
+int steal_sched_init(steal_sched_t *sched, int n_workers, int capacity) {
+    int result;
+
+    sched->n_workers = n_workers;
+    atomic_init(&sched->next, 0);
+    atomic_init(&sched->pending, 0);
+    atomic_init(&sched->idle_workers, 0);
+    atomic_init(&sched->blocked_pushers, 0);
+    atomic_init(&sched->shutdown, 0);
+
+    sched->deques = aligned_alloc(_Alignof(worker_deque_t), n_workers * sizeof(worker_deque_t));
+    if (sched->deques == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+
+    for (int i = 0; i < n_workers; i++) {
+        worker_deque_t *deque = &sched->deques[i];
+        deque->capacity = capacity;
+        deque->head = 0;
+        deque->length = 0;
+        atomic_init(&deque->active, 0);
+        deque->client_fds = malloc(capacity * sizeof(int));
+        result = deque->client_fds == NULL ? -1 : pthread_mutex_init(&deque->lock, NULL);
+        if (result) {
+            fprintf(stderr, "Failed to initialize worker deque\n");
+            free(deque->client_fds);
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&sched->deques[j].lock);
+                free(sched->deques[j].client_fds);
+            }
+            free(sched->deques);
+            return -1;
+        }
+    }
+
+    result = pthread_mutex_init(&sched->idle_lock, NULL);
+    if (result == 0) {
+        result = pthread_cond_init(&sched->work_available, NULL);
+        if (result == 0) {
+            result = pthread_cond_init(&sched->space_available, NULL);
+            if (result)
+                pthread_cond_destroy(&sched->work_available);
+        }
+        if (result)
+            pthread_mutex_destroy(&sched->idle_lock);
+    }
+
+    if (result) {
+        fprintf(stderr, "Failed to initialize scheduler: %s\n", strerror(result));
+        for (int i = 0; i < n_workers; i++) {
+            pthread_mutex_destroy(&sched->deques[i].lock);
+            free(sched->deques[i].client_fds);
+        }
+        free(sched->deques);
+        return -1;
+    }
+
+    return 0;
+}
+
+void steal_sched_set_active(steal_sched_t *sched, int worker, int active) {
+    atomic_store(&sched->deques[worker].active, active);
+}
+
+int steal_sched_push(steal_sched_t *sched, int connection_fd) {
+    while (try_push(sched, connection_fd) == -1) {
+        pthread_mutex_lock(&sched->idle_lock);
+
+        // Register, then look again so a pop that happened in between
+        // can't be missed
+        atomic_fetch_add(&sched->blocked_pushers, 1);
+        int pushed = try_push(sched, connection_fd) == 0;
+        while (!pushed && !atomic_load(&sched->shutdown)) {
+            pthread_cond_wait(&sched->space_available, &sched->idle_lock);
+            pushed = try_push(sched, connection_fd) == 0;
+        }
+        atomic_fetch_sub(&sched->blocked_pushers, 1);
+
+        pthread_mutex_unlock(&sched->idle_lock);
+        if (!pushed)
+            return -1;
+        break;
+    }
+
+    atomic_fetch_add(&sched->pending, 1);
+    wake_one(sched, &sched->idle_workers, &sched->work_available);
+    return 0;
+}
+
+int steal_sched_pop(steal_sched_t *sched, int worker) {
+    while (1) {
+        int fd = try_pop(sched, worker);
+        if (fd != -1) {
+            atomic_fetch_sub(&sched->pending, 1);
+            wake_one(sched, &sched->blocked_pushers, &sched->space_available);
+            return fd;
+        }
+
+        // Nothing anywhere, sleep until a push says otherwise
+        pthread_mutex_lock(&sched->idle_lock);
+        atomic_fetch_add(&sched->idle_workers, 1);
+        while (atomic_load(&sched->pending) == 0 && !atomic_load(&sched->shutdown))
+            pthread_cond_wait(&sched->work_available, &sched->idle_lock);
+        atomic_fetch_sub(&sched->idle_workers, 1);
+        pthread_mutex_unlock(&sched->idle_lock);
+
+        // Exit when no work is left instead of blocking on shutdown
+        if (atomic_load(&sched->shutdown) && atomic_load(&sched->pending) == 0)
+            return -1;
+    }
+}
+
+int steal_sched_shutdown(steal_sched_t *sched) {
+    int ret_val = 0;
+    int result;
+
+    pthread_mutex_lock(&sched->idle_lock);
+    atomic_store(&sched->shutdown, 1);
+
+    // Broadcast to threads
+    result = pthread_cond_broadcast(&sched->work_available);
+    if (result) {
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    result = pthread_cond_broadcast(&sched->space_available);
+    if (result) {
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    pthread_mutex_unlock(&sched->idle_lock);
+    return ret_val;
+}
+
+int steal_sched_free(steal_sched_t *sched) {
+    int ret_val = 0;
+    int result;
+
+    for (int i = 0; i < sched->n_workers; i++) {
+        result = pthread_mutex_destroy(&sched->deques[i].lock);
+        if (result) {
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+            ret_val = -1;
+        }
+        free(sched->deques[i].client_fds);
+    }
+    free(sched->deques);
+
+    result = pthread_mutex_destroy(&sched->idle_lock);
+    if (result) {
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    result = pthread_cond_destroy(&sched->work_available);
+    if (result) {
+        fprintf(stderr, "pthread_cond_destroy: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    result = pthread_cond_destroy(&sched->space_available);
+    if (result) {
+        fprintf(stderr, "pthread_cond_destroy: %s\n", strerror(result));
+        ret_val = -1;
+    }
+
+    return ret_val;
+}
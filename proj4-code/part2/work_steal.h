@@ -0,0 +1,86 @@
+#ifndef WORK_STEAL_H
+#define WORK_STEAL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A bounded double-ended queue of client sockets owned by one worker
+// The owner takes from the front (oldest first, so no connection starves)
+// and thieves take from the back, keeping the two apart when both are busy
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    int *client_fds;
+    int capacity;
+    int head;
+    int length;
+    atomic_int active;  // Whether a worker is currently serving this deque
+} worker_deque_t;
+
+// Scheduler that spreads connections round-robin across per-worker deques
+// Workers serve their own deque first and steal from the others when it runs
+// dry, so there is no single queue lock shared by every thread
+typedef struct {
+    worker_deque_t *deques;
+    int n_workers;
+    atomic_uint next;   // Round-robin position of the next push
+
+    // Connections queued across all deques, and threads sleeping on them
+    atomic_int pending;
+    atomic_int idle_workers;
+    atomic_int blocked_pushers;
+    atomic_int shutdown;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+    pthread_cond_t space_available;
+} steal_sched_t;
+
+/*
+ * Initialize a work-stealing scheduler
+ * sched: Pointer to steal_sched_t to be initialized
+ * n_workers: Number of worker threads, each with its own deque
+ * capacity: Maximum number of connections in each deque
+ * Returns 0 on success or -1 on error
+ */
+int steal_sched_init(steal_sched_t *sched, int n_workers, int capacity);
+
+/*
+ * Mark whether a worker is running to serve its deque. Pushes prefer the
+ * deques of active workers; anything left in an inactive deque is still
+ * served by stealing.
+ * worker: Index of the worker
+ * active: Nonzero if the worker is running
+ */
+void steal_sched_set_active(steal_sched_t *sched, int worker, int active);
+
+/*
+ * Hand a new connection to the next active worker in round-robin order,
+ * skipping workers whose deques are full. Blocks if every deque is full. If the
+ * scheduler is shut down, then no addition takes place and an error is
+ * returned.
+ * Returns 0 on success or -1 on error
+ */
+int steal_sched_push(steal_sched_t *sched, int connection_fd);
+
+/*
+ * Take a connection for a worker: from its own deque if possible, otherwise
+ * stolen from another worker's. Blocks while there is no work anywhere. Once
+ * the scheduler is shut down and all queued connections are taken, returns
+ * an error.
+ * worker: Index of the calling worker
+ * Returns the socket file descriptor on success or -1 on error
+ */
+int steal_sched_pop(steal_sched_t *sched, int worker);
+
+/*
+ * Wake every blocked thread and make further blocking calls fail
+ * Returns 0 on success or -1 on error
+ */
+int steal_sched_shutdown(steal_sched_t *sched);
+
+/*
+ * Deallocates the scheduler's deques and synchronization primitives
+ * Returns 0 on success or -1 on error
+ */
+int steal_sched_free(steal_sched_t *sched);
+
+#endif // WORK_STEAL_H